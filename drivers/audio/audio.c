@@ -26,6 +26,8 @@
 #define PWM_PIN1 (PWM_PIN0+1)
 
 #include "audio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 
 #ifdef AUDIO_PWM_PIN
 #include "hardware/pwm.h"
@@ -47,11 +49,56 @@ i2s_config_t i2s_get_default_config(void) {
         .dma_buf = NULL,
         .dma_trans_count = 0,
         .volume = 0,
+        .dma_head = 0,
+        .dma_tail = 0,
+        .dma_playing = 0,
+        .dma_underruns = 0,
+        .dma_fill = 0,
+        .drc_pos = 0,
+        .drc_step = 1 << 16,
+        .drc_last = { 0, 0 },
 	};
 
     return i2s_config;
 }
 
+static i2s_config_t *dma_ring = NULL;
+static uint32_t dma_silence[I2S_DMA_SILENCE_WORDS];
+
+static inline uint32_t *i2s_dma_buffer(const i2s_config_t *i2s_config, uint8_t index) {
+    return (uint32_t *)i2s_config->dma_buf + (index & (I2S_DMA_BUFFERS - 1)) * i2s_config->dma_trans_count;
+}
+
+/**
+ * Chains the next queued buffer when one finishes. With none queued the last sample is held,
+ * so a late frame is a short flat spot instead of a click, and the ring restarts as soon as
+ * a buffer arrives.
+ */
+static void __not_in_flash_func(i2s_dma_handler)(void) {
+    i2s_config_t *i2s_config = dma_ring;
+    dma_irqn_acknowledge_channel(I2S_DMA_IRQ - DMA_IRQ_0, i2s_config->dma_channel);
+    const uint8_t head = i2s_config->dma_head;
+
+    if (i2s_config->dma_playing) {
+        const uint32_t last = i2s_dma_buffer(i2s_config, i2s_config->dma_tail)[i2s_config->dma_trans_count - 1];
+        i2s_config->dma_tail++;
+        if (head == i2s_config->dma_tail) {
+            for (int i = 0; i < I2S_DMA_SILENCE_WORDS; i++)
+                dma_silence[i] = last;
+            i2s_config->dma_underruns++;
+        }
+    }
+
+    i2s_config->dma_playing = head != i2s_config->dma_tail;
+    if (i2s_config->dma_playing) {
+        dma_channel_transfer_from_buffer_now(i2s_config->dma_channel,
+                                             i2s_dma_buffer(i2s_config, i2s_config->dma_tail),
+                                             i2s_config->dma_trans_count);
+    } else {
+        dma_channel_transfer_from_buffer_now(i2s_config->dma_channel, dma_silence, I2S_DMA_SILENCE_WORDS);
+    }
+}
+
 /**
  * Initialize the I2S driver. Must be called before calling i2s_write or i2s_dma_write
  * i2s_config: I2S context obtained by i2s_get_default_config()
@@ -88,8 +135,14 @@ void i2s_init(i2s_config_t *i2s_config) {
 
     pio_sm_set_enabled(i2s_config->pio, i2s_config->sm, false);
 #endif
-    /* Allocate memory for the DMA buffer */
-    i2s_config->dma_buf=malloc(i2s_config->dma_trans_count*sizeof(uint32_t));
+    /* Allocate memory for the DMA ring */
+    i2s_config->dma_buf=malloc(I2S_DMA_BUFFERS*i2s_config->dma_trans_count*sizeof(uint32_t));
+    i2s_config->dma_head = i2s_config->dma_tail = 0;
+    i2s_config->dma_playing = 0;
+    i2s_config->dma_underruns = 0;
+    i2s_config->dma_fill = 0;
+    i2s_config->drc_pos = 0;
+    i2s_config->drc_step = 1 << 16;
 
     /* Direct Memory Access setup */
     i2s_config->dma_channel = dma_claim_unused_channel(true);
@@ -125,15 +178,30 @@ void i2s_init(i2s_config_t *i2s_config) {
     channel_config_set_dreq(&dma_config, pio_get_dreq(i2s_config->pio, i2s_config->sm, true));
 #endif
     
+    /* Silence until the first buffer is queued: mid-scale for PWM, zero for I2S */
+#ifdef AUDIO_PWM_PIN
+    const uint32_t silence = (65536/2)>>(4+i2s_config->volume);
+    for (int i = 0; i < I2S_DMA_SILENCE_WORDS; i++)
+        dma_silence[i] = silence | silence << 16;
+#else
+    memset(dma_silence, 0, sizeof(dma_silence));
+#endif
+
     dma_channel_configure(i2s_config->dma_channel,
                           &dma_config,
                           addr_write_DMA,    // Destination pointer
-                          i2s_config->dma_buf,                        // Source pointer
-                          i2s_config->dma_trans_count,                // Number of 32 bits words to transfer
+                          dma_silence,                                // Source pointer
+                          I2S_DMA_SILENCE_WORDS,                      // Number of 32 bits words to transfer
                           false                                       // Start immediately
     );
 
+    dma_ring = i2s_config;
+    dma_irqn_set_channel_enabled(I2S_DMA_IRQ - DMA_IRQ_0, i2s_config->dma_channel, true);
+    irq_set_exclusive_handler(I2S_DMA_IRQ, i2s_dma_handler);
+    irq_set_enabled(I2S_DMA_IRQ, true);
+
     pio_sm_set_enabled(i2s_config->pio, i2s_config->sm , true);
+    dma_channel_start(i2s_config->dma_channel);
 }
 
 /**
@@ -151,37 +219,137 @@ void i2s_write(const i2s_config_t *i2s_config,const int16_t *samples,const size_
 }
 
 /**
- * Write samples to DMA buffer and initiate DMA transfer (non blocking)
+ * Queue samples for playback without waiting (non blocking)
  * i2s_config: I2S context obtained by i2s_get_default_config()
  *     sample: pointer to an array of dma_trans_count x 32 bits samples
+ * Returns false, leaving the ring untouched, when all I2S_DMA_BUFFERS are queued.
  */
-void i2s_dma_write(i2s_config_t *i2s_config,const int16_t *samples) {
-    /* Wait the completion of the previous DMA transfer */
-    dma_channel_wait_for_finish_blocking(i2s_config->dma_channel);
-    /* Copy samples into the DMA buffer */
+bool i2s_dma_enqueue(i2s_config_t *i2s_config,const int16_t *samples) {
+    if (!i2s_dma_free(i2s_config))
+        return false;
+    uint16_t *dma_buf = (uint16_t *)i2s_dma_buffer(i2s_config, i2s_config->dma_head);
 
+    /* Copy samples into the DMA buffer */
 #ifdef AUDIO_PWM_PIN
     for(uint16_t i=0;i<i2s_config->dma_trans_count*2;i++) {
            
-            i2s_config->dma_buf[i] = (65536/2+(samples[i]))>>(4+i2s_config->volume);
+            dma_buf[i] = (65536/2+(samples[i]))>>(4+i2s_config->volume);
 
         }
 #else
 
     if(i2s_config->volume==0) {
-        memcpy(i2s_config->dma_buf,samples,i2s_config->dma_trans_count*sizeof(int32_t));
+        memcpy(dma_buf,samples,i2s_config->dma_trans_count*sizeof(int32_t));
     } else {
         for(uint16_t i=0;i<i2s_config->dma_trans_count*2;i++) {
-            i2s_config->dma_buf[i] = samples[i]>>i2s_config->volume;
+            dma_buf[i] = samples[i]>>i2s_config->volume;
         }
     }
 #endif    
 
+    /* The handler picks it up when the buffer or silence in flight ends */
+    __dmb();
+    i2s_config->dma_head++;
+    return true;
+}
+
+static inline uint16_t i2s_dma_sample(const i2s_config_t *i2s_config, int16_t sample) {
+#ifdef AUDIO_PWM_PIN
+    return (65536/2+sample)>>(4+i2s_config->volume);
+#else
+    return sample>>i2s_config->volume;
+#endif
+}
 
-    /* Initiate the DMA transfer */
-    dma_channel_transfer_from_buffer_now(i2s_config->dma_channel,
-                                         i2s_config->dma_buf,
-                                         i2s_config->dma_trans_count);
+/**
+ * Queue samples at a rate nudged by the ring level, so output neither runs dry nor overflows
+ * when the producer and the DMA clock drift apart (dynamic rate control). The samples are
+ * linearly interpolated into the ring, a buffer being queued each time one fills up. Samples
+ * that find the ring full are dropped. Do not mix with i2s_dma_enqueue.
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ *     sample: pointer to an array of len x 32 bits samples
+ *        len: length of sample in 32 bits words
+ */
+void i2s_dma_resample(i2s_config_t *i2s_config,const int16_t *samples,size_t len) {
+    /* Steer for the ring to sit half way between empty and full once these samples are added */
+    const int32_t target = ((int32_t)(I2S_DMA_BUFFERS * i2s_config->dma_trans_count) - (int32_t)len) / 2;
+    int32_t deviation = ((int32_t)i2s_dma_fill(i2s_config) - target) * I2S_DRC_MAX_DEVIATION / target;
+    if (deviation > I2S_DRC_MAX_DEVIATION) deviation = I2S_DRC_MAX_DEVIATION;
+    if (deviation < -I2S_DRC_MAX_DEVIATION) deviation = -I2S_DRC_MAX_DEVIATION;
+    const uint32_t step = (1 << 16) + deviation;
+    i2s_config->drc_step = step;
+
+    uint32_t pos = i2s_config->drc_pos;
+    int32_t left = i2s_config->drc_last[0], right = i2s_config->drc_last[1];
+    uint16_t *dma_buf = (uint16_t *)i2s_dma_buffer(i2s_config, i2s_config->dma_head);
+    uint16_t fill = i2s_config->dma_fill;
+    bool room = i2s_dma_free(i2s_config) != 0;
+
+    for (size_t i = 0; i < len; i++) {
+        const int32_t next_left = samples[i * 2], next_right = samples[i * 2 + 1];
+        for (; pos < (1 << 16); pos += step) {
+            if (!room)
+                continue;
+            dma_buf[fill * 2] = i2s_dma_sample(i2s_config, left + ((next_left - left) * (int32_t)(pos >> 1) >> 15));
+            dma_buf[fill * 2 + 1] = i2s_dma_sample(i2s_config, right + ((next_right - right) * (int32_t)(pos >> 1) >> 15));
+            if (++fill == i2s_config->dma_trans_count) {
+                __dmb();
+                i2s_config->dma_head++;
+                fill = 0;
+                room = i2s_dma_free(i2s_config) != 0;
+                dma_buf = (uint16_t *)i2s_dma_buffer(i2s_config, i2s_config->dma_head);
+            }
+        }
+        pos -= 1 << 16;
+        left = next_left;
+        right = next_right;
+    }
+
+    i2s_config->dma_fill = fill;
+    i2s_config->drc_pos = pos;
+    i2s_config->drc_last[0] = left;
+    i2s_config->drc_last[1] = right;
+}
+
+/**
+ * Queue samples for playback, waiting for a free buffer if the ring is full
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ *     sample: pointer to an array of dma_trans_count x 32 bits samples
+ */
+void i2s_dma_write(i2s_config_t *i2s_config,const int16_t *samples) {
+    while (!i2s_dma_enqueue(i2s_config, samples))
+        tight_loop_contents();
+}
+
+/**
+ * Buffers queued or playing
+ */
+uint8_t i2s_dma_queued(const i2s_config_t *i2s_config) {
+    return (uint8_t)(i2s_config->dma_head - i2s_config->dma_tail);
+}
+
+/**
+ * Samples queued or playing, counting those not yet played from the buffer in flight
+ */
+uint32_t i2s_dma_fill(const i2s_config_t *i2s_config) {
+    int32_t fill = i2s_dma_queued(i2s_config) * i2s_config->dma_trans_count + i2s_config->dma_fill;
+    if (i2s_config->dma_playing)
+        fill -= i2s_config->dma_trans_count - (uint16_t)dma_channel_hw_addr(i2s_config->dma_channel)->transfer_count;
+    return fill < 0 ? 0 : fill;
+}
+
+/**
+ * Buffers i2s_dma_enqueue can take before the ring is full
+ */
+uint8_t i2s_dma_free(const i2s_config_t *i2s_config) {
+    return I2S_DMA_BUFFERS - i2s_dma_queued(i2s_config);
+}
+
+/**
+ * Times the ring ran dry and output held the last sample
+ */
+uint32_t i2s_dma_underruns(const i2s_config_t *i2s_config) {
+    return i2s_config->dma_underruns;
 }
 
 /**
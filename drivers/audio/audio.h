@@ -34,6 +34,16 @@ extern "C" {
 #include <hardware/dma.h>
 #include "audio_i2s.pio.h"
 
+/* Number of dma_trans_count buffers queued for playback, a power of two */
+#ifndef I2S_DMA_BUFFERS
+#define I2S_DMA_BUFFERS 8
+#endif
+/* Words played while the ring is empty, repeating the last sample */
+#define I2S_DMA_SILENCE_WORDS 32
+#define I2S_DMA_IRQ (DMA_IRQ_1)
+/* Largest rate change i2s_dma_resample makes to steer the ring back to half full, 16.16 (0.5%) */
+#define I2S_DRC_MAX_DEVIATION 328
+
 typedef struct i2s_config 
 {
     uint32_t sample_freq;        
@@ -46,6 +56,14 @@ typedef struct i2s_config
     uint16_t dma_trans_count;
     uint16_t *dma_buf;
     uint8_t volume;
+    volatile uint8_t dma_head;      // buffers queued
+    volatile uint8_t dma_tail;      // buffers played
+    volatile uint8_t dma_playing;   // DMA reads from the ring, not from silence
+    volatile uint32_t dma_underruns;
+    uint16_t dma_fill;              // samples written to the buffer at dma_head
+    uint32_t drc_pos;               // 16.16 position between drc_last and the next input
+    uint32_t drc_step;              // 16.16 input samples per output sample
+    int16_t  drc_last[2];
 } i2s_config_t;
 
 
@@ -53,6 +71,12 @@ i2s_config_t i2s_get_default_config(void);
 void i2s_init(i2s_config_t *i2s_config);
 void i2s_write(const i2s_config_t *i2s_config,const int16_t *samples,const size_t len);
 void i2s_dma_write(i2s_config_t *i2s_config,const int16_t *samples);
+bool i2s_dma_enqueue(i2s_config_t *i2s_config,const int16_t *samples);
+void i2s_dma_resample(i2s_config_t *i2s_config,const int16_t *samples,size_t len);
+uint8_t i2s_dma_queued(const i2s_config_t *i2s_config);
+uint32_t i2s_dma_fill(const i2s_config_t *i2s_config);
+uint8_t i2s_dma_free(const i2s_config_t *i2s_config);
+uint32_t i2s_dma_underruns(const i2s_config_t *i2s_config);
 void i2s_volume(i2s_config_t *i2s_config,uint8_t volume);
 void i2s_increase_volume(i2s_config_t *i2s_config);
 void i2s_decrease_volume(i2s_config_t *i2s_config);
@@ -166,6 +166,7 @@ static void pio_set_x(PIO pio, const int sm, uint32_t v) {
 static void __scratch_y("hdmi_driver") dma_handler_HDMI() {
     static uint32_t inx_buf_dma;
     static uint line = 0;
+    static uint8_t* input_frame = NULL;
     irq_inx++;
 
     dma_hw->ints0 = 1u << dma_chan_ctrl;
@@ -173,6 +174,9 @@ static void __scratch_y("hdmi_driver") dma_handler_HDMI() {
 
     line = line >= 524 ? 0 : line + 1;
 
+    //новый буфер берём только между кадрами
+    if (line == 0) input_frame = graphics_buffer;
+
     if ((line & 1) == 0) return;
 
     inx_buf_dma++;
@@ -180,7 +184,7 @@ static void __scratch_y("hdmi_driver") dma_handler_HDMI() {
 
     uint8_t* activ_buf = (uint8_t *)dma_lines[inx_buf_dma & 1];
 
-    if (graphics_buffer && line < 480 ) {
+    if (input_frame && line < 480 ) {
         //область изображения
         uint8_t* output_buffer = activ_buf + 72; //для выравнивания синхры;
 
@@ -208,7 +212,7 @@ static void __scratch_y("hdmi_driver") dma_handler_HDMI() {
                 }
 
                 //рисуем сам видеобуфер+пространство справа
-                uint8_t* input_buffer = &graphics_buffer[(y - graphics_buffer_shift_y) * graphics_buffer_width];
+                uint8_t* input_buffer = &input_frame[(y - graphics_buffer_shift_y) * graphics_buffer_width];
 
                 const uint8_t* input_buffer_end = input_buffer + graphics_buffer_width;
 
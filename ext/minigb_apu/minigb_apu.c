@@ -11,7 +11,15 @@
 #include "minigb_apu.h"
 
 #define DMG_CLOCK_FREQ_U	((unsigned)DMG_CLOCK_FREQ)
-#define AUDIO_NSAMPLES		(AUDIO_SAMPLES * 2u)
+#define SCREEN_REFRESH_CYCLES_U	((unsigned)SCREEN_REFRESH_CYCLES)
+/* AUDIO_SAMPLES * 2, in a form that can size an array. */
+#define AUDIO_NSAMPLES		(AUDIO_SAMPLE_RATE * SCREEN_REFRESH_CYCLES_U / \
+					DMG_CLOCK_FREQ_U * 2u)
+
+/* Register writes in flight to synthesis, a power of two. */
+#define AUDIO_EVENTS_MAX	512
+/* Event address that marks the end of a frame. */
+#define AUDIO_EVENT_FRAME_END	0
 
 #define AUDIO_MEM_SIZE		(0xFF3F - 0xFF10 + 1)
 #define AUDIO_ADDR_COMPENSATION	0xFF10
@@ -35,6 +43,39 @@
  */
 static uint8_t audio_mem[AUDIO_MEM_SIZE];
 
+/**
+ * Registers as last written, which audio_read() returns while the writes wait
+ * for synthesis.
+ */
+static uint8_t audio_regs[AUDIO_MEM_SIZE];
+
+/* Channels triggered by writes synthesis has not reached, up to events_head
+ * trigger_head. */
+static uint8_t pending_triggers;
+static uint32_t trigger_head;
+
+/**
+ * Register writes and frame ends, in order, each write applied when synthesis
+ * reaches its sample. Only audio_write() and audio_end_frame() add to it and
+ * only synthesis takes from it, so the two sides may run on different cores.
+ */
+static struct audio_event {
+	uint32_t cycles;
+	uint16_t addr;
+	uint8_t val;
+} events[AUDIO_EVENTS_MAX];
+static volatile uint32_t events_head, events_tail;
+
+/* Frames ended by audio_end_frame(), and frames returned by audio_callback(). */
+static volatile uint32_t frames_ended, frames_done;
+
+/**
+ * Samples of the current frame, synthesised up to samples_pos.
+ */
+static int16_t samples[AUDIO_NSAMPLES];
+static uint_fast16_t samples_pos;
+static bool frame_complete;
+
 struct chan_len_ctr {
 	uint8_t load;
 	unsigned enabled : 1;
@@ -183,7 +224,8 @@ static void update_sweep(struct chan *c)
 	}
 }
 
-static void update_square(int16_t* samples, const bool ch2)
+static void update_square(int16_t* samples, const uint_fast16_t from,
+		const uint_fast16_t to, const bool ch2)
 {
 	uint32_t freq;
 	struct chan* c = chans + ch2;
@@ -195,7 +237,7 @@ static void update_square(int16_t* samples, const bool ch2)
 	set_note_freq(c, freq);
 	c->freq_inc *= 8;
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
+	for (uint_fast16_t i = from; i < to; i += 2) {
 		update_len(c);
 
 		if (!c->enabled)
@@ -243,7 +285,8 @@ static uint8_t wave_sample(const unsigned int pos, const unsigned int volume)
 	return volume ? (sample >> (volume - 1)) : 0;
 }
 
-static void update_wave(int16_t *samples)
+static void update_wave(int16_t *samples, const uint_fast16_t from,
+		const uint_fast16_t to)
 {
 	uint32_t freq;
 	struct chan *c = chans + 2;
@@ -256,7 +299,7 @@ static void update_wave(int16_t *samples)
 
 	c->freq_inc *= 32;
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
+	for (uint_fast16_t i = from; i < to; i += 2) {
 		update_len(c);
 
 		if (!c->enabled)
@@ -297,7 +340,8 @@ static void update_wave(int16_t *samples)
 	}
 }
 
-static void update_noise(int16_t *samples)
+static void update_noise(int16_t *samples, const uint_fast16_t from,
+		const uint_fast16_t to)
 {
 	struct chan *c = chans + 3;
 
@@ -317,7 +361,7 @@ static void update_noise(int16_t *samples)
 	if (c->freq >= 14)
 		c->enabled = 0;
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
+	for (uint_fast16_t i = from; i < to; i += 2) {
 		update_len(c);
 
 		if (!c->enabled)
@@ -361,6 +405,86 @@ static void update_noise(int16_t *samples)
 	}
 }
 
+/**
+ * Synthesise the samples of the current frame up to, but not including, "to".
+ */
+static void synthesise(const uint_fast16_t to)
+{
+	if (to <= samples_pos)
+		return;
+
+	update_square(samples, samples_pos, to, 0);
+	update_square(samples, samples_pos, to, 1);
+	update_wave(samples, samples_pos, to);
+	update_noise(samples, samples_pos, to);
+	samples_pos = to;
+}
+
+static void apply_write(const uint16_t addr, const uint8_t val);
+
+/**
+ * Synthesise up to the register writes made so far, applying each at the
+ * sample it was made at, and stop at the end of the frame.
+ */
+void audio_synthesise(void)
+{
+	while (!frame_complete && events_tail != events_head) {
+		const struct audio_event *e;
+
+		/* Read the event only after its index. */
+		__sync_synchronize();
+		e = &events[events_tail % AUDIO_EVENTS_MAX];
+
+		if (e->addr == AUDIO_EVENT_FRAME_END) {
+			synthesise(AUDIO_NSAMPLES);
+			frame_complete = true;
+		} else {
+			uint32_t cycles = MIN(e->cycles, SCREEN_REFRESH_CYCLES_U);
+
+			synthesise(cycles * (AUDIO_NSAMPLES / 2) /
+				SCREEN_REFRESH_CYCLES_U * 2);
+			apply_write(e->addr, e->val);
+		}
+
+		/* Done with the event before its slot is reused. */
+		__sync_synchronize();
+		events_tail = events_tail + 1;
+	}
+}
+
+/**
+ * Add an event for synthesis, waiting while the ring is full.
+ */
+static void push_event(const uint16_t addr, const uint8_t val,
+		const uint32_t cycles)
+{
+	struct audio_event *e;
+
+	while (events_head - events_tail == AUDIO_EVENTS_MAX)
+		;
+
+	e = &events[events_head % AUDIO_EVENTS_MAX];
+	e->cycles = cycles;
+	e->addr = addr;
+	e->val = val;
+
+	/* Publish the event before its index. */
+	__sync_synchronize();
+	events_head = events_head + 1;
+}
+
+void audio_end_frame(void)
+{
+	push_event(AUDIO_EVENT_FRAME_END, 0, 0);
+	__sync_synchronize();
+	frames_ended = frames_ended + 1;
+}
+
+unsigned audio_frames_pending(void)
+{
+	return frames_ended - frames_done;
+}
+
 /**
  * SDL2 style audio callback function.
  */
@@ -369,12 +493,15 @@ void audio_callback(void *userdata, int16_t *stream, size_t len)
 	/* Appease unused variable warning. */
 	(void)userdata;
 
-	memset(stream, 0, len);
+	audio_synthesise();
 
-	update_square(stream, 0);
-	update_square(stream, 1);
-	update_wave(stream);
-	update_noise(stream);
+	memcpy(stream, samples, MIN(len, sizeof(samples)));
+	memset(samples, 0, sizeof(samples));
+	samples_pos = 0;
+	frame_complete = false;
+
+	__sync_synchronize();
+	frames_done = frames_done + 1;
 }
 
 static void chan_trigger(uint_fast8_t i)
@@ -443,8 +570,39 @@ uint8_t audio_read(const uint16_t addr)
 		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 	};
 
-	return audio_mem[addr - AUDIO_ADDR_COMPENSATION] |
-		ortab[addr - AUDIO_ADDR_COMPENSATION];
+	uint8_t val = audio_regs[addr - AUDIO_ADDR_COMPENSATION];
+
+	/* Channel status as of the last synthesised sample, plus channels
+	 * triggered since. */
+	if (addr == 0xFF26 && (val & 0x80)) {
+		if ((int32_t)(events_tail - trigger_head) >= 0)
+			pending_triggers = 0;
+
+		val |= (audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] & 0x0F) |
+			pending_triggers;
+	}
+
+	return val | ortab[addr - AUDIO_ADDR_COMPENSATION];
+}
+
+/**
+ * Update the registers audio_read() returns.
+ * \return	false if the write is ignored, as the APU is powered off.
+ */
+static bool shadow_write(const uint16_t addr, const uint8_t val)
+{
+	if (addr == 0xFF26) {
+		audio_regs[addr - AUDIO_ADDR_COMPENSATION] = val & 0x80;
+		if ((val & 0x80) == 0)
+			memset(audio_regs, 0x00, 0xFF26 - AUDIO_ADDR_COMPENSATION);
+		return true;
+	}
+
+	if (audio_regs[0xFF26 - AUDIO_ADDR_COMPENSATION] == 0x00)
+		return false;
+
+	audio_regs[addr - AUDIO_ADDR_COMPENSATION] = val;
+	return true;
 }
 
 /**
@@ -452,8 +610,32 @@ uint8_t audio_read(const uint16_t addr)
  * \param addr	Address of audio register. Must be 0xFF10 <= addr <= 0xFF3F.
  *				This is not checked in this function.
  * \param val	Byte to write at address.
+ * \param cycles	Cycles at 4194304 Hz since the start of the frame.
+ */
+void audio_write(const uint16_t addr, const uint8_t val, const uint32_t cycles)
+{
+	if (!shadow_write(addr, val))
+		return;
+
+	push_event(addr, val, cycles);
+
+	switch (addr) {
+	case 0xFF14:
+	case 0xFF19:
+	case 0xFF1E:
+	case 0xFF23:
+		if (val & 0x80) {
+			pending_triggers |= 1 << ((addr - AUDIO_ADDR_COMPENSATION) / 5);
+			trigger_head = events_head;
+		}
+		break;
+	}
+}
+
+/**
+ * Apply a register write to the channels.
  */
-void audio_write(const uint16_t addr, const uint8_t val)
+static void apply_write(const uint16_t addr, const uint8_t val)
 {
 	/* Find sound channel corresponding to register address. */
 	uint_fast8_t i;
@@ -577,6 +759,17 @@ void audio_init(void)
 	memset(chans, 0, sizeof(chans));
 	chans[0].val = chans[1].val = -1;
 
+	events_head = events_tail = 0;
+	frames_ended = frames_done = 0;
+	pending_triggers = 0;
+	memset(samples, 0, sizeof(samples));
+	samples_pos = 0;
+	frame_complete = false;
+
+	/* Start powered off, as at reset, whatever the last game left. */
+	memset(audio_regs, 0, sizeof(audio_regs));
+	memset(audio_mem, 0, sizeof(audio_mem));
+
 	/* Initialise IO registers. */
 	{
 		const uint8_t regs_init[] = { 0x80, 0xBF, 0xF3, 0xFF, 0x3F,
@@ -586,7 +779,8 @@ void audio_init(void)
 					      0x77, 0xF3, 0xF1 };
 
 		for(uint_fast8_t i = 0; i < sizeof(regs_init); ++i)
-			audio_write(0xFF10 + i, regs_init[i]);
+			if (shadow_write(0xFF10 + i, regs_init[i]))
+				apply_write(0xFF10 + i, regs_init[i]);
 	}
 
 	/* Initialise Wave Pattern RAM. */
@@ -597,6 +791,152 @@ void audio_init(void)
 					      0xac, 0xdd, 0xda, 0x48 };
 
 		for(uint_fast8_t i = 0; i < sizeof(wave_init); ++i)
-			audio_write(0xFF30 + i, wave_init[i]);
+			if (shadow_write(0xFF30 + i, wave_init[i]))
+				apply_write(0xFF30 + i, wave_init[i]);
 	}
 }
+
+static uint8_t *state_put(uint8_t *p, uint32_t v, uint_fast8_t bytes)
+{
+	while (bytes--) {
+		*p++ = v;
+		v >>= 8;
+	}
+	return p;
+}
+
+static uint32_t state_get(const uint8_t **p, uint_fast8_t bytes)
+{
+	uint32_t v = 0;
+
+	for (uint_fast8_t i = 0; i < bytes; i++)
+		v |= (uint32_t)*(*p)++ << (i * 8);
+	return v;
+}
+
+/**
+ * Channel state is packed field by field, little endian, so the layout does
+ * not depend on the compiler.
+ */
+void audio_state_save(uint8_t *state)
+{
+	uint8_t *p = state;
+
+	memcpy(p, audio_mem, AUDIO_MEM_SIZE);
+	p += AUDIO_MEM_SIZE;
+	memcpy(p, audio_regs, AUDIO_MEM_SIZE);
+	p += AUDIO_MEM_SIZE;
+	p = state_put(p, vol_l, 4);
+	p = state_put(p, vol_r, 4);
+
+	for (uint_fast8_t i = 0; i < 4; i++) {
+		const struct chan *c = chans + i;
+
+		*p++ = c->enabled | c->powered << 1 | c->on_left << 2 |
+			c->on_right << 3 | c->muted << 4 | c->len.enabled << 5 |
+			c->env.up << 6 | c->sweep.up << 7;
+		*p++ = c->volume;
+		*p++ = c->volume_init;
+		p = state_put(p, c->freq, 2);
+		p = state_put(p, c->freq_counter, 4);
+		p = state_put(p, c->freq_inc, 4);
+		p = state_put(p, c->val, 2);
+
+		*p++ = c->len.load;
+		p = state_put(p, c->len.counter, 4);
+		p = state_put(p, c->len.inc, 4);
+
+		*p++ = c->env.step;
+		p = state_put(p, c->env.counter, 4);
+		p = state_put(p, c->env.inc, 4);
+
+		p = state_put(p, c->sweep.freq, 2);
+		*p++ = c->sweep.rate;
+		*p++ = c->sweep.shift;
+		p = state_put(p, c->sweep.counter, 4);
+		p = state_put(p, c->sweep.inc, 4);
+
+		if (i == 2) {
+			p = state_put(p, c->wave.sample, 4);
+		} else if (i == 3) {
+			p = state_put(p, c->noise.lfsr_reg, 2);
+			*p++ = c->noise.lfsr_wide;
+			*p++ = c->noise.lfsr_div;
+		} else {
+			*p++ = c->square.duty;
+			*p++ = c->square.duty_counter;
+			p = state_put(p, 0, 2);
+		}
+	}
+}
+
+bool audio_state_load(const uint8_t *state, size_t size)
+{
+	const uint8_t *p = state;
+
+	if (size < AUDIO_STATE_SIZE)
+		return false;
+
+	memcpy(audio_mem, p, AUDIO_MEM_SIZE);
+	p += AUDIO_MEM_SIZE;
+	memcpy(audio_regs, p, AUDIO_MEM_SIZE);
+	p += AUDIO_MEM_SIZE;
+	vol_l = (int32_t)state_get(&p, 4);
+	vol_r = (int32_t)state_get(&p, 4);
+
+	memset(chans, 0, sizeof(chans));
+	for (uint_fast8_t i = 0; i < 4; i++) {
+		struct chan *c = chans + i;
+		const uint8_t flags = *p++;
+
+		c->enabled = flags & 1;
+		c->powered = (flags >> 1) & 1;
+		c->on_left = (flags >> 2) & 1;
+		c->on_right = (flags >> 3) & 1;
+		c->muted = (flags >> 4) & 1;
+		c->len.enabled = (flags >> 5) & 1;
+		c->env.up = (flags >> 6) & 1;
+		c->sweep.up = (flags >> 7) & 1;
+		c->volume = *p++;
+		c->volume_init = *p++;
+		c->freq = state_get(&p, 2);
+		c->freq_counter = state_get(&p, 4);
+		c->freq_inc = state_get(&p, 4);
+		c->val = (int16_t)state_get(&p, 2);
+
+		c->len.load = *p++;
+		c->len.counter = state_get(&p, 4);
+		c->len.inc = state_get(&p, 4);
+
+		c->env.step = *p++;
+		c->env.counter = state_get(&p, 4);
+		c->env.inc = state_get(&p, 4);
+
+		c->sweep.freq = state_get(&p, 2);
+		c->sweep.rate = *p++;
+		c->sweep.shift = *p++;
+		c->sweep.counter = state_get(&p, 4);
+		c->sweep.inc = state_get(&p, 4);
+
+		if (i == 2) {
+			c->wave.sample = state_get(&p, 4);
+		} else if (i == 3) {
+			c->noise.lfsr_reg = state_get(&p, 2);
+			c->noise.lfsr_wide = *p++;
+			c->noise.lfsr_div = *p++;
+		} else {
+			c->square.duty = *p++;
+			c->square.duty_counter = *p++;
+			p += 2;
+		}
+	}
+
+	/* Nothing is queued, so no channel waits for a trigger. */
+	pending_triggers = 0;
+	trigger_head = events_head;
+	memset(samples, 0, sizeof(samples));
+	samples_pos = 0;
+	frame_complete = false;
+
+	return true;
+}
@@ -10,6 +10,8 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define AUDIO_SAMPLE_RATE	44100
@@ -21,27 +23,65 @@ extern "C" {
 #define AUDIO_SAMPLES		((unsigned)(AUDIO_SAMPLE_RATE / VERTICAL_SYNC))
 #define AUDIO_BUFFER_SIZE_BYTES (AUDIO_SAMPLES*4)
 
+/*
+ * The emulator side (audio_read, audio_write, audio_end_frame) and the
+ * synthesis side (audio_synthesise, audio_callback) only share a ring of
+ * register writes, so each may run on its own core. On a single core, call
+ * audio_callback() after each frame, and make no more than 512 writes a frame.
+ */
+
 /**
- * Fill allocated buffer "data" with "len" number of 32-bit floating point
- * samples (native endian order) in stereo interleaved format.
+ * Fill allocated buffer "data" with "len" bytes of 16-bit samples (native
+ * endian order) in stereo interleaved format, for the oldest frame ended with
+ * audio_end_frame(). Only call when audio_frames_pending() is non-zero.
  */
 void audio_callback(void *ptr, int16_t *data, size_t len);
 
+/**
+ * Synthesise as far as the register writes made so far allow, to spread the
+ * work of a frame out before audio_callback() is called. Optional.
+ */
+void audio_synthesise(void);
+
 /**
  * Read audio register at given address "addr".
  */
 uint8_t audio_read(const uint16_t addr);
 
 /**
- * Write "val" to audio register at given address "addr".
+ * Write "val" to audio register at given address "addr", "cycles" 4194304 Hz
+ * cycles into the current frame. The write is queued, and synthesis applies
+ * it at the matching sample. Waits while 512 writes are queued.
+ */
+void audio_write(const uint16_t addr, const uint8_t val, const uint32_t cycles);
+
+/**
+ * Mark the end of the current frame's register writes.
  */
-void audio_write(const uint16_t addr, const uint8_t val);
+void audio_end_frame(void);
+
+/**
+ * Return the number of frames ended but not yet passed to audio_callback().
+ */
+unsigned audio_frames_pending(void);
 
 /**
  * Initialise audio driver.
  */
 void audio_init(void);
 
+/* Bytes written by audio_state_save(). */
+#define AUDIO_STATE_SIZE	300
+
+/**
+ * Write the registers and channel state to "state" of AUDIO_STATE_SIZE bytes,
+ * and restore them with audio_state_load(). Only call between frames once
+ * audio_frames_pending() is zero, when synthesis has applied every write.
+ * audio_state_load() returns false, changing nothing, if "size" is too small.
+ */
+void audio_state_save(uint8_t *state);
+bool audio_state_load(const uint8_t *state, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
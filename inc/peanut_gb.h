@@ -43,7 +43,7 @@
 # define __has_include(x) 0
 #endif
 
-#include <cstdlib>	/* Required for qsort and abort */
+#include <cstdlib>	/* Required for abort */
 #include <cstdint>	/* Required for int types */
 #include <cstring>	/* Required for memset */
 #include <ctime>	/* Required for tm struct */
@@ -81,6 +81,8 @@
  * Sound support must be provided by an external library. When audio_read() and
  * audio_write() functions are provided, define ENABLE_SOUND to a non-zero value
  * before including peanut_gb.h in order for these functions to be used.
+ * audio_write() is also given the time of the write, in 4194304 Hz cycles
+ * since gb_run_frame() began.
  */
 #ifndef ENABLE_SOUND
 # define ENABLE_SOUND 0
@@ -111,6 +113,38 @@
 # define PEANUT_FULL_GBC_SUPPORT 1
 #endif
 
+/* Set to 0 to catch up the timers and LCD after every instruction instead of
+ * only when the next event is due. Slower, only useful to check the scheduler
+ * against. */
+#ifndef PEANUT_GB_SCHEDULE_EVENTS
+# define PEANUT_GB_SCHEDULE_EVENTS 1
+#endif
+
+/* Use GCC labels as values to jump from one instruction handler to the next
+ * without leaving __gb_step_cpu until the next event. Requires GCC or Clang. */
+#ifndef PEANUT_GB_THREADED_DISPATCH
+# define PEANUT_GB_THREADED_DISPATCH 0
+#endif
+
+/* Number of entries in the decoded instruction cache for code executing from
+ * directly mapped ROM. Must be a power of two. Set to 0 to disable. */
+#ifndef PEANUT_GB_ICACHE_SIZE
+# define PEANUT_GB_ICACHE_SIZE 0
+#endif
+
+/* Count instruction cache hits, misses and bypassed fetches in gb->icache.
+ * Only for measuring the hit rate, costs a store on every fetch. */
+#ifndef PEANUT_GB_ICACHE_STATS
+# define PEANUT_GB_ICACHE_STATS 0
+#endif
+
+/* Number of switchable ROM banks that can be cached in RAM in front of a ROM
+ * that is slow to read directly, such as XIP flash. The front-end provides
+ * the memory with gb_init_rom_bank_cache(). Set to 0 to disable. */
+#ifndef PEANUT_GB_ROM_BANK_CACHE
+# define PEANUT_GB_ROM_BANK_CACHE 0
+#endif
+
 /* Only include function prototypes. At least one file must *not* have this
  * defined. */
 // #define PEANUT_GB_HEADER_ONLY
@@ -167,6 +201,10 @@
 #define SERIAL_CYCLES_32KB  (SERIAL_CYCLES/32ul)
 #define SERIAL_CYCLES_64KB  (SERIAL_CYCLES/64ul)
 
+/* Longest run of cycles the scheduler lets pass without an event, so that
+ * the timing counters stay small while the LCD and timer are off. */
+#define SCHEDULE_MAX_CYCLES 0x4000
+
 /* Calculating VSYNC. */
 #define DMG_CLOCK_FREQ      4194304.0
 #define SCREEN_REFRESH_CYCLES 70224.0
@@ -284,39 +322,39 @@
 # define PGB_INSTR_SBC_R8(r,cin)						\
 	{									\
 		uint8_t temp;							\
-		gb->cpu_reg.f_bits.c = PGB_INTRIN_SBC(gb->cpu_reg.a,r,cin,temp);\
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0;	\
-		gb->cpu_reg.f_bits.n = 1;					\
-		gb->cpu_reg.f_bits.z = (temp == 0x00);				\
-		gb->cpu_reg.a = temp;						\
+		cpu->f_bits.c = PGB_INTRIN_SBC(cpu->a,r,cin,temp);	\
+		cpu->f_bits.h = ((cpu->a ^ r ^ temp) & 0x10) > 0;	\
+		cpu->f_bits.n = 1;					\
+		cpu->f_bits.z = (temp == 0x00);				\
+		cpu->a = temp;						\
 	}
 
 # define PGB_INSTR_CP_R8(r)							\
 	{									\
 		uint8_t temp;							\
-		gb->cpu_reg.f_bits.c = PGB_INTRIN_SBC(gb->cpu_reg.a,r,0,temp);	\
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0;	\
-		gb->cpu_reg.f_bits.n = 1;					\
-		gb->cpu_reg.f_bits.z = (temp == 0x00);				\
+		cpu->f_bits.c = PGB_INTRIN_SBC(cpu->a,r,0,temp);	\
+		cpu->f_bits.h = ((cpu->a ^ r ^ temp) & 0x10) > 0;	\
+		cpu->f_bits.n = 1;					\
+		cpu->f_bits.z = (temp == 0x00);				\
 	}
 #else
 # define PGB_INSTR_SBC_R8(r,cin)						\
 	{									\
-		uint16_t temp = gb->cpu_reg.a - (r + cin);			\
-		gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;			\
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0; \
-		gb->cpu_reg.f_bits.n = 1;					\
-		gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);			\
-		gb->cpu_reg.a = (temp & 0xFF);					\
+		uint16_t temp = cpu->a - (r + cin);			\
+		cpu->f_bits.c = (temp & 0xFF00) ? 1 : 0;		\
+		cpu->f_bits.h = ((cpu->a ^ r ^ temp) & 0x10) > 0;	\
+		cpu->f_bits.n = 1;					\
+		cpu->f_bits.z = ((temp & 0xFF) == 0x00);		\
+		cpu->a = (temp & 0xFF);					\
 	}
 
 # define PGB_INSTR_CP_R8(r)							\
 	{									\
-		uint16_t temp = gb->cpu_reg.a - r;				\
-		gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;			\
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0; \
-		gb->cpu_reg.f_bits.n = 1;					\
-		gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);			\
+		uint16_t temp = cpu->a - r;				\
+		cpu->f_bits.c = (temp & 0xFF00) ? 1 : 0;		\
+		cpu->f_bits.h = ((cpu->a ^ r ^ temp) & 0x10) > 0;	\
+		cpu->f_bits.n = 1;					\
+		cpu->f_bits.z = ((temp & 0xFF) == 0x00);		\
 	}
 #endif  /* PGB_INTRIN_SBC */
 
@@ -324,50 +362,50 @@
 # define PGB_INSTR_ADC_R8(r,cin)						\
 	{									\
 		uint8_t temp;							\
-		gb->cpu_reg.f_bits.c = PGB_INTRIN_ADC(gb->cpu_reg.a,r,cin,temp);\
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0; \
-		gb->cpu_reg.f_bits.n = 0;					\
-		gb->cpu_reg.f_bits.z = (temp == 0x00);				\
-		gb->cpu_reg.a = temp;						\
+		cpu->f_bits.c = PGB_INTRIN_ADC(cpu->a,r,cin,temp);	\
+		cpu->f_bits.h = ((cpu->a ^ r ^ temp) & 0x10) > 0;	\
+		cpu->f_bits.n = 0;					\
+		cpu->f_bits.z = (temp == 0x00);				\
+		cpu->a = temp;						\
 	}
 #else
 # define PGB_INSTR_ADC_R8(r,cin)						\
 	{									\
-		uint16_t temp = gb->cpu_reg.a + r + cin;			\
-		gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;			\
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0; \
-		gb->cpu_reg.f_bits.n = 0;					\
-		gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);			\
-		gb->cpu_reg.a = (temp & 0xFF);					\
+		uint16_t temp = cpu->a + r + cin;			\
+		cpu->f_bits.c = (temp & 0xFF00) ? 1 : 0;		\
+		cpu->f_bits.h = ((cpu->a ^ r ^ temp) & 0x10) > 0;	\
+		cpu->f_bits.n = 0;					\
+		cpu->f_bits.z = ((temp & 0xFF) == 0x00);		\
+		cpu->a = (temp & 0xFF);					\
 	}
 #endif /* PGB_INTRIN_ADC */
 
 #define PGB_INSTR_DEC_R8(r)							\
 	r--;									\
-	gb->cpu_reg.f_bits.h = ((r & 0x0F) == 0x0F);				\
-	gb->cpu_reg.f_bits.n = 1;						\
-	gb->cpu_reg.f_bits.z = (r == 0x00);
+	cpu->f_bits.h = ((r & 0x0F) == 0x0F);				\
+	cpu->f_bits.n = 1;						\
+	cpu->f_bits.z = (r == 0x00);
 
 #define PGB_INSTR_XOR_R8(r)							\
-	gb->cpu_reg.a ^= r;							\
-	gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);				\
-	gb->cpu_reg.f_bits.n = 0;						\
-	gb->cpu_reg.f_bits.h = 0;						\
-	gb->cpu_reg.f_bits.c = 0;
+	cpu->a ^= r;							\
+	cpu->f_bits.z = (cpu->a == 0x00);				\
+	cpu->f_bits.n = 0;						\
+	cpu->f_bits.h = 0;						\
+	cpu->f_bits.c = 0;
 
 #define PGB_INSTR_OR_R8(r)							\
-	gb->cpu_reg.a |= r;							\
-	gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);				\
-	gb->cpu_reg.f_bits.n = 0;						\
-	gb->cpu_reg.f_bits.h = 0;						\
-	gb->cpu_reg.f_bits.c = 0;
+	cpu->a |= r;							\
+	cpu->f_bits.z = (cpu->a == 0x00);				\
+	cpu->f_bits.n = 0;						\
+	cpu->f_bits.h = 0;						\
+	cpu->f_bits.c = 0;
 
 #define PGB_INSTR_AND_R8(r)							\
-	gb->cpu_reg.a &= r;							\
-	gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);				\
-	gb->cpu_reg.f_bits.n = 0;						\
-	gb->cpu_reg.f_bits.h = 1;						\
-	gb->cpu_reg.f_bits.c = 0;
+	cpu->a &= r;							\
+	cpu->f_bits.z = (cpu->a == 0x00);				\
+	cpu->f_bits.n = 0;						\
+	cpu->f_bits.h = 1;						\
+	cpu->f_bits.c = 0;
 
 #if PEANUT_GB_IS_LITTLE_ENDIAN
 # define PEANUT_GB_GET_LSB16(x) (x & 0xFF)
@@ -458,12 +496,34 @@ struct cpu_registers_s
 #undef PEANUT_GB_LE_REG
 };
 
+#if PEANUT_GB_ICACHE_SIZE
+/* One pre-decoded instruction. */
+struct gb_icache_entry_s
+{
+	const uint8_t *tag;	/* Host address of the opcode, NULL if empty. */
+	uint8_t opcode;
+	uint8_t imm[2];		/* Operand bytes, if any. */
+	uint8_t cycles;		/* Base cycles from op_cycles. */
+};
+#endif
+
 struct count_s
 {
 	uint_fast16_t lcd_count;	/* LCD Timing */
 	uint_fast16_t div_count;	/* Divider Register Counter */
 	uint_fast16_t tima_count;	/* Timer Counter */
 	uint_fast16_t serial_count;	/* Serial Counter */
+
+	/* CPU cycles executed but not yet applied to the counters above. */
+	uint_fast32_t pending;
+	/* Pending cycles at which the next timer, serial or LCD event is due. */
+	uint_fast32_t next_event;
+
+	/* Cycles skipped in HALT or idle loops since gb_run_frame() began. */
+	uint_fast32_t idle_cycles;
+
+	/* Cycles at single speed applied since gb_run_frame() began. */
+	uint_fast32_t frame_cycles;
 };
 
 #if ENABLE_LCD
@@ -486,6 +546,25 @@ struct count_s
 	*/
 	#define LCD_PALETTE_ALL 0x30
 # endif
+
+/**
+ * Registers that decide how a line looks, captured when the line is reached so
+ * that it can be drawn later. See gb_init_lcd_queue().
+ */
+struct gb_line_s
+{
+	uint8_t ly;
+	/* LCDC, with the window enable bit cleared if the window is not on
+	 * this line. */
+	uint8_t lcdc;
+	uint8_t scx;
+	uint8_t scy;
+	uint8_t wx;
+	/* Line of the window to draw. */
+	uint8_t window_line;
+	uint8_t bg_palette[4];
+	uint8_t sp_palette[8];
+};
 #endif
 
 /**
@@ -590,6 +669,12 @@ struct gb_s
 	uint16_t num_rom_banks_mask;
 	/* Number of RAM banks in cartridge. Ignore for MBC2. */
 	uint8_t num_ram_banks;
+	/* gb_get_save_size() - 1, or 0 without cart RAM. Sizes are powers of
+	 * two, so cart RAM addresses wrap into the save with a mask. */
+	uint32_t cart_ram_mask;
+	/* Offset of the selected cart RAM bank within the save, masked.
+	 * Worked out when the bank or mode changes. */
+	uint32_t cart_ram_offset;
 
 	uint16_t selected_rom_bank;
 	/* WRAM and VRAM bank selection not available. */
@@ -620,13 +705,86 @@ struct gb_s
 	uint8_t oam[OAM_SIZE];
 	uint8_t hram_io[HRAM_IO_SIZE];
 
+	/**
+	 * Memory map with one entry per 256 byte page of the address space.
+	 * A non-NULL entry points to the host memory backing that page, so
+	 * the access is a single indexed load or store. NULL entries (boot
+	 * ROM, MBC registers, disabled cart RAM, RTC, OAM and IO) are handled
+	 * by the slow path. OAM and HRAM share pages 0xFE and 0xFF with the
+	 * unusable area and the IO registers, so they cannot have entries of
+	 * their own. Only rebuilt when the banking state changes.
+	 */
+	struct
+	{
+		const uint8_t *read[0x100];
+		uint8_t *write[0x100];
+
+		/* Direct pointers given by gb_init_memory_map(), may be NULL. */
+		const uint8_t *rom;
+		uint8_t *cart_ram;
+	} map;
+
+#if PEANUT_GB_ICACHE_SIZE
+	/**
+	 * Decoded instruction cache, indexed by PC. Entries are tagged with
+	 * the host address of the opcode, which identifies both the ROM bank
+	 * and the PC. Only ROM is cached, so writes can never make an entry
+	 * stale; code running from RAM bypasses the cache.
+	 */
+	struct
+	{
+		struct gb_icache_entry_s entry[PEANUT_GB_ICACHE_SIZE];
+
+#if PEANUT_GB_ICACHE_STATS
+		/* Instructions fetched from the cache, decoded into it, and
+		 * read from memory because they are not in ROM. */
+		uint_fast32_t hits;
+		uint_fast32_t misses;
+		uint_fast32_t bypass;
+#endif
+	} icache;
+#endif
+
+#if PEANUT_GB_ROM_BANK_CACHE
+	/**
+	 * ROM banks copied into RAM given by gb_init_rom_bank_cache(). Slot 0
+	 * always holds bank 0; the other slots hold switchable banks and the
+	 * least recently selected one is replaced on a miss.
+	 */
+	struct
+	{
+		uint8_t *slots;
+		uint_fast8_t count;
+
+		/* Copy a whole ROM bank to dst. Copies from the memory mapped
+		 * ROM if NULL. */
+		void (*fill)(struct gb_s*, uint8_t *dst, uint_fast16_t bank);
+
+		/* Bank held by each slot, or -1 if empty, and when it was
+		 * last selected. */
+		int_fast16_t bank[PEANUT_GB_ROM_BANK_CACHE + 1];
+		uint_fast32_t last_used[PEANUT_GB_ROM_BANK_CACHE + 1];
+		uint_fast32_t tick;
+
+		/* Bank in the switchable window, or -1. */
+		int_fast16_t mapped;
+
+		/* Bank selections served from a slot, and ones that needed a
+		 * fill. */
+		uint_fast32_t hits;
+		uint_fast32_t misses;
+	} rom_cache;
+#endif
+
 	struct
 	{
 		/**
 		 * Draw line on screen.
 		 *
 		 * \param gb_s		emulator context
-		 * \param pixels	The 160 pixels to draw.
+		 * \param pixels	The 160 pixels to draw. In a DMG game,
+		 * 			each is a shade looked up in colours,
+		 * 			by default:
 		 * 			Bits 1-0 are the colour to draw.
 		 * 			Bits 5-4 are the palette, where:
 		 * 				OBJ0 = 0b00,
@@ -645,13 +803,39 @@ struct gb_s
 				const uint8_t *pixels,
 				const uint_fast8_t line);
 
-		/* Palettes */
+		/* If set, lines are passed here instead of drawn, and
+		 * lcd_wait_lines is called before VRAM or OAM changes. See
+		 * gb_init_lcd_queue(). */
+		void (*lcd_queue_line)(struct gb_s *gb,
+				const struct gb_line_s *line);
+		void (*lcd_wait_lines)(struct gb_s *gb);
+		/* Set when a line was queued since lcd_wait_lines last ran.
+		 * VRAM writes take the slow path only while it is set. */
+		uint8_t vram_queued;
+
+		/* Palettes, holding pixel values already looked up in
+		 * colours. */
 		uint8_t bg_palette[4];
 		uint8_t sp_palette[8];
 
+		/* Pixel value of each shade of OBJ0, OBJ1 and BG, in the
+		 * LCD_PALETTE_ALL order. See gb_init_lcd_framebuffer(). */
+		uint8_t colours[3][4];
+		/* If set, line "ly" is drawn straight into
+		 * framebuffer + ly * LCD_WIDTH. */
+		uint8_t *framebuffer;
+
 		uint8_t window_clear;
 		uint8_t WY;
 
+		/* Sprites on each line, at most ten picked in OAM order, in
+		 * drawing priority order. Rebuilt from OAM before the next line
+		 * is drawn whenever sprites_dirty is set. */
+		uint8_t sprites_dirty;
+		uint8_t sprites_height;
+		uint8_t line_sprite_count[LCD_HEIGHT];
+		uint8_t line_sprites[LCD_HEIGHT][MAX_SPRITES_LINE];
+
 		/* Only support 30fps frame skip. */
 		uint8_t frame_skip_count : 1;
 		uint8_t interlace_count : 1;
@@ -696,6 +880,18 @@ struct gb_s
 		 */
 		uint8_t interlace : 1;
 		uint8_t frame_skip : 1;
+		/* Set before gb_run_frame to emulate that frame without drawing
+		 * it. Lets the front-end pick which frames to skip. */
+		uint8_t skip_frame : 1;
+		/* Set to skip ahead while the CPU is stuck in a loop polling LY,
+		 * STAT or JOYP. Emulation results are unchanged, the time saved
+		 * is counted in counter.idle_cycles. */
+		uint8_t idle_skip : 1;
+		/* Set to leave cart RAM unmapped for writes until it is written,
+		 * so the first write to each page after a bank switch or
+		 * gb_cart_ram_clean() goes through gb_cart_ram_write(). Lets the
+		 * front-end track which parts of the save changed. */
+		uint8_t cart_ram_track : 1;
 
 		union
 		{
@@ -718,6 +914,23 @@ struct gb_s
 	} direct;
 };
 
+/**
+ * Chunks of a save state, see gb_state_save(). Ids are four characters, first
+ * character in the low byte.
+ */
+#define GB_STATE_ID(a, b, c, d)	((uint32_t)(a) | (uint32_t)(b) << 8 | \
+				 (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+#define GB_STATE_CPU	GB_STATE_ID('C', 'P', 'U', ' ')
+#define GB_STATE_MBC	GB_STATE_ID('M', 'B', 'C', ' ')
+#define GB_STATE_LCD	GB_STATE_ID('L', 'C', 'D', ' ')
+#define GB_STATE_CGB	GB_STATE_ID('C', 'G', 'B', ' ')
+#define GB_STATE_IO	GB_STATE_ID('I', 'O', ' ', ' ')
+#define GB_STATE_OAM	GB_STATE_ID('O', 'A', 'M', ' ')
+#define GB_STATE_VRAM	GB_STATE_ID('V', 'R', 'A', 'M')
+#define GB_STATE_WRAM	GB_STATE_ID('W', 'R', 'A', 'M')
+/* Largest chunk passed to gb_state_load(), with room for fields added later. */
+#define GB_STATE_PACKED_MAX	256
+
 #ifndef PEANUT_GB_HEADER_ONLY
 
 #define IO_JOYP	0x00
@@ -754,11 +967,279 @@ struct gb_s
 #define IO_STAT_MODE_SEARCH_TRANSFER	3
 #define IO_STAT_MODE_VBLANK_OR_TRANSFER_MASK 0x1
 
+/* Memory map page helpers. */
+#define MAP_PAGE_SIZE		0x100
+#define MAP_PAGE(addr)		((addr) >> 8)
+
+/**
+ * Point "count" pages of the memory map, starting at the page of "addr", to
+ * consecutive host memory at "base". A NULL base unmaps the pages.
+ */
+static void __gb_map_pages(const uint8_t **read, uint8_t **write,
+		const uint_fast16_t addr, const uint_fast16_t count,
+		uint8_t *base)
+{
+	for(uint_fast16_t i = 0; i < count; i++)
+	{
+		uint8_t *p = base != NULL ? base + i * MAP_PAGE_SIZE : NULL;
+
+		if(read != NULL)
+			read[MAP_PAGE(addr) + i] = p;
+
+		if(write != NULL)
+			write[MAP_PAGE(addr) + i] = p;
+	}
+}
+
+#if PEANUT_GB_ICACHE_SIZE
+static void __gb_icache_flush(struct gb_s *gb);
+#endif
+
+/**
+ * Return the host memory holding a ROM bank.
+ */
+static uint8_t *__gb_rom_bank(struct gb_s *gb, uint_fast16_t bank)
+{
+	uint8_t *rom = (uint8_t *)gb->map.rom;
+#if PEANUT_GB_ROM_BANK_CACHE
+	uint_fast8_t victim = 1;
+	uint8_t *slot;
+
+	if(gb->rom_cache.count == 0)
+		return rom + bank * ROM_BANK_SIZE;
+
+	/* Bank 0 is pinned to slot 0. */
+	if(bank == 0)
+		return gb->rom_cache.slots;
+
+	gb->rom_cache.tick++;
+
+	for(uint_fast8_t i = 1; i < gb->rom_cache.count; i++)
+	{
+		if(gb->rom_cache.bank[i] == (int_fast16_t)bank)
+		{
+			gb->rom_cache.last_used[i] = gb->rom_cache.tick;
+
+			/* Every MBC write remaps the window, only count a
+			 * switch to another bank. */
+			if((int_fast16_t)bank != gb->rom_cache.mapped)
+				gb->rom_cache.hits++;
+
+			return gb->rom_cache.slots + i * ROM_BANK_SIZE;
+		}
+
+		if(gb->rom_cache.last_used[i] <
+				gb->rom_cache.last_used[victim])
+			victim = i;
+	}
+
+	gb->rom_cache.misses++;
+	gb->rom_cache.bank[victim] = bank;
+	gb->rom_cache.last_used[victim] = gb->rom_cache.tick;
+	slot = gb->rom_cache.slots + victim * ROM_BANK_SIZE;
+
+	if(gb->rom_cache.fill != NULL)
+		gb->rom_cache.fill(gb, slot, bank);
+	else
+		memcpy(slot, rom + bank * ROM_BANK_SIZE, ROM_BANK_SIZE);
+
+#if PEANUT_GB_ICACHE_SIZE
+	/* The instruction cache is tagged by host address, which now holds a
+	 * different bank. */
+	__gb_icache_flush(gb);
+#endif
+	return slot;
+#else
+	return rom + bank * ROM_BANK_SIZE;
+#endif
+}
+
+/**
+ * Map ROM bank 0 and the switchable ROM bank. ROM is never directly writable
+ * as writes to it are MBC register accesses.
+ */
+static void __gb_map_rom(struct gb_s *gb)
+{
+	uint_fast16_t bank = gb->selected_rom_bank;
+
+	if(gb->map.rom == NULL)
+	{
+		__gb_map_pages(gb->map.read, NULL, ROM_0_ADDR, 0x80, NULL);
+		return;
+	}
+
+	__gb_map_pages(gb->map.read, NULL, ROM_0_ADDR, 0x40,
+			__gb_rom_bank(gb, 0));
+
+	/* The boot ROM overlays the first page until it is switched off. */
+	if(gb->hram_io[IO_BANK] == 0 && gb->gb_bootrom_read != NULL)
+		gb->map.read[0] = NULL;
+
+	if(gb->mbc == 1 && gb->cart_mode_select)
+		bank &= 0x1F;
+
+	__gb_map_pages(gb->map.read, NULL, ROM_N_ADDR, 0x40,
+			__gb_rom_bank(gb, bank));
+#if PEANUT_GB_ROM_BANK_CACHE
+	gb->rom_cache.mapped = bank;
+#endif
+}
+
+/**
+ * Select the cart RAM bank and map it. MBC1 only banks RAM in mode 1. Bank
+ * numbers past the end of the save wrap around, and saves smaller than 8 KB
+ * are mirrored across the window, as on the cartridge.
+ */
+static void __gb_map_cart_ram(struct gb_s *gb)
+{
+	uint8_t *ram = gb->map.cart_ram;
+
+	if(gb->cart_mode_select || gb->mbc != 1)
+		gb->cart_ram_offset = (gb->cart_ram_bank * CRAM_BANK_SIZE) &
+			gb->cart_ram_mask;
+	else
+		gb->cart_ram_offset = 0;
+
+	if(ram == NULL || !gb->cart_ram || !gb->enable_cart_ram ||
+			!gb->cart_ram_mask || gb->mbc == 2 ||
+			(gb->mbc == 3 && gb->cart_ram_bank >= 0x08))
+		ram = NULL;
+
+	for(uint_fast16_t i = 0; i < 0x20; i++)
+	{
+		uint8_t *p = ram != NULL ? ram + ((gb->cart_ram_offset +
+				i * MAP_PAGE_SIZE) & gb->cart_ram_mask) : NULL;
+
+		gb->map.read[MAP_PAGE(CART_RAM_ADDR) + i] = p;
+		gb->map.write[MAP_PAGE(CART_RAM_ADDR) + i] =
+			gb->direct.cart_ram_track ? NULL : p;
+	}
+}
+
+/**
+ * Map the selected VRAM bank.
+ */
+static void __gb_map_vram(struct gb_s *gb)
+{
+#if PEANUT_FULL_GBC_SUPPORT
+	uint8_t *vram = gb->vram + (VRAM_ADDR - gb->cgb.vramBankOffset);
+#else
+	uint8_t *vram = gb->vram;
+#endif
+	/* Queued lines are drawn from VRAM later, so while there may be any,
+	 * writes go through __gb_write_slow() to wait for them. */
+	__gb_map_pages(gb->map.read, NULL, VRAM_ADDR, 0x20, vram);
+	__gb_map_pages(NULL, gb->map.write, VRAM_ADDR, 0x20,
+			gb->display.vram_queued ? NULL : vram);
+}
+
+/**
+ * Map WRAM bank 0, the switchable WRAM bank and their echo up to OAM.
+ */
+static void __gb_map_wram(struct gb_s *gb)
+{
+	uint8_t *wram_n = gb->wram + WRAM_BANK_SIZE;
+
+	__gb_map_pages(gb->map.read, gb->map.write, WRAM_0_ADDR, 0x10, gb->wram);
+	__gb_map_pages(gb->map.read, gb->map.write, ECHO_ADDR, 0x10, gb->wram);
+
+#if PEANUT_FULL_GBC_SUPPORT
+	wram_n = gb->wram + (WRAM_1_ADDR - gb->cgb.wramBankOffset);
+
+	/* In DMG mode reads ignore the selected bank. */
+	__gb_map_pages(gb->map.read, NULL, WRAM_1_ADDR, 0x10,
+			gb->cgb.cgbMode ? wram_n : gb->wram + WRAM_BANK_SIZE);
+	__gb_map_pages(NULL, gb->map.write, WRAM_1_ADDR, 0x10, wram_n);
+#else
+	__gb_map_pages(gb->map.read, gb->map.write, WRAM_1_ADDR, 0x10, wram_n);
+#endif
+	/* Echo of the switchable bank, 0xF000 - 0xFDFF. */
+	__gb_map_pages(gb->map.read, gb->map.write, ECHO_ADDR + WRAM_BANK_SIZE,
+			0x0E, wram_n);
+}
+
+/**
+ * Rebuild the whole memory map. OAM, unusable memory, IO and HRAM are always
+ * handled by the slow path.
+ */
+static void __gb_map_all(struct gb_s *gb)
+{
+	__gb_map_pages(gb->map.read, gb->map.write, 0x0000, 0x100, NULL);
+	__gb_map_rom(gb);
+	__gb_map_vram(gb);
+	__gb_map_cart_ram(gb);
+	__gb_map_wram(gb);
+}
+
+/**
+ * Wait until the front-end has drawn every queued line, before VRAM or OAM
+ * change. VRAM writes take the fast path again until the next line is queued.
+ */
+static void __gb_wait_lines(struct gb_s *gb)
+{
+	if(gb->display.lcd_wait_lines == NULL)
+		return;
+
+	gb->display.lcd_wait_lines(gb);
+
+	if(gb->display.vram_queued)
+	{
+		gb->display.vram_queued = 0;
+		__gb_map_vram(gb);
+	}
+}
+
+static uint8_t __gb_read_slow(struct gb_s *gb, uint16_t addr);
+static void __gb_write_slow(struct gb_s *gb, uint_fast16_t addr, uint8_t val);
+static void __gb_sync(struct gb_s *gb);
+static void __gb_schedule(struct gb_s *gb);
+
 /**
  * Internal function used to read bytes.
  * addr is host platform endian.
  */
-uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+static inline uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+{
+	const uint8_t *page = gb->map.read[MAP_PAGE(addr)];
+
+	if(page != NULL)
+		return page[addr & 0xFF];
+
+	return __gb_read_slow(gb, addr);
+}
+
+/**
+ * Internal function used to write bytes.
+ */
+static inline void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+{
+	uint8_t *page = gb->map.write[MAP_PAGE(addr)];
+
+	if(page != NULL)
+	{
+		page[addr & 0xFF] = val;
+		return;
+	}
+
+	__gb_write_slow(gb, addr, val);
+}
+
+#if PEANUT_GB_ICACHE_SIZE
+/**
+ * Empty the instruction cache, for when the ROM behind the memory map may
+ * have changed.
+ */
+static void __gb_icache_flush(struct gb_s *gb)
+{
+	memset(&gb->icache, 0, sizeof(gb->icache));
+}
+#endif
+
+/**
+ * Internal function used to read bytes that are not directly mapped.
+ * addr is host platform endian.
+ */
+static uint8_t __gb_read_slow(struct gb_s *gb, uint16_t addr)
 {
 	switch(PEANUT_GB_GET_MSN16(addr))
 	{
@@ -799,22 +1280,12 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 		{
 			return gb->cart_rtc[gb->cart_ram_bank - 0x08];
 		}
-		else if(gb->cart_ram && gb->enable_cart_ram)
+		else if(gb->cart_ram && gb->enable_cart_ram && gb->cart_ram_mask)
 		{
-			if(gb->mbc == 2)
-			{
-				/* Only 9 bits are available in address. */
-				addr &= 0x1FF;
-				return gb->gb_cart_ram_read(gb, addr);
-			}
-			else if((gb->cart_mode_select || gb->mbc != 1) &&
-					gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR +
-							    (gb->cart_ram_bank * CRAM_BANK_SIZE));
-			}
-			else
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR);
+			/* MBC2 only decodes 9 bits of address, which its
+			 * 512 byte mask keeps. */
+			return gb->gb_cart_ram_read(gb, (addr - CART_RAM_ADDR +
+						gb->cart_ram_offset) & gb->cart_ram_mask);
 		}
 
 		return 0xFF;
@@ -845,6 +1316,14 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 		if(addr < IO_ADDR)
 			return 0xFF;
 
+		/* HRAM and the interrupt enable register. */
+		if(addr >= HRAM_ADDR)
+			return gb->hram_io[addr - IO_ADDR];
+
+		/* DIV and TIMA are only brought up to date when read. */
+		if(addr == IO_ADDR + IO_DIV || addr == IO_ADDR + IO_TIMA)
+			__gb_sync(gb);
+
 		/* APU registers. */
 		if((addr >= 0xFF10) && (addr <= 0xFF3F))
 		{
@@ -921,9 +1400,56 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 }
 
 /**
- * Internal function used to write bytes.
+ * Internal function used to fill the pixel values of each colour of a palette
+ * from a BGP, OBP0 or OBP1 register value.
+ */
+static void __gb_set_palette(uint8_t *palette, const uint8_t *colours,
+		uint8_t val)
+{
+	for(uint_fast8_t c = 0; c < 4; c++)
+		palette[c] = colours[(val >> (c << 1)) & 0x03];
+}
+
+#if PEANUT_FULL_GBC_SUPPORT
+/**
+ * Convert CGB palette colour "i", BG colours then OBJ colours, for the screen.
+ */
+static void __gb_fix_palette(struct gb_s *gb, const uint_fast8_t i)
+{
+	const uint8_t *pal = i < 0x20 ? gb->cgb.BGPalette : gb->cgb.OAMPalette;
+	const uint_fast16_t c = (pal[((i & 0x1F) << 1) + 1] << 8) +
+		pal[(i & 0x1F) << 1];
+
+	// swap Red and Blue
+	gb->cgb.fixPalette[i] = RGB555_TO_RGB888(((c & 0x7C00) >> 10) |
+			(c & 0x03E0) | ((c & 0x001F) << 10));
+	graphics_set_palette(i, gb->cgb.fixPalette[i]);
+}
+#endif
+
+/**
+ * Internal function used to set the pixel values of each shade to the shade,
+ * plus the layer bits if PEANUT_GB_12_COLOUR is enabled.
+ */
+static void __gb_default_colours(uint8_t colours[3][4])
+{
+	for(uint_fast8_t p = 0; p < 3; p++)
+	{
+		for(uint_fast8_t c = 0; c < 4; c++)
+		{
+#if PEANUT_GB_12_COLOUR
+			colours[p][c] = (p << 4) | c;
+#else
+			colours[p][c] = c;
+#endif
+		}
+	}
+}
+
+/**
+ * Internal function used to write bytes that are not directly mapped.
  */
-void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+static void __gb_write_slow(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 {
 	switch(PEANUT_GB_GET_MSN16(addr))
 	{
@@ -933,7 +1459,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		if(gb->mbc > 0 && gb->mbc != 2 && gb->cart_ram)
 		{
 			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-			return;
+			break;
 		}
 
 	/* Intentional fall through. */
@@ -943,7 +1469,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
 			gb->selected_rom_bank =
 				gb->selected_rom_bank & gb->num_rom_banks_mask;
-			return;
+			break;
 		}
 
 	/* Intentional fall through. */
@@ -970,7 +1496,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			else
 			{
 				gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-				return;
+				break;
 			}
 		}
 		else if(gb->mbc == 3)
@@ -984,7 +1510,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->selected_rom_bank = (val & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
 
 		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
-		return;
+		break;
 
 	case 0x4:
 	case 0x5:
@@ -999,15 +1525,16 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		else if(gb->mbc == 5)
 			gb->cart_ram_bank = (val & 0x0F);
 
-		return;
+		break;
 
 	case 0x6:
 	case 0x7:
 		gb->cart_mode_select = (val & 1);
-		return;
+		break;
 
 	case 0x8:
 	case 0x9:
+		__gb_wait_lines(gb);
 #if PEANUT_FULL_GBC_SUPPORT
 		gb->vram[addr - gb->cgb.vramBankOffset] = val;
 #else
@@ -1022,24 +1549,17 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->cart_rtc[gb->cart_ram_bank - 0x08] = val;
 		}
 		/* Do not write to RAM if unavailable or disabled. */
-		else if(gb->cart_ram && gb->enable_cart_ram)
+		else if(gb->cart_ram && gb->enable_cart_ram && gb->cart_ram_mask)
 		{
+			/* Data is only 4 bits wide in MBC2 RAM. */
 			if(gb->mbc == 2)
-			{
-				/* Only 9 bits are available in address. */
-				addr &= 0x1FF;
-				/* Data is only 4 bits wide in MBC2 RAM. */
 				val &= 0x0F;
-				gb->gb_cart_ram_write(gb, addr, val);
-			}
-			else if(gb->cart_mode_select &&
-					gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				gb->gb_cart_ram_write(gb,
-						      addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE), val);
-			}
-			else if(gb->num_ram_banks)
-				gb->gb_cart_ram_write(gb, addr - CART_RAM_ADDR, val);
+
+			gb->gb_cart_ram_write(gb, (addr - CART_RAM_ADDR +
+						gb->cart_ram_offset) & gb->cart_ram_mask, val);
+			/* Tracked pages take further writes directly. */
+			gb->map.write[MAP_PAGE(addr)] =
+				(uint8_t *)gb->map.read[MAP_PAGE(addr)];
 		}
 
 		return;
@@ -1073,7 +1593,9 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 
 		if(addr < UNUSED_ADDR)
 		{
+			__gb_wait_lines(gb);
 			gb->oam[addr - OAM_ADDR] = val;
+			gb->display.sprites_dirty = 1;
 			return;
 		}
 
@@ -1090,15 +1612,20 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		if((addr >= 0xFF10) && (addr <= 0xFF3F))
 		{
 #if ENABLE_SOUND
-			audio_write(addr, val);
+			/* Stamped with the time into the frame, so that it
+			 * is heard at the right sample. */
+			audio_write(addr, val, gb->counter.frame_cycles +
+#if PEANUT_FULL_GBC_SUPPORT
+					(gb->counter.pending >> gb->cgb.doubleSpeed)
+#else
+					gb->counter.pending
+#endif
+					);
 #else
 			gb->hram_io[addr - IO_ADDR] = val;
 #endif
 			return;
 		}
-#if PEANUT_FULL_GBC_SUPPORT
-		uint16_t fixPaletteTemp;
-#endif
 		/* IO and Interrupts. */
 		switch(PEANUT_GB_GET_LSB16(addr))
 		{
@@ -1124,16 +1651,21 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			return;
 
 		case 0x02:
+			__gb_sync(gb);
 			gb->hram_io[IO_SC] = val;
+			__gb_schedule(gb);
 			return;
 
 		/* Timer Registers */
 		case 0x04:
+			__gb_sync(gb);
 			gb->hram_io[IO_DIV] = 0x00;
 			return;
 
 		case 0x05:
+			__gb_sync(gb);
 			gb->hram_io[IO_TIMA] = val;
+			__gb_schedule(gb);
 			return;
 
 		case 0x06:
@@ -1141,7 +1673,9 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			return;
 
 		case 0x07:
+			__gb_sync(gb);
 			gb->hram_io[IO_TAC] = val;
+			__gb_schedule(gb);
 			return;
 
 		/* Interrupt Flag Register */
@@ -1154,6 +1688,8 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		{
 			uint8_t lcd_enabled;
 
+			__gb_sync(gb);
+
 			/* Check if LCD is already enabled. */
 			lcd_enabled = (gb->hram_io[IO_LCDC] & LCDC_ENABLE);
 
@@ -1180,6 +1716,8 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 				/* Reset LCD timer. */
 				gb->counter.lcd_count = 0;
 			}
+
+			__gb_schedule(gb);
 			return;
 		}
 
@@ -1212,10 +1750,13 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			dma_addr = (uint_fast16_t)val << 8;
 			gb->hram_io[IO_DMA] = val;
 #endif
+			__gb_wait_lines(gb);
+
 			for(i = 0; i < OAM_SIZE; i++)
 			{
 				gb->oam[i] = __gb_read(gb, dma_addr + i);
 			}
+			gb->display.sprites_dirty = 1;
 
 			return;
 		}
@@ -1223,26 +1764,20 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		/* DMG Palette Registers */
 		case 0x47:
 			gb->hram_io[IO_BGP] = val;
-			gb->display.bg_palette[0] = (gb->hram_io[IO_BGP] & 0x03);
-			gb->display.bg_palette[1] = (gb->hram_io[IO_BGP] >> 2) & 0x03;
-			gb->display.bg_palette[2] = (gb->hram_io[IO_BGP] >> 4) & 0x03;
-			gb->display.bg_palette[3] = (gb->hram_io[IO_BGP] >> 6) & 0x03;
+			__gb_set_palette(gb->display.bg_palette,
+					gb->display.colours[2], val);
 			return;
 
 		case 0x48:
 			gb->hram_io[IO_OBP0] = val;
-			gb->display.sp_palette[0] = (gb->hram_io[IO_OBP0] & 0x03);
-			gb->display.sp_palette[1] = (gb->hram_io[IO_OBP0] >> 2) & 0x03;
-			gb->display.sp_palette[2] = (gb->hram_io[IO_OBP0] >> 4) & 0x03;
-			gb->display.sp_palette[3] = (gb->hram_io[IO_OBP0] >> 6) & 0x03;
+			__gb_set_palette(gb->display.sp_palette,
+					gb->display.colours[0], val);
 			return;
 
 		case 0x49:
 			gb->hram_io[IO_OBP1] = val;
-			gb->display.sp_palette[4] = (gb->hram_io[IO_OBP1] & 0x03);
-			gb->display.sp_palette[5] = (gb->hram_io[IO_OBP1] >> 2) & 0x03;
-			gb->display.sp_palette[6] = (gb->hram_io[IO_OBP1] >> 4) & 0x03;
-			gb->display.sp_palette[7] = (gb->hram_io[IO_OBP1] >> 6) & 0x03;
+			__gb_set_palette(gb->display.sp_palette + 4,
+					gb->display.colours[1], val);
 			return;
 
 		/* Window Position Registers */
@@ -1264,11 +1799,13 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		case 0x4F:
 			gb->cgb.vramBank = val & 0x01;
 			if(gb->cgb.cgbMode) gb->cgb.vramBankOffset = VRAM_ADDR - (gb->cgb.vramBank << 13);
+			__gb_map_vram(gb);
 			return;
 #endif
 		/* Turn off boot ROM */
 		case 0x50:
 			gb->hram_io[IO_BANK] = val;
+			__gb_map_rom(gb);
 			return;
 #if PEANUT_FULL_GBC_SUPPORT
 		/* DMA Register */
@@ -1320,10 +1857,8 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		/* CGB BG Palette*/
 		case 0x69:
 			gb->cgb.BGPalette[(gb->cgb.BGPaletteID & 0x3F)] = val;
-			fixPaletteTemp = (gb->cgb.BGPalette[(gb->cgb.BGPaletteID & 0x3E) + 1] << 8) + (gb->cgb.BGPalette[(gb->cgb.BGPaletteID & 0x3E)]);
-			gb->cgb.fixPalette[((gb->cgb.BGPaletteID & 0x3E) >> 1)] = RGB555_TO_RGB888(((fixPaletteTemp & 0x7C00) >> 10) | (fixPaletteTemp & 0x03E0) | ((fixPaletteTemp & 0x001F) << 10));  // swap Red and Blue
-			graphics_set_palette((gb->cgb.BGPaletteID & 0x3E) >> 1,gb->cgb.fixPalette[((gb->cgb.BGPaletteID & 0x3E) >> 1)]);
-			if(gb->cgb.BGPaletteInc) gb->cgb.BGPaletteID = (++gb->cgb.BGPaletteID) & 0x3F;
+			__gb_fix_palette(gb, (gb->cgb.BGPaletteID & 0x3E) >> 1);
+			if(gb->cgb.BGPaletteInc) gb->cgb.BGPaletteID = (gb->cgb.BGPaletteID + 1) & 0x3F;
 			return;
 
 		/* CGB OAM Palette Index*/
@@ -1335,11 +1870,8 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		/* CGB OAM Palette*/
 		case 0x6B:
 			gb->cgb.OAMPalette[(gb->cgb.OAMPaletteID & 0x3F)] = val;
-			fixPaletteTemp = (gb->cgb.OAMPalette[(gb->cgb.OAMPaletteID & 0x3E) + 1] << 8) + (gb->cgb.OAMPalette[(gb->cgb.OAMPaletteID & 0x3E)]);
-
-			gb->cgb.fixPalette[0x20 + ((gb->cgb.OAMPaletteID & 0x3E) >> 1)] = RGB555_TO_RGB888(((fixPaletteTemp & 0x7C00) >> 10) | (fixPaletteTemp & 0x03E0) | ((fixPaletteTemp & 0x001F) << 10));  // swap Red and Blue
-			graphics_set_palette(0x20 + ((gb->cgb.OAMPaletteID & 0x3E) >> 1), gb->cgb.fixPalette[0x20 + ((gb->cgb.OAMPaletteID & 0x3E) >> 1)]);
-			if(gb->cgb.OAMPaletteInc) gb->cgb.OAMPaletteID = (++gb->cgb.OAMPaletteID) & 0x3F;
+			__gb_fix_palette(gb, 0x20 + ((gb->cgb.OAMPaletteID & 0x3E) >> 1));
+			if(gb->cgb.OAMPaletteInc) gb->cgb.OAMPaletteID = (gb->cgb.OAMPaletteID + 1) & 0x3F;
 			return;
 
 		/* CGB WRAM Bank*/
@@ -1347,6 +1879,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->cgb.wramBank = val;
 			gb->cgb.wramBankOffset = WRAM_1_ADDR - (1 << 12);
 			if(gb->cgb.cgbMode && (gb->cgb.wramBank & 7) > 0) gb->cgb.wramBankOffset = WRAM_1_ADDR - ((gb->cgb.wramBank & 7) << 12);
+			__gb_map_wram(gb);
 			return;
 #endif
 
@@ -1357,14 +1890,22 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		}
 	}
 
+	/* Writes to the MBC may have changed the ROM or cart RAM mapping. */
+	if(addr < VRAM_ADDR)
+	{
+		__gb_map_rom(gb);
+		__gb_map_cart_ram(gb);
+	}
+
 	/* Invalid writes are ignored. */
 	return;
 }
 
-uint8_t __gb_execute_cb(struct gb_s *gb)
+
+static inline uint8_t __gb_execute_cb(struct gb_s *gb,
+		struct cpu_registers_s *cpu, uint8_t cbop)
 {
 	uint8_t inst_cycles;
-	uint8_t cbop = __gb_read(gb, gb->cpu_reg.pc.reg++);
 	uint8_t r = (cbop & 0x7);
 	uint8_t b = (cbop >> 3) & 0x7;
 	uint8_t d = (cbop >> 3) & 0x1;
@@ -1388,37 +1929,37 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 	switch(r)
 	{
 	case 0:
-		val = gb->cpu_reg.bc.bytes.b;
+		val = cpu->bc.bytes.b;
 		break;
 
 	case 1:
-		val = gb->cpu_reg.bc.bytes.c;
+		val = cpu->bc.bytes.c;
 		break;
 
 	case 2:
-		val = gb->cpu_reg.de.bytes.d;
+		val = cpu->de.bytes.d;
 		break;
 
 	case 3:
-		val = gb->cpu_reg.de.bytes.e;
+		val = cpu->de.bytes.e;
 		break;
 
 	case 4:
-		val = gb->cpu_reg.hl.bytes.h;
+		val = cpu->hl.bytes.h;
 		break;
 
 	case 5:
-		val = gb->cpu_reg.hl.bytes.l;
+		val = cpu->hl.bytes.l;
 		break;
 
 	case 6:
-		val = __gb_read(gb, gb->cpu_reg.hl.reg);
+		val = __gb_read(gb, cpu->hl.reg);
 		break;
 
 	/* Only values 0-7 are possible here, so we make the final case
 	 * default to satisfy -Wmaybe-uninitialized warning. */
 	default:
-		val = gb->cpu_reg.a;
+		val = cpu->a;
 		break;
 	}
 
@@ -1436,21 +1977,21 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 			{
 				uint8_t temp = val;
 				val = (val >> 1);
-				val |= cbop ? (gb->cpu_reg.f_bits.c << 7) : (temp << 7);
-				gb->cpu_reg.f_bits.z = (val == 0x00);
-				gb->cpu_reg.f_bits.n = 0;
-				gb->cpu_reg.f_bits.h = 0;
-				gb->cpu_reg.f_bits.c = (temp & 0x01);
+				val |= cbop ? (cpu->f_bits.c << 7) : (temp << 7);
+				cpu->f_bits.z = (val == 0x00);
+				cpu->f_bits.n = 0;
+				cpu->f_bits.h = 0;
+				cpu->f_bits.c = (temp & 0x01);
 			}
 			else /* RLC R / RL R */
 			{
 				uint8_t temp = val;
 				val = (val << 1);
-				val |= cbop ? gb->cpu_reg.f_bits.c : (temp >> 7);
-				gb->cpu_reg.f_bits.z = (val == 0x00);
-				gb->cpu_reg.f_bits.n = 0;
-				gb->cpu_reg.f_bits.h = 0;
-				gb->cpu_reg.f_bits.c = (temp >> 7);
+				val |= cbop ? cpu->f_bits.c : (temp >> 7);
+				cpu->f_bits.z = (val == 0x00);
+				cpu->f_bits.n = 0;
+				cpu->f_bits.h = 0;
+				cpu->f_bits.c = (temp >> 7);
 			}
 
 			break;
@@ -1458,19 +1999,19 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 		case 0x2:
 			if(d) /* SRA R */
 			{
-				gb->cpu_reg.f_bits.c = val & 0x01;
+				cpu->f_bits.c = val & 0x01;
 				val = (val >> 1) | (val & 0x80);
-				gb->cpu_reg.f_bits.z = (val == 0x00);
-				gb->cpu_reg.f_bits.n = 0;
-				gb->cpu_reg.f_bits.h = 0;
+				cpu->f_bits.z = (val == 0x00);
+				cpu->f_bits.n = 0;
+				cpu->f_bits.h = 0;
 			}
 			else /* SLA R */
 			{
-				gb->cpu_reg.f_bits.c = (val >> 7);
+				cpu->f_bits.c = (val >> 7);
 				val = val << 1;
-				gb->cpu_reg.f_bits.z = (val == 0x00);
-				gb->cpu_reg.f_bits.n = 0;
-				gb->cpu_reg.f_bits.h = 0;
+				cpu->f_bits.z = (val == 0x00);
+				cpu->f_bits.n = 0;
+				cpu->f_bits.h = 0;
 			}
 
 			break;
@@ -1478,21 +2019,21 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 		case 0x3:
 			if(d) /* SRL R */
 			{
-				gb->cpu_reg.f_bits.c = val & 0x01;
+				cpu->f_bits.c = val & 0x01;
 				val = val >> 1;
-				gb->cpu_reg.f_bits.z = (val == 0x00);
-				gb->cpu_reg.f_bits.n = 0;
-				gb->cpu_reg.f_bits.h = 0;
+				cpu->f_bits.z = (val == 0x00);
+				cpu->f_bits.n = 0;
+				cpu->f_bits.h = 0;
 			}
 			else /* SWAP R */
 			{
 				uint8_t temp = (val >> 4) & 0x0F;
 				temp |= (val << 4) & 0xF0;
 				val = temp;
-				gb->cpu_reg.f_bits.z = (val == 0x00);
-				gb->cpu_reg.f_bits.n = 0;
-				gb->cpu_reg.f_bits.h = 0;
-				gb->cpu_reg.f_bits.c = 0;
+				cpu->f_bits.z = (val == 0x00);
+				cpu->f_bits.n = 0;
+				cpu->f_bits.h = 0;
+				cpu->f_bits.c = 0;
 			}
 
 			break;
@@ -1501,9 +2042,9 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 		break;
 
 	case 0x1: /* BIT B, R */
-		gb->cpu_reg.f_bits.z = !((val >> b) & 0x1);
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = 1;
+		cpu->f_bits.z = !((val >> b) & 0x1);
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = 1;
 		writeback = 0;
 		break;
 
@@ -1521,35 +2062,35 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 		switch(r)
 		{
 		case 0:
-			gb->cpu_reg.bc.bytes.b = val;
+			cpu->bc.bytes.b = val;
 			break;
 
 		case 1:
-			gb->cpu_reg.bc.bytes.c = val;
+			cpu->bc.bytes.c = val;
 			break;
 
 		case 2:
-			gb->cpu_reg.de.bytes.d = val;
+			cpu->de.bytes.d = val;
 			break;
 
 		case 3:
-			gb->cpu_reg.de.bytes.e = val;
+			cpu->de.bytes.e = val;
 			break;
 
 		case 4:
-			gb->cpu_reg.hl.bytes.h = val;
+			cpu->hl.bytes.h = val;
 			break;
 
 		case 5:
-			gb->cpu_reg.hl.bytes.l = val;
+			cpu->hl.bytes.l = val;
 			break;
 
 		case 6:
-			__gb_write(gb, gb->cpu_reg.hl.reg, val);
+			__gb_write(gb, cpu->hl.reg, val);
 			break;
 
 		case 7:
-			gb->cpu_reg.a = val;
+			cpu->a = val;
 			break;
 		}
 	}
@@ -1557,414 +2098,273 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 }
 
 #if ENABLE_LCD
-struct sprite_data {
-	uint8_t sprite_number;
-	uint8_t x;
-};
-
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-static int compare_sprites(const void *in1, const void *in2)
+/**
+ * Internal function used to sort sprites into the lines they are on. Like the
+ * hardware, only the first ten sprites in OAM found on a line are kept. On the
+ * DMG they are then ordered by X position when high LCD accuracy is enabled,
+ * otherwise by OAM position, highest priority first.
+ */
+template<bool cgb_mode>
+static void __gb_build_sprite_lines(struct gb_s *gb, const uint8_t height)
 {
-	const struct sprite_data *sd1, *sd2;
-	int x_res;
+	uint_fast8_t s;
 
-	sd1 = (struct sprite_data *)in1;
-	sd2 = (struct sprite_data *)in2;
-	x_res = (int)sd1->x - (int)sd2->x;
-	if(x_res != 0)
-		return x_res;
+	memset(gb->display.line_sprite_count, 0,
+			sizeof(gb->display.line_sprite_count));
 
-	return (int)sd1->sprite_number - (int)sd2->sprite_number;
-}
-#endif
+	for(s = 0; s < NUM_SPRITES; s++)
+	{
+		/* Sprite Y position. */
+		const int_fast16_t top = (int_fast16_t)gb->oam[s << 2] - 16;
+		int_fast16_t line = top < 0 ? 0 : top;
+		const int_fast16_t bottom = MIN(top + height, LCD_HEIGHT);
 
-void __gb_draw_line(struct gb_s *gb)
-{
-	uint8_t pixels[160] = {0};
+		for(; line < bottom; line++)
+		{
+			uint8_t *sprites = gb->display.line_sprites[line];
+			uint_fast8_t n = gb->display.line_sprite_count[line];
 
-	/* If LCD not initialised by front-end, don't render anything. */
-	if(gb->display.lcd_draw_line == NULL)
-		return;
+			if(n == MAX_SPRITES_LINE)
+				continue;
 
-	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
-		return;
+			gb->display.line_sprite_count[line] = n + 1;
 
-#if PEANUT_FULL_GBC_SUPPORT
-	uint8_t pixelsPrio[160] = {0};  //do these pixels have priority over OAM?
+#if PEANUT_GB_HIGH_LCD_ACCURACY
+			/* Smaller X has priority, then smaller OAM position. */
+			if(!cgb_mode)
+			{
+				const uint8_t x = gb->oam[(s << 2) + 1];
+
+				while(n && gb->oam[(sprites[n - 1] << 2) + 1] > x)
+				{
+					sprites[n] = sprites[n - 1];
+					n--;
+				}
+			}
 #endif
-	/* If interlaced mode is activated, check if we need to draw the current
-	 * line. */
-	if(gb->direct.interlace)
-	{
-		if((gb->display.interlace_count == 0
-				&& (gb->hram_io[IO_LY] & 1) == 0)
-				|| (gb->display.interlace_count == 1
-				    && (gb->hram_io[IO_LY] & 1) == 1))
-		{
-			/* Compensate for missing window draw if required. */
-			if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-					&& gb->hram_io[IO_LY] >= gb->display.WY
-					&& gb->hram_io[IO_WX] <= 166)
-				gb->display.window_clear++;
-
-			return;
+			sprites[n] = s;
 		}
 	}
 
-	/* If background is enabled, draw it. */
-#if PEANUT_FULL_GBC_SUPPORT
-	if(gb->cgb.cgbMode || gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
-#else
-	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
-#endif
-	{
-		uint8_t bg_y, disp_x, bg_x, idx, py, px, t1, t2;
-		uint16_t bg_map, tile;
-
-		/* Calculate current background line to draw. Constant because
-		 * this function draws only this one line each time it is
-		 * called. */
-		bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
-
-		/* Get selected background map address for first tile
-		 * corresponding to current line.
-		 * 0x20 (32) is the width of a background tile, and the bit
-		 * shift is to calculate the address. */
-		bg_map =
-			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
-			 VRAM_BMAP_2 : VRAM_BMAP_1)
-			+ ((bg_y >> 3) << 5);
-
-		/* The displays (what the player sees) X coordinate, drawn right
-		 * to left. */
-		disp_x = LCD_WIDTH - 1;
-
-		/* The X coordinate to begin drawing the background at. */
-		bg_x = disp_x + gb->hram_io[IO_SCX];
-
-		/* Get tile index for current background tile. */
-		idx = gb->vram[bg_map + (bg_x >> 3)];
-#if PEANUT_FULL_GBC_SUPPORT
-		uint8_t idxAtt = gb->vram[bg_map + (bg_x >> 3) + 0x2000];
-#endif
-		/* Y coordinate of tile pixel to draw. */
-		py = (bg_y & 0x07);
-		/* X coordinate of tile pixel to draw. */
-		px = 7 - (bg_x & 0x07);
-
-		/* Select addressing mode. */
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-			tile = VRAM_TILES_1 + (idx << 4);
-		else
-			tile = VRAM_TILES_2 + (((idx + 0x80) % 0x100) << 4);
-
-#if PEANUT_FULL_GBC_SUPPORT
-		if(gb->cgb.cgbMode)
-		{
-			if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
-			if(idxAtt & 0x40) tile += 2 * (7 - py);
-		}
-		if(!(idxAtt & 0x40))
-		{
-			tile += py << 1;
-		}
+	gb->display.sprites_height = height;
+	gb->display.sprites_dirty = 0;
+}
 
-		/* fetch first tile */
-		if(gb->cgb.cgbMode && (idxAtt & 0x20))
-		{  //Horizantal Flip
-			t1 = gb->vram[tile] << px;
-			t2 = gb->vram[tile + 1] << px;
-		}
-		else
-		{
-			t1 = gb->vram[tile] >> px;
-			t2 = gb->vram[tile + 1] >> px;
-		}
+/* Colour numbers of the eight pixels of a tile row, one byte each from the
+ * left, for each value of one bitplane byte. Not const so that targets running
+ * from flash keep it in RAM. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+# define PGB_TILE_PIXEL(b, i)	((uint64_t)((b) >> (7 - (i)) & 1) << (56 - 8 * (i)))
 #else
-		tile += 2 * py;
-
-		/* fetch first tile */
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
+# define PGB_TILE_PIXEL(b, i)	((uint64_t)((b) >> (7 - (i)) & 1) << (8 * (i)))
 #endif
-		for(; disp_x != 0xFF; disp_x--)
-		{
-			uint8_t c;
-
-			if(px == 8)
-			{
-				/* fetch next tile */
-				px = 0;
-				bg_x = disp_x + gb->hram_io[IO_SCX];
-				idx = gb->vram[bg_map + (bg_x >> 3)];
-#if PEANUT_FULL_GBC_SUPPORT
-				idxAtt = gb->vram[bg_map + (bg_x >> 3) + 0x2000];
+#define PGB_TILE_ROW(b)		(PGB_TILE_PIXEL(b, 0) | PGB_TILE_PIXEL(b, 1) | \
+				 PGB_TILE_PIXEL(b, 2) | PGB_TILE_PIXEL(b, 3) | \
+				 PGB_TILE_PIXEL(b, 4) | PGB_TILE_PIXEL(b, 5) | \
+				 PGB_TILE_PIXEL(b, 6) | PGB_TILE_PIXEL(b, 7))
+#define PGB_TILE_ROW4(b)	PGB_TILE_ROW(b), PGB_TILE_ROW(b + 1), \
+				PGB_TILE_ROW(b + 2), PGB_TILE_ROW(b + 3)
+#define PGB_TILE_ROW16(b)	PGB_TILE_ROW4(b), PGB_TILE_ROW4(b + 4), \
+				PGB_TILE_ROW4(b + 8), PGB_TILE_ROW4(b + 12)
+#define PGB_TILE_ROW64(b)	PGB_TILE_ROW16(b), PGB_TILE_ROW16(b + 16), \
+				PGB_TILE_ROW16(b + 32), PGB_TILE_ROW16(b + 48)
+static uint64_t tile_row_pixels[0x100] = {
+	PGB_TILE_ROW64(0x00), PGB_TILE_ROW64(0x40),
+	PGB_TILE_ROW64(0x80), PGB_TILE_ROW64(0xC0)
+};
+#undef PGB_TILE_ROW64
+#undef PGB_TILE_ROW16
+#undef PGB_TILE_ROW4
+#undef PGB_TILE_ROW
+#undef PGB_TILE_PIXEL
+
+/* Reverse the pixels of a decoded tile row for horizontal flip. */
+#if __has_builtin(__builtin_bswap64)
+# define PGB_TILE_FLIP(row)	__builtin_bswap64(row)
+#else
+static inline uint64_t PGB_TILE_FLIP(uint64_t row)
+{
+	row = (row & 0x00FF00FF00FF00FF) << 8 | (row >> 8 & 0x00FF00FF00FF00FF);
+	row = (row & 0x0000FFFF0000FFFF) << 16 | (row >> 16 & 0x0000FFFF0000FFFF);
+	return row << 32 | row >> 32;
+}
 #endif
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-					tile = VRAM_TILES_1 + (idx << 4);
-				else
-					tile = VRAM_TILES_2 + (((idx + 0x80) % 0x100) << 4);
 
 #if PEANUT_FULL_GBC_SUPPORT
-				if(gb->cgb.cgbMode)
-				{
-					if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
-					if(idxAtt & 0x40) tile += 2 * (7 - py);
-				}
-				if(!(idxAtt & 0x40))
-				{
-                    tile += py << 1;
-				}
+# define PGB_PIXELS_PRIO(prio)	prio
 #else
-                tile += py << 1;
+# define PGB_PIXELS_PRIO(prio)	NULL
 #endif
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
-			}
 
-			/* copy background */
+/**
+ * Internal function used to draw "width" pixels of one row of a tile map
+ * from display X position "disp_x". "map" is the address of the map row,
+ * "map_x" the X position in it to start at and "py" the pixel row within the
+ * tiles. Whole tile rows are decoded eight pixels at a time into a buffer
+ * aligned to the tiles, then copied to the line.
+ */
+template<bool cgb_mode>
+static void __gb_draw_tiles(struct gb_s *gb, const struct gb_line_s *line,
+		uint8_t *pixels, uint8_t *pixels_prio,
+		uint_fast8_t disp_x, uint_fast8_t width,
+		uint_fast16_t map, uint8_t map_x, uint_fast8_t py)
+{
+	uint64_t row[LCD_WIDTH / 8 + 1];
 #if PEANUT_FULL_GBC_SUPPORT
-			if(gb->cgb.cgbMode && (idxAtt & 0x20))
-			{  //Horizantal Flip
-				c = (((t1 & 0x80) >> 1) | (t2 & 0x80)) >> 6;
-				pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
-				pixelsPrio[disp_x] = (idxAtt >> 7);
-				t1 = t1 << 1;
-				t2 = t2 << 1;
-			}
-			else
-			{
-				c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-				if(gb->cgb.cgbMode)
-				{
-					pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
-					pixelsPrio[disp_x] = (idxAtt >> 7);
-				}
-				else
-				{
-					pixels[disp_x] = gb->display.bg_palette[c];
-#if PEANUT_GB_12_COLOUR
-					pixels[disp_x] |= LCD_PALETTE_BG;
-#endif
-				}
-				t1 = t1 >> 1;
-				t2 = t2 >> 1;
-			}
-#else
-			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
-#if PEANUT_GB_12_COLOUR
-			pixels[disp_x] |= LCD_PALETTE_BG;
-#endif
-			t1 = t1 >> 1;
-			t2 = t2 >> 1;
+	uint64_t prio[LCD_WIDTH / 8 + 1];
 #endif
-			px++;
-		}
-	}
+	const uint_fast8_t tiles = ((map_x & 0x07) + width + 7) >> 3;
+	const uint8_t *src = (const uint8_t *)row + (map_x & 0x07);
 
-	/* draw window */
-	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-			&& gb->hram_io[IO_LY] >= gb->display.WY
-			&& gb->hram_io[IO_WX] <= 166)
-	{
-		uint16_t win_line, tile;
-		uint8_t disp_x, win_x, py, px, idx, t1, t2, end;
-
-		/* Calculate Window Map Address. */
-		win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
-				    VRAM_BMAP_2 : VRAM_BMAP_1;
-		win_line += (gb->display.window_clear >> 3) << 5;
+	(void)pixels_prio;
 
-		disp_x = LCD_WIDTH - 1;
-		win_x = disp_x - gb->hram_io[IO_WX] + 7;
-
-		// look up tile
-		py = gb->display.window_clear & 0x07;
-		px = 7 - (win_x & 0x07);
-		idx = gb->vram[win_line + (win_x >> 3)];
+	for(uint_fast8_t i = 0; i < tiles; i++)
+	{
+		const uint_fast8_t col = ((map_x >> 3) + i) & 0x1F;
+		const uint8_t idx = gb->vram[map + col];
+		uint_fast16_t tile;
+		uint_fast8_t tile_y = py;
+		uint64_t pixels_row;
 #if PEANUT_FULL_GBC_SUPPORT
-		uint8_t idxAtt = gb->vram[win_line + (win_x >> 3) + 0x2000];
+		const uint8_t idxAtt = cgb_mode ? gb->vram[map + col + 0x2000] : 0;
 #endif
 
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+		/* Select addressing mode. */
+		if(line->lcdc & LCDC_TILE_SELECT)
 			tile = VRAM_TILES_1 + (idx << 4);
 		else
 			tile = VRAM_TILES_2 + (((idx + 0x80) % 0x100) << 4);
 
 #if PEANUT_FULL_GBC_SUPPORT
-		if(gb->cgb.cgbMode)
+		if(cgb_mode)
 		{
 			if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
-			if(idxAtt & 0x40) tile += 2 * (7 - py);
-		}
-		if(!(idxAtt & 0x40))
-		{
-            tile += py << 1;
+			if(idxAtt & 0x40) tile_y = 7 - py; //Vertical Flip
 		}
+#endif
+		tile += tile_y << 1;
 
-		// fetch first tile
-		if(gb->cgb.cgbMode && (idxAtt & 0x20))
-		{  //Horizantal Flip
-			t1 = gb->vram[tile] << px;
-			t2 = gb->vram[tile + 1] << px;
-		}
-		else
+		pixels_row = tile_row_pixels[gb->vram[tile]] |
+			tile_row_pixels[gb->vram[tile + 1]] << 1;
+
+#if PEANUT_FULL_GBC_SUPPORT
+		if(cgb_mode)
 		{
-			t1 = gb->vram[tile] >> px;
-			t2 = gb->vram[tile + 1] >> px;
-		}
-#else
-        tile += py << 1;
+			if(idxAtt & 0x20) //Horizantal Flip
+				pixels_row = PGB_TILE_FLIP(pixels_row);
 
-		// fetch first tile
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
+			/* Palette number above the colour number. */
+			pixels_row += 0x0101010101010101 * ((idxAtt & 0x07) << 2);
+			prio[i] = 0x0101010101010101 * (idxAtt >> 7);
+		}
 #endif
-		// loop & copy window
-		end = (gb->hram_io[IO_WX] < 7 ? 0 : gb->hram_io[IO_WX] - 7) - 1;
-
-		for(; disp_x != end; disp_x--)
-		{
-			uint8_t c;
+		row[i] = pixels_row;
+	}
 
-			if(px == 8)
-			{
-				// fetch next tile
-				px = 0;
-				win_x = disp_x - gb->hram_io[IO_WX] + 7;
-				idx = gb->vram[win_line + (win_x >> 3)];
 #if PEANUT_FULL_GBC_SUPPORT
-				idxAtt = gb->vram[win_line + (win_x >> 3) + 0x2000];
+	if(cgb_mode)
+	{
+		memcpy(pixels + disp_x, src, width);
+		memcpy(pixels_prio + disp_x, (const uint8_t *)prio + (map_x & 0x07), width);
+		return;
+	}
 #endif
 
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-					tile = VRAM_TILES_1 + (idx << 4);
-				else
-					tile = VRAM_TILES_2 + (((idx + 0x80) % 0x100) << 4);
+	for(uint_fast8_t x = 0; x < width; x++)
+		pixels[disp_x + x] = line->bg_palette[src[x]];
+}
 
+/**
+ * Internal function used to render a line from its captured registers.
+ * Instantiated separately for DMG and CGB mode, so the DMG renderer carries no
+ * CGB checks.
+ */
+template<bool cgb_mode>
+static void __gb_render_line(struct gb_s *gb, const struct gb_line_s *line)
+{
+	uint8_t line_pixels[LCD_WIDTH];
+	uint8_t *const pixels = gb->display.framebuffer != NULL ?
+		gb->display.framebuffer + line->ly * LCD_WIDTH : line_pixels;
 #if PEANUT_FULL_GBC_SUPPORT
-				if(gb->cgb.cgbMode)
-				{
-					if(idxAtt & 0x08) tile += 0x2000; //VRAM bank 2
-					if(idxAtt & 0x40) tile += 2 * (7 - py);
-				}
-				if(!(idxAtt & 0x40))
-				{
-                    tile += py << 1;
-				}
-#else
-                tile += py << 1;
+	uint8_t pixelsPrio[160] = {0};  //do these pixels have priority over OAM?
 #endif
-				t1 = gb->vram[tile];
-				t2 = gb->vram[tile + 1];
-			}
 
-			// copy window
+	/* If background is enabled, draw it. */
 #if PEANUT_FULL_GBC_SUPPORT
-			if(idxAtt & 0x20)
-			{  //Horizantal Flip
-				c = (((t1 & 0x80) >> 1) | (t2 & 0x80)) >> 6;
-				pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
-				pixelsPrio[disp_x] = (idxAtt >> 7);
-				t1 = t1 << 1;
-				t2 = t2 << 1;
-			}
-			else
-			{
-				c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-				if(gb->cgb.cgbMode)
-				{
-					pixels[disp_x] = ((idxAtt & 0x07) << 2) + c;
-					pixelsPrio[disp_x] = (idxAtt >> 7);
-				}
-				else
-				{
-					pixels[disp_x] = gb->display.bg_palette[c];
-#if PEANUT_GB_12_COLOUR
-					pixels[disp_x] |= LCD_PALETTE_BG;
-#endif
-				}
-				t1 = t1 >> 1;
-				t2 = t2 >> 1;
-			}
+	if(cgb_mode || line->lcdc & LCDC_BG_ENABLE)
 #else
-			c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
-#if PEANUT_GB_12_COLOUR
-			pixels[disp_x] |= LCD_PALETTE_BG;
+	if(line->lcdc & LCDC_BG_ENABLE)
 #endif
-			t1 = t1 >> 1;
-			t2 = t2 >> 1;
-#endif
-			px++;
-		}
+	{
+		uint8_t bg_y, bg_x;
+		uint16_t bg_map;
 
-		gb->display.window_clear++; // advance window line
+		/* Calculate current background line to draw. Constant because
+		 * this function draws only this one line each time it is
+		 * called. */
+		bg_y = line->ly + line->scy;
+
+		/* Get selected background map address for first tile
+		 * corresponding to current line.
+		 * 0x20 (32) is the width of a background tile, and the bit
+		 * shift is to calculate the address. */
+		bg_map =
+			((line->lcdc & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ ((bg_y >> 3) << 5);
+
+		/* The X coordinate to begin drawing the background at. */
+		bg_x = line->scx;
+
+		/* 21 tiles cover the line when it starts part way into one. */
+		__gb_draw_tiles<cgb_mode>(gb, line, pixels, PGB_PIXELS_PRIO(pixelsPrio),
+				0, LCD_WIDTH, bg_map, bg_x, bg_y & 0x07);
+	}
+	else
+	{
+		/* A disabled background shows as white. */
+		memset(pixels, gb->display.colours[2][0], LCD_WIDTH);
 	}
 
-	// draw sprites
-	if(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)
+	/* draw window */
+	if(line->lcdc & LCDC_WINDOW_ENABLE)
 	{
-		uint8_t sprite_number;
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-		uint8_t number_of_sprites = 0;
+		uint16_t win_line;
+		uint8_t disp_x;
+
+		/* Calculate Window Map Address. */
+		win_line = (line->lcdc & LCDC_WINDOW_MAP) ?
+				    VRAM_BMAP_2 : VRAM_BMAP_1;
+		win_line += (line->window_line >> 3) << 5;
 
-		struct sprite_data sprites_to_render[NUM_SPRITES];
+		/* The window starts at WX - 7, cut off at the left edge. */
+		disp_x = line->wx < 7 ? 0 : line->wx - 7;
 
-		/* Record number of sprites on the line being rendered, limited
-		 * to the maximum number sprites that the Game Boy is able to
-		 * render on each line (10 sprites). */
-		for(sprite_number = 0;
-				sprite_number < PEANUT_GB_ARRAYSIZE(sprites_to_render);
-				sprite_number++)
-		{
-			/* Sprite Y position. */
-			uint8_t OY = gb->oam[sprite_number << 2];
-			/* Sprite X position. */
-			uint8_t OX = gb->oam[(sprite_number << 2)+ 1];
+		__gb_draw_tiles<cgb_mode>(gb, line, pixels, PGB_PIXELS_PRIO(pixelsPrio),
+				disp_x, LCD_WIDTH - disp_x, win_line,
+				disp_x - line->wx + 7,
+				line->window_line & 0x07);
+	}
 
-			/* If sprite isn't on this line, continue. */
-			if(gb->hram_io[IO_LY] +
-				(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY
-					|| gb->hram_io[IO_LY] + 16 < OY)
-				continue;
+	// draw sprites
+	if(line->lcdc & LCDC_OBJ_ENABLE)
+	{
+		const uint8_t height = line->lcdc & LCDC_OBJ_SIZE ? 16 : 8;
+		const uint8_t *sprites;
+		uint8_t sprite_number;
 
+		if(gb->display.sprites_dirty ||
+				gb->display.sprites_height != height)
+			__gb_build_sprite_lines<cgb_mode>(gb, height);
 
-			sprites_to_render[number_of_sprites].sprite_number = sprite_number;
-			sprites_to_render[number_of_sprites].x = OX;
-			number_of_sprites++;
-		}
-#if PEANUT_FULL_GBC_SUPPORT
-		if(!gb->cgb.cgbMode)
-		{
-#endif
-		/* If maximum number of sprites reached, prioritise X
-		 * coordinate and object location in OAM. */
-		qsort(&sprites_to_render[0], number_of_sprites,
-				sizeof(sprites_to_render[0]), compare_sprites);
-#if PEANUT_FULL_GBC_SUPPORT
-		}
-#endif
-		if(number_of_sprites > MAX_SPRITES_LINE)
-			number_of_sprites = MAX_SPRITES_LINE;
-#endif
+		sprites = gb->display.line_sprites[line->ly];
 
 		/* Render each sprite, from low priority to high priority. */
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-		/* Render the top ten prioritised sprites on this scanline. */
-		for(sprite_number = number_of_sprites - 1;
+		for(sprite_number = gb->display.line_sprite_count[line->ly] - 1;
 				sprite_number != 0xFF;
 				sprite_number--)
 		{
-			uint8_t s = sprites_to_render[sprite_number].sprite_number;
-#else
-		for (sprite_number = NUM_SPRITES - 1;
-			sprite_number != 0xFF;
-			sprite_number--)
-		{
-			uint8_t s = sprite_number;
-#endif
+			uint8_t s = sprites[sprite_number];
 			uint8_t py, t1, t2, dir, start, end, shift, disp_x;
 			/* Sprite Y position. */
 			uint8_t OY = gb->oam[s << 2];
@@ -1972,31 +2372,23 @@ void __gb_draw_line(struct gb_s *gb)
 			uint8_t OX = gb->oam[(s << 2) + 1];
 			/* Sprite Tile/Pattern Number. */
 			uint8_t OT = gb->oam[(s << 2) + 2]
-				     & (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
+				     & (line->lcdc & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
 			/* Additional attributes. */
 			uint8_t OF = gb->oam[(s << 2) + 3];
 
-#if !PEANUT_GB_HIGH_LCD_ACCURACY
-			/* If sprite isn't on this line, continue. */
-			if(gb->hram_io[IO_LY] +
-					(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY ||
-					gb->hram_io[IO_LY] + 16 < OY)
-				continue;
-#endif
-
 			/* Continue if sprite not visible. */
 			if(OX == 0 || OX >= 168)
 				continue;
 
 			// y flip
-			py = gb->hram_io[IO_LY] - OY + 16;
+			py = line->ly - OY + 16;
 
 			if(OF & OBJ_FLIP_Y)
-				py = (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 15 : 7) - py;
+				py = height - 1 - py;
 
 			// fetch the tile
 #if PEANUT_FULL_GBC_SUPPORT
-			if(gb->cgb.cgbMode)
+			if(cgb_mode)
 			{
 				t1 = gb->vram[((OF & OBJ_BANK) << 10) + VRAM_TILES_1 + (OT << 4) + (py << 1)];
 				t2 = gb->vram[((OF & OBJ_BANK) << 10) + VRAM_TILES_1 + (OT << 4) + (py << 1) + 1];
@@ -2036,9 +2428,9 @@ void __gb_draw_line(struct gb_s *gb)
 				uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
 				// check transparency / sprite overlap / background overlap
 #if PEANUT_FULL_GBC_SUPPORT
-				if(gb->cgb.cgbMode)
+				if(cgb_mode)
 				{
-					uint8_t isBackgroundDisabled = c && !(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE);
+					uint8_t isBackgroundDisabled = c && !(line->lcdc & LCDC_BG_ENABLE);
 					uint8_t isPixelPriorityNonConflicting = c &&
 															!(pixelsPrio[disp_x] && (pixels[disp_x] & 0x3)) &&
 															!((OF & OBJ_PRIORITY) && (pixels[disp_x] & 0x3));
@@ -2051,20 +2443,16 @@ void __gb_draw_line(struct gb_s *gb)
 				}
 				else
 #endif
-				if(c && !(OF & OBJ_PRIORITY && !((pixels[disp_x] & 0x3) == gb->display.bg_palette[0])))
+				/* Behind the background, the sprite only shows
+				 * over its colour 0 or where it is disabled. */
+				if(c && !(OF & OBJ_PRIORITY &&
+						line->lcdc & LCDC_BG_ENABLE &&
+						pixels[disp_x] != line->bg_palette[0]))
 				{
 					/* Set pixel colour. */
 					pixels[disp_x] = (OF & OBJ_PALETTE)
-						? gb->display.sp_palette[c + 4]
-						: gb->display.sp_palette[c];
-#if PEANUT_GB_12_COLOUR
-					/* Set pixel palette (OBJ0 or OBJ1). */
-					pixels[disp_x] |= (OF & OBJ_PALETTE);
-#endif
-#if PEANUT_FULL_GBC_SUPPORT
-					/* Deselect BG palette. */
-					pixels[disp_x] &= ~LCD_PALETTE_BG;
-#endif
+						? line->sp_palette[c + 4]
+						: line->sp_palette[c];
 				}
 
 				t1 = t1 >> 1;
@@ -2073,17 +2461,586 @@ void __gb_draw_line(struct gb_s *gb)
 		}
 	}
 
-	gb->display.lcd_draw_line(gb, pixels, gb->hram_io[IO_LY]);
+	if(gb->display.lcd_draw_line != NULL)
+		gb->display.lcd_draw_line(gb, pixels, line->ly);
+}
+
+/**
+ * Internal function used to capture the registers of the current line, then
+ * render it or queue it for the front-end to render.
+ */
+template<bool cgb_mode>
+static void __gb_draw_line(struct gb_s *gb)
+{
+	struct gb_line_s line;
+	uint8_t window;
+
+	/* If LCD not initialised by front-end, don't render anything. */
+	if(gb->display.lcd_draw_line == NULL &&
+			gb->display.framebuffer == NULL)
+		return;
+
+	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
+		return;
+
+	if(gb->direct.skip_frame)
+		return;
+
+	window = gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+			&& gb->hram_io[IO_LY] >= gb->display.WY
+			&& gb->hram_io[IO_WX] <= 166;
+
+	/* If interlaced mode is activated, check if we need to draw the current
+	 * line. */
+	if(gb->direct.interlace)
+	{
+		if((gb->display.interlace_count == 0
+				&& (gb->hram_io[IO_LY] & 1) == 0)
+				|| (gb->display.interlace_count == 1
+				    && (gb->hram_io[IO_LY] & 1) == 1))
+		{
+			/* Compensate for missing window draw if required. */
+			if(window)
+				gb->display.window_clear++;
+
+			return;
+		}
+	}
+
+	line.ly = gb->hram_io[IO_LY];
+	line.lcdc = gb->hram_io[IO_LCDC];
+	line.scx = gb->hram_io[IO_SCX];
+	line.scy = gb->hram_io[IO_SCY];
+	line.wx = gb->hram_io[IO_WX];
+	line.window_line = gb->display.window_clear;
+	memcpy(line.bg_palette, gb->display.bg_palette, sizeof(line.bg_palette));
+	memcpy(line.sp_palette, gb->display.sp_palette, sizeof(line.sp_palette));
+
+	if(window)
+		gb->display.window_clear++; // advance window line
+	else
+		line.lcdc &= ~LCDC_WINDOW_ENABLE;
+
+	if(gb->display.lcd_queue_line != NULL)
+	{
+		gb->display.lcd_queue_line(gb, &line);
+
+		/* The line reads VRAM when it is drawn, so writes have to wait
+		 * for it. */
+		if(!gb->display.vram_queued)
+		{
+			gb->display.vram_queued = 1;
+			__gb_map_pages(NULL, gb->map.write, VRAM_ADDR, 0x20, NULL);
+		}
+		return;
+	}
+
+	__gb_render_line<cgb_mode>(gb, &line);
 }
 #endif
 
+static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+
+/**
+ * Internal function used to advance DIV, serial, TIMA and the LCD by the
+ * given number of CPU cycles.
+ */
+template<bool cgb_mode>
+static void __gb_update_timing(struct gb_s *gb, uint_fast32_t cycles)
+{
+#if PEANUT_FULL_GBC_SUPPORT
+	if(cgb_mode)
+		gb->counter.frame_cycles += cycles >> gb->cgb.doubleSpeed;
+	else
+#endif
+	gb->counter.frame_cycles += cycles;
+
+	/* DIV register timing */
+	gb->counter.div_count += cycles;
+	while(gb->counter.div_count >= DIV_CYCLES)
+	{
+		gb->hram_io[IO_DIV]++;
+		gb->counter.div_count -= DIV_CYCLES;
+	}
+
+	/* Check serial transmission. */
+	if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+	{
+		unsigned int serial_cycles = SERIAL_CYCLES_1KB;
+
+		/* If new transfer, call TX function. */
+		if(gb->counter.serial_count == 0 &&
+			gb->gb_serial_tx != NULL)
+			(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
+
+#if PEANUT_FULL_GBC_SUPPORT
+		if(cgb_mode && (gb->hram_io[IO_SC] & 0x3))
+			serial_cycles = SERIAL_CYCLES_32KB;
+#endif
+
+		gb->counter.serial_count += cycles;
+
+		/* If it's time to receive byte, call RX function. */
+		if(gb->counter.serial_count >= serial_cycles)
+		{
+			/* If RX can be done, do it. */
+			/* If RX failed, do not change SB if using external
+			 * clock, or set to 0xFF if using internal clock. */
+			uint8_t rx;
+
+			if(gb->gb_serial_rx != NULL &&
+				(gb->gb_serial_rx(gb, &rx) ==
+					GB_SERIAL_RX_SUCCESS))
+			{
+				gb->hram_io[IO_SB] = rx;
+
+				/* Inform game of serial TX/RX completion. */
+				gb->hram_io[IO_SC] &= 0x01;
+				gb->hram_io[IO_IF] |= SERIAL_INTR;
+			}
+			else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
+			{
+				/* If using internal clock, and console is not
+				 * attached to any external peripheral, shifted
+				 * bits are replaced with logic 1. */
+				gb->hram_io[IO_SB] = 0xFF;
+
+				/* Inform game of serial TX/RX completion. */
+				gb->hram_io[IO_SC] &= 0x01;
+				gb->hram_io[IO_IF] |= SERIAL_INTR;
+			}
+			else
+			{
+				/* If using external clock, and console is not
+				 * attached to any external peripheral, bits are
+				 * not shifted, so SB is not modified. */
+			}
+
+			gb->counter.serial_count = 0;
+		}
+	}
+
+	/* TIMA register timing */
+	/* TODO: Change tac_enable to struct of TAC timer control bits. */
+	if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+	{
+		gb->counter.tima_count += cycles;
+
+		while(gb->counter.tima_count >=
+			TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
+		{
+			gb->counter.tima_count -=
+				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+
+			if(++gb->hram_io[IO_TIMA] == 0)
+			{
+				gb->hram_io[IO_IF] |= TIMER_INTR;
+				/* On overflow, set TMA to TIMA. */
+				gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
+			}
+		}
+	}
+
+	/* If LCD is off, don't update LCD state or increase the LCD
+	 * ticks. */
+	if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+		return;
+
+	/* LCD Timing */
+#if PEANUT_FULL_GBC_SUPPORT
+        if (cgb_mode && cycles > 1)
+            gb->counter.lcd_count += (cycles >> gb->cgb.doubleSpeed);
+        else
+#endif
+	gb->counter.lcd_count += cycles;
+
+	/* New Scanline */
+	if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
+	{
+		gb->counter.lcd_count -= LCD_LINE_CYCLES;
+
+		/* Next line */
+		gb->hram_io[IO_LY] = (gb->hram_io[IO_LY] + 1) % LCD_VERT_LINES;
+
+		/* LYC Update */
+		if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
+		{
+			gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
+
+			if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
+		}
+		else
+			gb->hram_io[IO_STAT] &= 0xFB;
+
+		/* VBLANK Start */
+		if(gb->hram_io[IO_LY] == LCD_HEIGHT)
+		{
+			gb->hram_io[IO_STAT] =
+				(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
+			gb->gb_frame = 1;
+			gb->hram_io[IO_IF] |= VBLANK_INTR;
+			gb->lcd_blank = 0;
+
+			if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
+
+#if ENABLE_LCD
+			/* If frame skip is activated, check if we need to draw
+			 * the frame or skip it. */
+			if(gb->direct.frame_skip)
+			{
+				gb->display.frame_skip_count =
+					!gb->display.frame_skip_count;
+			}
+
+			/* If interlaced is activated, change which lines get
+			 * updated. Also, only update lines on frames that are
+			 * actually drawn when frame skip is enabled. */
+			if(gb->direct.interlace &&
+					(!gb->direct.frame_skip ||
+					 gb->display.frame_skip_count))
+			{
+				gb->display.interlace_count =
+					!gb->display.interlace_count;
+			}
+#endif
+		}
+		/* Normal Line */
+		else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
+		{
+			if(gb->hram_io[IO_LY] == 0)
+			{
+				/* Clear Screen */
+				gb->display.WY = gb->hram_io[IO_WY];
+				gb->display.window_clear = 0;
+			}
+
+			gb->hram_io[IO_STAT] =
+				(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+
+#if PEANUT_FULL_GBC_SUPPORT
+			//DMA GBC
+			if(cgb_mode && !gb->cgb.dmaActive && gb->cgb.dmaMode)
+			{
+				for (uint8_t i = 0; i < 0x10; i++)
+				{
+					__gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i,
+							   __gb_read(gb, (gb->cgb.dmaSource & 0xFFF0) + i));
+				}
+				gb->cgb.dmaSource += 0x10;
+				gb->cgb.dmaDest += 0x10;
+				if(!(--gb->cgb.dmaSize)) gb->cgb.dmaActive = 1;
+			}
+#endif
+			if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
+		}
+	}
+	/* OAM access */
+	else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_HBLANK &&
+			gb->counter.lcd_count >= LCD_MODE_2_CYCLES)
+	{
+		gb->hram_io[IO_STAT] =
+			(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_SEARCH_OAM;
+
+		if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
+			gb->hram_io[IO_IF] |= LCDC_INTR;
+	}
+	/* Update LCD */
+	else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_SEARCH_OAM &&
+			gb->counter.lcd_count >= LCD_MODE_3_CYCLES)
+	{
+		gb->hram_io[IO_STAT] =
+			(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_SEARCH_TRANSFER;
+#if ENABLE_LCD
+		if(!gb->lcd_blank)
+			__gb_draw_line<cgb_mode>(gb);
+#endif
+	}
+}
+
+/**
+ * Internal function used to work out how many cycles may pass before the
+ * timer, serial or LCD state would change in a way the CPU can see.
+ * DIV never needs an event as it is only observed when read.
+ */
+template<bool cgb_mode>
+static void __gb_schedule(struct gb_s *gb)
+{
+	int_fast32_t next = SCHEDULE_MAX_CYCLES;
+
+	if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+	{
+		int_fast32_t serial_cycles = SERIAL_CYCLES_1KB;
+
+#if PEANUT_FULL_GBC_SUPPORT
+		if(cgb_mode && (gb->hram_io[IO_SC] & 0x3))
+			serial_cycles = SERIAL_CYCLES_32KB;
+#endif
+		/* A new transfer calls the TX function on the next update. */
+		if(gb->counter.serial_count == 0)
+			serial_cycles = 0;
+		else
+			serial_cycles -= gb->counter.serial_count;
+
+		if(serial_cycles < next)
+			next = serial_cycles;
+	}
+
+	if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+	{
+		int_fast32_t tima_cycles =
+			(0x100 - gb->hram_io[IO_TIMA]) *
+			TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK] -
+			gb->counter.tima_count;
+
+		if(tima_cycles < next)
+			next = tima_cycles;
+	}
+
+	if(gb->hram_io[IO_LCDC] & LCDC_ENABLE)
+	{
+		const uint_fast8_t mode = gb->hram_io[IO_STAT] & STAT_MODE;
+		int_fast32_t lcd_cycles = LCD_LINE_CYCLES - gb->counter.lcd_count;
+
+		if(mode == IO_STAT_MODE_HBLANK &&
+				LCD_MODE_2_CYCLES - (int_fast32_t)gb->counter.lcd_count < lcd_cycles)
+			lcd_cycles = LCD_MODE_2_CYCLES - gb->counter.lcd_count;
+		else if(mode == IO_STAT_MODE_SEARCH_OAM &&
+				LCD_MODE_3_CYCLES - (int_fast32_t)gb->counter.lcd_count < lcd_cycles)
+			lcd_cycles = LCD_MODE_3_CYCLES - gb->counter.lcd_count;
+
+#if PEANUT_FULL_GBC_SUPPORT
+		/* The LCD runs at half the CPU rate in double speed mode. */
+		if(cgb_mode)
+			lcd_cycles <<= gb->cgb.doubleSpeed;
+#endif
+		if(lcd_cycles < next)
+			next = lcd_cycles;
+	}
+
+	/* An event that is already due happens after the next instruction.
+	 * At least one cycle away, so that a halted CPU still moves time on
+	 * when nothing is pending, e.g. while a serial transfer waits on an
+	 * external clock. */
+	if(next < 1)
+		next = 1;
+
+#if !PEANUT_GB_SCHEDULE_EVENTS
+	/* Every instruction is an event. A halted CPU moves time on by one
+	 * NOP at a time. */
+	next = 4;
+#endif
+	gb->counter.next_event = next;
+}
+
+static void __gb_schedule(struct gb_s *gb)
+{
+#if PEANUT_FULL_GBC_SUPPORT
+	if(gb->cgb.cgbMode)
+	{
+		__gb_schedule<true>(gb);
+		return;
+	}
+#endif
+	__gb_schedule<false>(gb);
+}
+
+/**
+ * Internal function used to apply pending CPU cycles to the timers and LCD.
+ * Called when an event is due, and before registers that depend on the
+ * pending cycles are read or written.
+ */
+template<bool cgb_mode>
+static void __gb_sync(struct gb_s *gb)
+{
+	uint_fast32_t cycles = gb->counter.pending;
+
+	if(cycles == 0)
+		return;
+
+	gb->counter.pending = 0;
+	__gb_update_timing<cgb_mode>(gb, cycles);
+	__gb_schedule<cgb_mode>(gb);
+}
+
+static void __gb_sync(struct gb_s *gb)
+{
+#if PEANUT_FULL_GBC_SUPPORT
+	if(gb->cgb.cgbMode)
+	{
+		__gb_sync<true>(gb);
+		return;
+	}
+#endif
+	__gb_sync<false>(gb);
+}
+
+/**
+ * Internal function used to skip iterations of a loop that only polls LY,
+ * STAT or JOYP, such as "LDH A,(LY); CP n; JR NZ,loop", having just jumped
+ * back to its start.
+ * The polled registers only change at scheduled events. So if one iteration
+ * leaves A and F as they are and branches back again, every iteration until
+ * the next event does the same and can be skipped.
+ */
+static void __gb_skip_idle_loop(struct gb_s *gb)
+{
+	uint_fast16_t pc = gb->cpu_reg.pc.reg;
+	uint_fast16_t reg;
+	uint_fast32_t loop_cycles, skip;
+	uint8_t a, op, z, n, h, c, taken;
+
+	if(pc >= IO_ADDR && pc < HRAM_ADDR)
+		return;
+
+	op = __gb_read(gb, pc);
+
+	if(op == 0xF0) /* LDH A, (imm) */
+	{
+		reg = IO_ADDR | __gb_read(gb, pc + 1);
+		loop_cycles = 12;
+		pc += 2;
+	}
+	else if(op == 0xFA) /* LD A, (imm) */
+	{
+		reg = PEANUT_GB_U8_TO_U16(__gb_read(gb, pc + 2),
+					  __gb_read(gb, pc + 1));
+		loop_cycles = 16;
+		pc += 3;
+	}
+	else
+		return;
+
+	if(reg != IO_ADDR + IO_LY && reg != IO_ADDR + IO_STAT &&
+			reg != IO_ADDR + IO_JOYP)
+		return;
+
+	a = gb->hram_io[reg - IO_ADDR];
+	z = gb->cpu_reg.f_bits.z;
+	n = gb->cpu_reg.f_bits.n;
+	h = gb->cpu_reg.f_bits.h;
+	c = gb->cpu_reg.f_bits.c;
+
+	/* Up to two tests on the polled value. */
+	for(uint_fast8_t i = 0; i < 2; i++)
+	{
+		const uint8_t imm = __gb_read(gb, pc + 1);
+
+		op = __gb_read(gb, pc);
+
+		if(op == 0xE6) /* AND imm */
+		{
+			a &= imm;
+			z = (a == 0x00);
+			n = 0;
+			h = 1;
+			c = 0;
+		}
+		else if(op == 0xFE) /* CP imm */
+		{
+			const uint8_t temp = a - imm;
+			z = (temp == 0x00);
+			n = 1;
+			h = ((a ^ imm ^ temp) & 0x10) > 0;
+			c = (a < imm);
+		}
+		else if(op == 0xCB && (imm & 0xC7) == 0x47) /* BIT n, A */
+		{
+			z = !((a >> ((imm >> 3) & 0x07)) & 1);
+			n = 0;
+			h = 1;
+		}
+		else
+			break;
+
+		loop_cycles += 8;
+		pc += 2;
+	}
+
+	/* Must end with JR cc back to the start of the loop. */
+	op = __gb_read(gb, pc);
+
+	if((op & 0xE7) != 0x20 ||
+			(uint16_t)(pc + 2 + (int8_t)__gb_read(gb, pc + 1)) !=
+			gb->cpu_reg.pc.reg)
+		return;
+
+	switch((op >> 3) & 0x03)
+	{
+	case 0: taken = !z; break;
+	case 1: taken = z; break;
+	case 2: taken = !c; break;
+	default: taken = c; break;
+	}
+
+	if(!taken || a != gb->cpu_reg.a ||
+			z != gb->cpu_reg.f_bits.z || n != gb->cpu_reg.f_bits.n ||
+			h != gb->cpu_reg.f_bits.h || c != gb->cpu_reg.f_bits.c)
+		return;
+
+	/* Skip whole iterations, stopping short of the instruction that
+	 * reaches the next event. */
+	loop_cycles += 12;
+	skip = (gb->counter.next_event - gb->counter.pending - 1) /
+		loop_cycles * loop_cycles;
+	gb->counter.pending += skip;
+	gb->counter.idle_cycles += skip;
+}
+
 /**
  * Internal function used to step the CPU.
+ * With PEANUT_GB_THREADED_DISPATCH, this runs a block of instructions until
+ * the next event, HALT or interrupt instead of a single instruction.
+ * Instantiated separately for DMG and CGB mode.
  */
-void __gb_step_cpu(struct gb_s *gb)
+template<bool cgb_mode>
+static void __gb_step_cpu(struct gb_s *gb)
 {
 	uint8_t opcode;
 	uint_fast16_t inst_cycles;
+#if PEANUT_GB_THREADED_DISPATCH
+	/* Registers live in a local for the length of the block, so that the
+	 * compiler does not reload them after every memory access. */
+	struct cpu_registers_s regs = gb->cpu_reg;
+	struct cpu_registers_s *const cpu = &regs;
+# define PGB_OP(op)	case op: op_##op
+#else
+	struct cpu_registers_s *const cpu = &gb->cpu_reg;
+# define PGB_OP(op)	case op
+#endif
+#if PEANUT_GB_ICACHE_SIZE
+	/* Operand bytes of the current instruction. */
+	const uint8_t *imm;
+	uint8_t imm_buf[2];
+	/* Instruction length in bytes, including the opcode. */
+	static const uint8_t op_length[0x100] =
+	{
+		/* *INDENT-OFF* */
+		/*0 1 2 3 4 5 6 7 8 9 A B C D E F	*/
+		1,3,1,1,1,1,2,1,3,1,1,1,1,1,2,1,	/* 0x00 */
+		1,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1,	/* 0x10 */
+		2,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1,	/* 0x20 */
+		2,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1,	/* 0x30 */
+		1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x40 */
+		1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x50 */
+		1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x60 */
+		1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x70 */
+		1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x80 */
+		1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0x90 */
+		1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0xA0 */
+		1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,	/* 0xB0 */
+		1,1,3,3,3,1,2,1,1,1,3,2,3,3,2,1,	/* 0xC0 */
+		1,1,3,1,3,1,2,1,1,1,3,1,3,1,2,1,	/* 0xD0 */
+		2,1,1,1,1,1,2,1,2,1,3,1,1,1,2,1,	/* 0xE0 */
+		2,1,1,1,1,1,2,1,2,1,3,1,1,1,2,1	/* 0xF0 */
+		/* *INDENT-ON* */
+	};
+# define PGB_FETCH_IMM8() (cpu->pc.reg++, *imm++)
+#else
+# define PGB_FETCH_IMM8() __gb_read(gb, cpu->pc.reg++)
+#endif
 	static const uint8_t op_cycles[0x100] =
 	{
 		/* *INDENT-OFF* */
@@ -2106,7 +3063,6 @@ void __gb_step_cpu(struct gb_s *gb)
 		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
 		/* *INDENT-ON* */
 	};
-	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
 
 	/* Handle interrupts */
 	/* If gb_halt is positive, then an interrupt must have occured by the
@@ -2124,1736 +3080,1657 @@ void __gb_step_cpu(struct gb_s *gb)
 		gb->gb_ime = 0;
 
 		/* Push Program Counter */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
 
 		/* Call interrupt handler if required. */
 		if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & VBLANK_INTR)
 		{
-			gb->cpu_reg.pc.reg = VBLANK_INTR_ADDR;
+			cpu->pc.reg = VBLANK_INTR_ADDR;
 			gb->hram_io[IO_IF] ^= VBLANK_INTR;
 		}
 		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & LCDC_INTR)
 		{
-			gb->cpu_reg.pc.reg = LCDC_INTR_ADDR;
+			cpu->pc.reg = LCDC_INTR_ADDR;
 			gb->hram_io[IO_IF] ^= LCDC_INTR;
 		}
 		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & TIMER_INTR)
 		{
-			gb->cpu_reg.pc.reg = TIMER_INTR_ADDR;
+			cpu->pc.reg = TIMER_INTR_ADDR;
 			gb->hram_io[IO_IF] ^= TIMER_INTR;
 		}
 		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & SERIAL_INTR)
 		{
-			gb->cpu_reg.pc.reg = SERIAL_INTR_ADDR;
+			cpu->pc.reg = SERIAL_INTR_ADDR;
 			gb->hram_io[IO_IF] ^= SERIAL_INTR;
 		}
 		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & CONTROL_INTR)
 		{
-			gb->cpu_reg.pc.reg = CONTROL_INTR_ADDR;
+			cpu->pc.reg = CONTROL_INTR_ADDR;
 			gb->hram_io[IO_IF] ^= CONTROL_INTR;
 		}
 
 		break;
 	}
 
+#if PEANUT_GB_THREADED_DISPATCH
+fetch:
+#endif
 	/* Obtain opcode */
-	opcode = __gb_read(gb, gb->cpu_reg.pc.reg++);
+#if PEANUT_GB_ICACHE_SIZE
+	{
+		const uint_fast16_t pc = cpu->pc.reg;
+		const uint8_t *page = gb->map.read[MAP_PAGE(pc)];
+
+		/* Only cache ROM, and only instructions that do not cross
+		 * into the next page. */
+		if(pc < VRAM_ADDR && page != NULL && (pc & 0xFF) <= 0xFD)
+		{
+			const uint8_t *host = page + (pc & 0xFF);
+			struct gb_icache_entry_s *e =
+				&gb->icache.entry[pc & (PEANUT_GB_ICACHE_SIZE - 1)];
+
+			if(e->tag != host)
+			{
+				e->tag = host;
+				e->opcode = host[0];
+				e->imm[0] = host[1];
+				e->imm[1] = host[2];
+				e->cycles = op_cycles[host[0]];
+#if PEANUT_GB_ICACHE_STATS
+				gb->icache.misses++;
+#endif
+			}
+#if PEANUT_GB_ICACHE_STATS
+			else
+				gb->icache.hits++;
+#endif
+
+			opcode = e->opcode;
+			inst_cycles = e->cycles;
+			imm = e->imm;
+		}
+		else
+		{
+			opcode = __gb_read(gb, pc);
+			inst_cycles = op_cycles[opcode];
+
+			for(uint_fast8_t i = 1; i < op_length[opcode]; i++)
+				imm_buf[i - 1] = __gb_read(gb, pc + i);
+
+			imm = imm_buf;
+#if PEANUT_GB_ICACHE_STATS
+			gb->icache.bypass++;
+#endif
+		}
+
+		cpu->pc.reg++;
+	}
+#else
+	opcode = __gb_read(gb, cpu->pc.reg++);
 	inst_cycles = op_cycles[opcode];
+#endif
 
 	/* Execute opcode */
+#if PEANUT_GB_THREADED_DISPATCH
+	{
+		static const void *const dispatch[0x100] =
+		{
+			/* *INDENT-OFF* */
+			&&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03,
+			&&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+			&&op_0x08, &&op_0x09, &&op_0x0A, &&op_0x0B,
+			&&op_0x0C, &&op_0x0D, &&op_0x0E, &&op_0x0F,
+			&&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13,
+			&&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+			&&op_0x18, &&op_0x19, &&op_0x1A, &&op_0x1B,
+			&&op_0x1C, &&op_0x1D, &&op_0x1E, &&op_0x1F,
+			&&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23,
+			&&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+			&&op_0x28, &&op_0x29, &&op_0x2A, &&op_0x2B,
+			&&op_0x2C, &&op_0x2D, &&op_0x2E, &&op_0x2F,
+			&&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33,
+			&&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+			&&op_0x38, &&op_0x39, &&op_0x3A, &&op_0x3B,
+			&&op_0x3C, &&op_0x3D, &&op_0x3E, &&op_0x3F,
+			&&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43,
+			&&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+			&&op_0x48, &&op_0x49, &&op_0x4A, &&op_0x4B,
+			&&op_0x4C, &&op_0x4D, &&op_0x4E, &&op_0x4F,
+			&&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53,
+			&&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+			&&op_0x58, &&op_0x59, &&op_0x5A, &&op_0x5B,
+			&&op_0x5C, &&op_0x5D, &&op_0x5E, &&op_0x5F,
+			&&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63,
+			&&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,
+			&&op_0x68, &&op_0x69, &&op_0x6A, &&op_0x6B,
+			&&op_0x6C, &&op_0x6D, &&op_0x6E, &&op_0x6F,
+			&&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73,
+			&&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+			&&op_0x78, &&op_0x79, &&op_0x7A, &&op_0x7B,
+			&&op_0x7C, &&op_0x7D, &&op_0x7E, &&op_0x7F,
+			&&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83,
+			&&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+			&&op_0x88, &&op_0x89, &&op_0x8A, &&op_0x8B,
+			&&op_0x8C, &&op_0x8D, &&op_0x8E, &&op_0x8F,
+			&&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93,
+			&&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+			&&op_0x98, &&op_0x99, &&op_0x9A, &&op_0x9B,
+			&&op_0x9C, &&op_0x9D, &&op_0x9E, &&op_0x9F,
+			&&op_0xA0, &&op_0xA1, &&op_0xA2, &&op_0xA3,
+			&&op_0xA4, &&op_0xA5, &&op_0xA6, &&op_0xA7,
+			&&op_0xA8, &&op_0xA9, &&op_0xAA, &&op_0xAB,
+			&&op_0xAC, &&op_0xAD, &&op_0xAE, &&op_0xAF,
+			&&op_0xB0, &&op_0xB1, &&op_0xB2, &&op_0xB3,
+			&&op_0xB4, &&op_0xB5, &&op_0xB6, &&op_0xB7,
+			&&op_0xB8, &&op_0xB9, &&op_0xBA, &&op_0xBB,
+			&&op_0xBC, &&op_0xBD, &&op_0xBE, &&op_0xBF,
+			&&op_0xC0, &&op_0xC1, &&op_0xC2, &&op_0xC3,
+			&&op_0xC4, &&op_0xC5, &&op_0xC6, &&op_0xC7,
+			&&op_0xC8, &&op_0xC9, &&op_0xCA, &&op_0xCB,
+			&&op_0xCC, &&op_0xCD, &&op_0xCE, &&op_0xCF,
+			&&op_0xD0, &&op_0xD1, &&op_0xD2, &&op_invalid,
+			&&op_0xD4, &&op_0xD5, &&op_0xD6, &&op_0xD7,
+			&&op_0xD8, &&op_0xD9, &&op_0xDA, &&op_invalid,
+			&&op_0xDC, &&op_invalid, &&op_0xDE, &&op_0xDF,
+			&&op_0xE0, &&op_0xE1, &&op_0xE2, &&op_invalid,
+			&&op_invalid, &&op_0xE5, &&op_0xE6, &&op_0xE7,
+			&&op_0xE8, &&op_0xE9, &&op_0xEA, &&op_invalid,
+			&&op_invalid, &&op_invalid, &&op_0xEE, &&op_0xEF,
+			&&op_0xF0, &&op_0xF1, &&op_0xF2, &&op_0xF3,
+			&&op_invalid, &&op_0xF5, &&op_0xF6, &&op_0xF7,
+			&&op_0xF8, &&op_0xF9, &&op_0xFA, &&op_0xFB,
+			&&op_invalid, &&op_invalid, &&op_0xFE, &&op_0xFF
+			/* *INDENT-ON* */
+		};
+		goto *dispatch[opcode];
+	}
+#endif
 	switch(opcode)
 	{
-	case 0x00: /* NOP */
+	PGB_OP(0x00): /* NOP */
 		break;
 
-	case 0x01: /* LD BC, imm */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x01): /* LD BC, imm */
+		cpu->bc.bytes.c = PGB_FETCH_IMM8();
+		cpu->bc.bytes.b = PGB_FETCH_IMM8();
 		break;
 
-	case 0x02: /* LD (BC), A */
-		__gb_write(gb, gb->cpu_reg.bc.reg, gb->cpu_reg.a);
+	PGB_OP(0x02): /* LD (BC), A */
+		__gb_write(gb, cpu->bc.reg, cpu->a);
 		break;
 
-	case 0x03: /* INC BC */
-		gb->cpu_reg.bc.reg++;
+	PGB_OP(0x03): /* INC BC */
+		cpu->bc.reg++;
 		break;
 
-	case 0x04: /* INC B */
-		gb->cpu_reg.bc.bytes.b++;
-		gb->cpu_reg.f_bits.z = (gb->cpu_reg.bc.bytes.b == 0x00);
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.bc.bytes.b & 0x0F) == 0x00);
+	PGB_OP(0x04): /* INC B */
+		cpu->bc.bytes.b++;
+		cpu->f_bits.z = (cpu->bc.bytes.b == 0x00);
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = ((cpu->bc.bytes.b & 0x0F) == 0x00);
 		break;
 
-	case 0x05: /* DEC B */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.b);
+	PGB_OP(0x05): /* DEC B */
+		PGB_INSTR_DEC_R8(cpu->bc.bytes.b);
 		break;
 
-	case 0x06: /* LD B, imm */
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x06): /* LD B, imm */
+		cpu->bc.bytes.b = PGB_FETCH_IMM8();
 		break;
 
-	case 0x07: /* RLCA */
-		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | (gb->cpu_reg.a >> 7);
-		gb->cpu_reg.f_bits.z = 0;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = 0;
-		gb->cpu_reg.f_bits.c = (gb->cpu_reg.a & 0x01);
+	PGB_OP(0x07): /* RLCA */
+		cpu->a = (cpu->a << 1) | (cpu->a >> 7);
+		cpu->f_bits.z = 0;
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = 0;
+		cpu->f_bits.c = (cpu->a & 0x01);
 		break;
 
-	case 0x08: /* LD (imm), SP */
+	PGB_OP(0x08): /* LD (imm), SP */
 	{
 		uint8_t h, l;
 		uint16_t temp;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		l = PGB_FETCH_IMM8();
+		h = PGB_FETCH_IMM8();
 		temp = PEANUT_GB_U8_TO_U16(h,l);
-		__gb_write(gb, temp++, gb->cpu_reg.sp.bytes.p);
-		__gb_write(gb, temp, gb->cpu_reg.sp.bytes.s);
+		__gb_write(gb, temp++, cpu->sp.bytes.p);
+		__gb_write(gb, temp, cpu->sp.bytes.s);
 		break;
 	}
 
-	case 0x09: /* ADD HL, BC */
+	PGB_OP(0x09): /* ADD HL, BC */
 	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.bc.reg;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h =
-			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.bc.reg) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
-		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
+		uint_fast32_t temp = cpu->hl.reg + cpu->bc.reg;
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h =
+			(temp ^ cpu->hl.reg ^ cpu->bc.reg) & 0x1000 ? 1 : 0;
+		cpu->f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
+		cpu->hl.reg = (temp & 0x0000FFFF);
 		break;
 	}
 
-	case 0x0A: /* LD A, (BC) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.bc.reg);
+	PGB_OP(0x0A): /* LD A, (BC) */
+		cpu->a = __gb_read(gb, cpu->bc.reg);
 		break;
 
-	case 0x0B: /* DEC BC */
-		gb->cpu_reg.bc.reg--;
+	PGB_OP(0x0B): /* DEC BC */
+		cpu->bc.reg--;
 		break;
 
-	case 0x0C: /* INC C */
-		gb->cpu_reg.bc.bytes.c++;
-		gb->cpu_reg.f_bits.z = (gb->cpu_reg.bc.bytes.c == 0x00);
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.bc.bytes.c & 0x0F) == 0x00);
+	PGB_OP(0x0C): /* INC C */
+		cpu->bc.bytes.c++;
+		cpu->f_bits.z = (cpu->bc.bytes.c == 0x00);
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = ((cpu->bc.bytes.c & 0x0F) == 0x00);
 		break;
 
-	case 0x0D: /* DEC C */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.c);
+	PGB_OP(0x0D): /* DEC C */
+		PGB_INSTR_DEC_R8(cpu->bc.bytes.c);
 		break;
 
-	case 0x0E: /* LD C, imm */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x0E): /* LD C, imm */
+		cpu->bc.bytes.c = PGB_FETCH_IMM8();
 		break;
 
-	case 0x0F: /* RRCA */
-		gb->cpu_reg.f_bits.c = gb->cpu_reg.a & 0x01;
-		gb->cpu_reg.a = (gb->cpu_reg.a >> 1) | (gb->cpu_reg.a << 7);
-		gb->cpu_reg.f_bits.z = 0;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = 0;
+	PGB_OP(0x0F): /* RRCA */
+		cpu->f_bits.c = cpu->a & 0x01;
+		cpu->a = (cpu->a >> 1) | (cpu->a << 7);
+		cpu->f_bits.z = 0;
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = 0;
 		break;
 
-	case 0x10: /* STOP */
+	PGB_OP(0x10): /* STOP */
 		//gb->gb_halt = 1;
 #if PEANUT_FULL_GBC_SUPPORT
-		if(gb->cgb.cgbMode & gb->cgb.doubleSpeedPrep)
+		if(cgb_mode & gb->cgb.doubleSpeedPrep)
 		{
+			__gb_sync<cgb_mode>(gb);
 			gb->cgb.doubleSpeedPrep = 0;
 			gb->cgb.doubleSpeed ^= 1;
+			__gb_schedule<cgb_mode>(gb);
 		}
 #endif
 		break;
 
-	case 0x11: /* LD DE, imm */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x11): /* LD DE, imm */
+		cpu->de.bytes.e = PGB_FETCH_IMM8();
+		cpu->de.bytes.d = PGB_FETCH_IMM8();
 		break;
 
-	case 0x12: /* LD (DE), A */
-		__gb_write(gb, gb->cpu_reg.de.reg, gb->cpu_reg.a);
+	PGB_OP(0x12): /* LD (DE), A */
+		__gb_write(gb, cpu->de.reg, cpu->a);
 		break;
 
-	case 0x13: /* INC DE */
-		gb->cpu_reg.de.reg++;
+	PGB_OP(0x13): /* INC DE */
+		cpu->de.reg++;
 		break;
 
-	case 0x14: /* INC D */
-		gb->cpu_reg.de.bytes.d++;
-		gb->cpu_reg.f_bits.z = (gb->cpu_reg.de.bytes.d == 0x00);
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.de.bytes.d & 0x0F) == 0x00);
+	PGB_OP(0x14): /* INC D */
+		cpu->de.bytes.d++;
+		cpu->f_bits.z = (cpu->de.bytes.d == 0x00);
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = ((cpu->de.bytes.d & 0x0F) == 0x00);
 		break;
 
-	case 0x15: /* DEC D */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.d);
+	PGB_OP(0x15): /* DEC D */
+		PGB_INSTR_DEC_R8(cpu->de.bytes.d);
 		break;
 
-	case 0x16: /* LD D, imm */
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x16): /* LD D, imm */
+		cpu->de.bytes.d = PGB_FETCH_IMM8();
 		break;
 
-	case 0x17: /* RLA */
+	PGB_OP(0x17): /* RLA */
 	{
-		uint8_t temp = gb->cpu_reg.a;
-		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | gb->cpu_reg.f_bits.c;
-		gb->cpu_reg.f_bits.z = 0;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = 0;
-		gb->cpu_reg.f_bits.c = (temp >> 7) & 0x01;
+		uint8_t temp = cpu->a;
+		cpu->a = (cpu->a << 1) | cpu->f_bits.c;
+		cpu->f_bits.z = 0;
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = 0;
+		cpu->f_bits.c = (temp >> 7) & 0x01;
 		break;
 	}
 
-	case 0x18: /* JR imm */
+	PGB_OP(0x18): /* JR imm */
 	{
-		int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.pc.reg += temp;
+		int8_t temp = (int8_t) PGB_FETCH_IMM8();
+		cpu->pc.reg += temp;
 		break;
 	}
 
-	case 0x19: /* ADD HL, DE */
+	PGB_OP(0x19): /* ADD HL, DE */
 	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.de.reg;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h =
-			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.de.reg) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
-		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
+		uint_fast32_t temp = cpu->hl.reg + cpu->de.reg;
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h =
+			(temp ^ cpu->hl.reg ^ cpu->de.reg) & 0x1000 ? 1 : 0;
+		cpu->f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
+		cpu->hl.reg = (temp & 0x0000FFFF);
 		break;
 	}
 
-	case 0x1A: /* LD A, (DE) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.de.reg);
+	PGB_OP(0x1A): /* LD A, (DE) */
+		cpu->a = __gb_read(gb, cpu->de.reg);
 		break;
 
-	case 0x1B: /* DEC DE */
-		gb->cpu_reg.de.reg--;
+	PGB_OP(0x1B): /* DEC DE */
+		cpu->de.reg--;
 		break;
 
-	case 0x1C: /* INC E */
-		gb->cpu_reg.de.bytes.e++;
-		gb->cpu_reg.f_bits.z = (gb->cpu_reg.de.bytes.e == 0x00);
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.de.bytes.e & 0x0F) == 0x00);
+	PGB_OP(0x1C): /* INC E */
+		cpu->de.bytes.e++;
+		cpu->f_bits.z = (cpu->de.bytes.e == 0x00);
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = ((cpu->de.bytes.e & 0x0F) == 0x00);
 		break;
 
-	case 0x1D: /* DEC E */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.e);
+	PGB_OP(0x1D): /* DEC E */
+		PGB_INSTR_DEC_R8(cpu->de.bytes.e);
 		break;
 
-	case 0x1E: /* LD E, imm */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x1E): /* LD E, imm */
+		cpu->de.bytes.e = PGB_FETCH_IMM8();
 		break;
 
-	case 0x1F: /* RRA */
+	PGB_OP(0x1F): /* RRA */
 	{
-		uint8_t temp = gb->cpu_reg.a;
-		gb->cpu_reg.a = gb->cpu_reg.a >> 1 | (gb->cpu_reg.f_bits.c << 7);
-		gb->cpu_reg.f_bits.z = 0;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = 0;
-		gb->cpu_reg.f_bits.c = temp & 0x1;
+		uint8_t temp = cpu->a;
+		cpu->a = cpu->a >> 1 | (cpu->f_bits.c << 7);
+		cpu->f_bits.z = 0;
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = 0;
+		cpu->f_bits.c = temp & 0x1;
 		break;
 	}
 
-	case 0x20: /* JR NZ, imm */
-		if(!gb->cpu_reg.f_bits.z)
+	PGB_OP(0x20): /* JR NZ, imm */
+		if(!cpu->f_bits.z)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
+			int8_t temp = (int8_t) PGB_FETCH_IMM8();
+			cpu->pc.reg += temp;
 			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg++;
+			cpu->pc.reg++;
 
 		break;
 
-	case 0x21: /* LD HL, imm */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x21): /* LD HL, imm */
+		cpu->hl.bytes.l = PGB_FETCH_IMM8();
+		cpu->hl.bytes.h = PGB_FETCH_IMM8();
 		break;
 
-	case 0x22: /* LDI (HL), A */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
-		gb->cpu_reg.hl.reg++;
+	PGB_OP(0x22): /* LDI (HL), A */
+		__gb_write(gb, cpu->hl.reg, cpu->a);
+		cpu->hl.reg++;
 		break;
 
-	case 0x23: /* INC HL */
-		gb->cpu_reg.hl.reg++;
+	PGB_OP(0x23): /* INC HL */
+		cpu->hl.reg++;
 		break;
 
-	case 0x24: /* INC H */
-		gb->cpu_reg.hl.bytes.h++;
-		gb->cpu_reg.f_bits.z = (gb->cpu_reg.hl.bytes.h == 0x00);
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.hl.bytes.h & 0x0F) == 0x00);
+	PGB_OP(0x24): /* INC H */
+		cpu->hl.bytes.h++;
+		cpu->f_bits.z = (cpu->hl.bytes.h == 0x00);
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = ((cpu->hl.bytes.h & 0x0F) == 0x00);
 		break;
 
-	case 0x25: /* DEC H */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.h);
+	PGB_OP(0x25): /* DEC H */
+		PGB_INSTR_DEC_R8(cpu->hl.bytes.h);
 		break;
 
-	case 0x26: /* LD H, imm */
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x26): /* LD H, imm */
+		cpu->hl.bytes.h = PGB_FETCH_IMM8();
 		break;
 
-	case 0x27: /* DAA */
+	PGB_OP(0x27): /* DAA */
 	{
 		/* The following is from SameBoy. MIT License. */
-		int16_t a = gb->cpu_reg.a;
+		int16_t a = cpu->a;
 
-		if(gb->cpu_reg.f_bits.n)
+		if(cpu->f_bits.n)
 		{
-			if(gb->cpu_reg.f_bits.h)
+			if(cpu->f_bits.h)
 				a = (a - 0x06) & 0xFF;
 
-			if(gb->cpu_reg.f_bits.c)
+			if(cpu->f_bits.c)
 				a -= 0x60;
 		}
 		else
 		{
-			if(gb->cpu_reg.f_bits.h || (a & 0x0F) > 9)
+			if(cpu->f_bits.h || (a & 0x0F) > 9)
 				a += 0x06;
 
-			if(gb->cpu_reg.f_bits.c || a > 0x9F)
+			if(cpu->f_bits.c || a > 0x9F)
 				a += 0x60;
 		}
 
 		if((a & 0x100) == 0x100)
-			gb->cpu_reg.f_bits.c = 1;
+			cpu->f_bits.c = 1;
 
-		gb->cpu_reg.a = a;
-		gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0);
-		gb->cpu_reg.f_bits.h = 0;
+		cpu->a = a;
+		cpu->f_bits.z = (cpu->a == 0);
+		cpu->f_bits.h = 0;
 
 		break;
 	}
 
-	case 0x28: /* JR Z, imm */
-		if(gb->cpu_reg.f_bits.z)
+	PGB_OP(0x28): /* JR Z, imm */
+		if(cpu->f_bits.z)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
+			int8_t temp = (int8_t) PGB_FETCH_IMM8();
+			cpu->pc.reg += temp;
 			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg++;
+			cpu->pc.reg++;
 
 		break;
 
-	case 0x29: /* ADD HL, HL */
+	PGB_OP(0x29): /* ADD HL, HL */
 	{
-		gb->cpu_reg.f_bits.c = (gb->cpu_reg.hl.reg & 0x8000) > 0;
-		gb->cpu_reg.hl.reg <<= 1;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = (gb->cpu_reg.hl.reg & 0x1000) > 0;
+		cpu->f_bits.c = (cpu->hl.reg & 0x8000) > 0;
+		cpu->hl.reg <<= 1;
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = (cpu->hl.reg & 0x1000) > 0;
 		break;
 	}
 
-	case 0x2A: /* LD A, (HL+) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg++);
+	PGB_OP(0x2A): /* LD A, (HL+) */
+		cpu->a = __gb_read(gb, cpu->hl.reg++);
 		break;
 
-	case 0x2B: /* DEC HL */
-		gb->cpu_reg.hl.reg--;
+	PGB_OP(0x2B): /* DEC HL */
+		cpu->hl.reg--;
 		break;
 
-	case 0x2C: /* INC L */
-		gb->cpu_reg.hl.bytes.l++;
-		gb->cpu_reg.f_bits.z = (gb->cpu_reg.hl.bytes.l == 0x00);
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.hl.bytes.l & 0x0F) == 0x00);
+	PGB_OP(0x2C): /* INC L */
+		cpu->hl.bytes.l++;
+		cpu->f_bits.z = (cpu->hl.bytes.l == 0x00);
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = ((cpu->hl.bytes.l & 0x0F) == 0x00);
 		break;
 
-	case 0x2D: /* DEC L */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.l);
+	PGB_OP(0x2D): /* DEC L */
+		PGB_INSTR_DEC_R8(cpu->hl.bytes.l);
 		break;
 
-	case 0x2E: /* LD L, imm */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x2E): /* LD L, imm */
+		cpu->hl.bytes.l = PGB_FETCH_IMM8();
 		break;
 
-	case 0x2F: /* CPL */
-		gb->cpu_reg.a = ~gb->cpu_reg.a;
-		gb->cpu_reg.f_bits.n = 1;
-		gb->cpu_reg.f_bits.h = 1;
+	PGB_OP(0x2F): /* CPL */
+		cpu->a = ~cpu->a;
+		cpu->f_bits.n = 1;
+		cpu->f_bits.h = 1;
 		break;
 
-	case 0x30: /* JR NC, imm */
-		if(!gb->cpu_reg.f_bits.c)
+	PGB_OP(0x30): /* JR NC, imm */
+		if(!cpu->f_bits.c)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
+			int8_t temp = (int8_t) PGB_FETCH_IMM8();
+			cpu->pc.reg += temp;
 			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg++;
+			cpu->pc.reg++;
 
 		break;
 
-	case 0x31: /* LD SP, imm */
-		gb->cpu_reg.sp.bytes.p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.sp.bytes.s = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x31): /* LD SP, imm */
+		cpu->sp.bytes.p = PGB_FETCH_IMM8();
+		cpu->sp.bytes.s = PGB_FETCH_IMM8();
 		break;
 
-	case 0x32: /* LD (HL), A */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
-		gb->cpu_reg.hl.reg--;
+	PGB_OP(0x32): /* LD (HL), A */
+		__gb_write(gb, cpu->hl.reg, cpu->a);
+		cpu->hl.reg--;
 		break;
 
-	case 0x33: /* INC SP */
-		gb->cpu_reg.sp.reg++;
+	PGB_OP(0x33): /* INC SP */
+		cpu->sp.reg++;
 		break;
 
-	case 0x34: /* INC (HL) */
+	PGB_OP(0x34): /* INC (HL) */
 	{
-		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg) + 1;
-		gb->cpu_reg.f_bits.z = (temp == 0x00);
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((temp & 0x0F) == 0x00);
-		__gb_write(gb, gb->cpu_reg.hl.reg, temp);
+		uint8_t temp = __gb_read(gb, cpu->hl.reg) + 1;
+		cpu->f_bits.z = (temp == 0x00);
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = ((temp & 0x0F) == 0x00);
+		__gb_write(gb, cpu->hl.reg, temp);
 		break;
 	}
 
-	case 0x35: /* DEC (HL) */
+	PGB_OP(0x35): /* DEC (HL) */
 	{
-		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg) - 1;
-		gb->cpu_reg.f_bits.z = (temp == 0x00);
-		gb->cpu_reg.f_bits.n = 1;
-		gb->cpu_reg.f_bits.h = ((temp & 0x0F) == 0x0F);
-		__gb_write(gb, gb->cpu_reg.hl.reg, temp);
+		uint8_t temp = __gb_read(gb, cpu->hl.reg) - 1;
+		cpu->f_bits.z = (temp == 0x00);
+		cpu->f_bits.n = 1;
+		cpu->f_bits.h = ((temp & 0x0F) == 0x0F);
+		__gb_write(gb, cpu->hl.reg, temp);
 		break;
 	}
 
-	case 0x36: /* LD (HL), imm */
-		__gb_write(gb, gb->cpu_reg.hl.reg, __gb_read(gb, gb->cpu_reg.pc.reg++));
+	PGB_OP(0x36): /* LD (HL), imm */
+		__gb_write(gb, cpu->hl.reg, PGB_FETCH_IMM8());
 		break;
 
-	case 0x37: /* SCF */
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = 0;
-		gb->cpu_reg.f_bits.c = 1;
+	PGB_OP(0x37): /* SCF */
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = 0;
+		cpu->f_bits.c = 1;
 		break;
 
-	case 0x38: /* JR C, imm */
-		if(gb->cpu_reg.f_bits.c)
+	PGB_OP(0x38): /* JR C, imm */
+		if(cpu->f_bits.c)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
+			int8_t temp = (int8_t) PGB_FETCH_IMM8();
+			cpu->pc.reg += temp;
 			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg++;
+			cpu->pc.reg++;
 
 		break;
 
-	case 0x39: /* ADD HL, SP */
+	PGB_OP(0x39): /* ADD HL, SP */
 	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.sp.reg;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h =
-			((gb->cpu_reg.hl.reg & 0xFFF) + (gb->cpu_reg.sp.reg & 0xFFF)) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f_bits.c = temp & 0x10000 ? 1 : 0;
-		gb->cpu_reg.hl.reg = (uint16_t)temp;
+		uint_fast32_t temp = cpu->hl.reg + cpu->sp.reg;
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h =
+			((cpu->hl.reg & 0xFFF) + (cpu->sp.reg & 0xFFF)) & 0x1000 ? 1 : 0;
+		cpu->f_bits.c = temp & 0x10000 ? 1 : 0;
+		cpu->hl.reg = (uint16_t)temp;
 		break;
 	}
 
-	case 0x3A: /* LD A, (HL) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg--);
+	PGB_OP(0x3A): /* LD A, (HL) */
+		cpu->a = __gb_read(gb, cpu->hl.reg--);
 		break;
 
-	case 0x3B: /* DEC SP */
-		gb->cpu_reg.sp.reg--;
+	PGB_OP(0x3B): /* DEC SP */
+		cpu->sp.reg--;
 		break;
 
-	case 0x3C: /* INC A */
-		gb->cpu_reg.a++;
-		gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a & 0x0F) == 0x00);
+	PGB_OP(0x3C): /* INC A */
+		cpu->a++;
+		cpu->f_bits.z = (cpu->a == 0x00);
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = ((cpu->a & 0x0F) == 0x00);
 		break;
 
-	case 0x3D: /* DEC A */
-		gb->cpu_reg.a--;
-		gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
-		gb->cpu_reg.f_bits.n = 1;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a & 0x0F) == 0x0F);
+	PGB_OP(0x3D): /* DEC A */
+		cpu->a--;
+		cpu->f_bits.z = (cpu->a == 0x00);
+		cpu->f_bits.n = 1;
+		cpu->f_bits.h = ((cpu->a & 0x0F) == 0x0F);
 		break;
 
-	case 0x3E: /* LD A, imm */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OP(0x3E): /* LD A, imm */
+		cpu->a = PGB_FETCH_IMM8();
 		break;
 
-	case 0x3F: /* CCF */
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = 0;
-		gb->cpu_reg.f_bits.c = ~gb->cpu_reg.f_bits.c;
+	PGB_OP(0x3F): /* CCF */
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = 0;
+		cpu->f_bits.c = ~cpu->f_bits.c;
 		break;
 
-	case 0x40: /* LD B, B */
+	PGB_OP(0x40): /* LD B, B */
 		break;
 
-	case 0x41: /* LD B, C */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.bc.bytes.c;
+	PGB_OP(0x41): /* LD B, C */
+		cpu->bc.bytes.b = cpu->bc.bytes.c;
 		break;
 
-	case 0x42: /* LD B, D */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.d;
+	PGB_OP(0x42): /* LD B, D */
+		cpu->bc.bytes.b = cpu->de.bytes.d;
 		break;
 
-	case 0x43: /* LD B, E */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.e;
+	PGB_OP(0x43): /* LD B, E */
+		cpu->bc.bytes.b = cpu->de.bytes.e;
 		break;
 
-	case 0x44: /* LD B, H */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.h;
+	PGB_OP(0x44): /* LD B, H */
+		cpu->bc.bytes.b = cpu->hl.bytes.h;
 		break;
 
-	case 0x45: /* LD B, L */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.l;
+	PGB_OP(0x45): /* LD B, L */
+		cpu->bc.bytes.b = cpu->hl.bytes.l;
 		break;
 
-	case 0x46: /* LD B, (HL) */
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OP(0x46): /* LD B, (HL) */
+		cpu->bc.bytes.b = __gb_read(gb, cpu->hl.reg);
 		break;
 
-	case 0x47: /* LD B, A */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.a;
+	PGB_OP(0x47): /* LD B, A */
+		cpu->bc.bytes.b = cpu->a;
 		break;
 
-	case 0x48: /* LD C, B */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.bc.bytes.b;
+	PGB_OP(0x48): /* LD C, B */
+		cpu->bc.bytes.c = cpu->bc.bytes.b;
 		break;
 
-	case 0x49: /* LD C, C */
+	PGB_OP(0x49): /* LD C, C */
 		break;
 
-	case 0x4A: /* LD C, D */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.d;
+	PGB_OP(0x4A): /* LD C, D */
+		cpu->bc.bytes.c = cpu->de.bytes.d;
 		break;
 
-	case 0x4B: /* LD C, E */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.e;
+	PGB_OP(0x4B): /* LD C, E */
+		cpu->bc.bytes.c = cpu->de.bytes.e;
 		break;
 
-	case 0x4C: /* LD C, H */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.h;
+	PGB_OP(0x4C): /* LD C, H */
+		cpu->bc.bytes.c = cpu->hl.bytes.h;
 		break;
 
-	case 0x4D: /* LD C, L */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.l;
+	PGB_OP(0x4D): /* LD C, L */
+		cpu->bc.bytes.c = cpu->hl.bytes.l;
 		break;
 
-	case 0x4E: /* LD C, (HL) */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OP(0x4E): /* LD C, (HL) */
+		cpu->bc.bytes.c = __gb_read(gb, cpu->hl.reg);
 		break;
 
-	case 0x4F: /* LD C, A */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.a;
+	PGB_OP(0x4F): /* LD C, A */
+		cpu->bc.bytes.c = cpu->a;
 		break;
 
-	case 0x50: /* LD D, B */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.b;
+	PGB_OP(0x50): /* LD D, B */
+		cpu->de.bytes.d = cpu->bc.bytes.b;
 		break;
 
-	case 0x51: /* LD D, C */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.c;
+	PGB_OP(0x51): /* LD D, C */
+		cpu->de.bytes.d = cpu->bc.bytes.c;
 		break;
 
-	case 0x52: /* LD D, D */
+	PGB_OP(0x52): /* LD D, D */
 		break;
 
-	case 0x53: /* LD D, E */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.de.bytes.e;
+	PGB_OP(0x53): /* LD D, E */
+		cpu->de.bytes.d = cpu->de.bytes.e;
 		break;
 
-	case 0x54: /* LD D, H */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.h;
+	PGB_OP(0x54): /* LD D, H */
+		cpu->de.bytes.d = cpu->hl.bytes.h;
 		break;
 
-	case 0x55: /* LD D, L */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.l;
+	PGB_OP(0x55): /* LD D, L */
+		cpu->de.bytes.d = cpu->hl.bytes.l;
 		break;
 
-	case 0x56: /* LD D, (HL) */
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OP(0x56): /* LD D, (HL) */
+		cpu->de.bytes.d = __gb_read(gb, cpu->hl.reg);
 		break;
 
-	case 0x57: /* LD D, A */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.a;
+	PGB_OP(0x57): /* LD D, A */
+		cpu->de.bytes.d = cpu->a;
 		break;
 
-	case 0x58: /* LD E, B */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.b;
+	PGB_OP(0x58): /* LD E, B */
+		cpu->de.bytes.e = cpu->bc.bytes.b;
 		break;
 
-	case 0x59: /* LD E, C */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.c;
+	PGB_OP(0x59): /* LD E, C */
+		cpu->de.bytes.e = cpu->bc.bytes.c;
 		break;
 
-	case 0x5A: /* LD E, D */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.de.bytes.d;
+	PGB_OP(0x5A): /* LD E, D */
+		cpu->de.bytes.e = cpu->de.bytes.d;
 		break;
 
-	case 0x5B: /* LD E, E */
+	PGB_OP(0x5B): /* LD E, E */
 		break;
 
-	case 0x5C: /* LD E, H */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.h;
+	PGB_OP(0x5C): /* LD E, H */
+		cpu->de.bytes.e = cpu->hl.bytes.h;
 		break;
 
-	case 0x5D: /* LD E, L */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.l;
+	PGB_OP(0x5D): /* LD E, L */
+		cpu->de.bytes.e = cpu->hl.bytes.l;
 		break;
 
-	case 0x5E: /* LD E, (HL) */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OP(0x5E): /* LD E, (HL) */
+		cpu->de.bytes.e = __gb_read(gb, cpu->hl.reg);
 		break;
 
-	case 0x5F: /* LD E, A */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.a;
+	PGB_OP(0x5F): /* LD E, A */
+		cpu->de.bytes.e = cpu->a;
 		break;
 
-	case 0x60: /* LD H, B */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.b;
+	PGB_OP(0x60): /* LD H, B */
+		cpu->hl.bytes.h = cpu->bc.bytes.b;
 		break;
 
-	case 0x61: /* LD H, C */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.c;
+	PGB_OP(0x61): /* LD H, C */
+		cpu->hl.bytes.h = cpu->bc.bytes.c;
 		break;
 
-	case 0x62: /* LD H, D */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.d;
+	PGB_OP(0x62): /* LD H, D */
+		cpu->hl.bytes.h = cpu->de.bytes.d;
 		break;
 
-	case 0x63: /* LD H, E */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.e;
+	PGB_OP(0x63): /* LD H, E */
+		cpu->hl.bytes.h = cpu->de.bytes.e;
 		break;
 
-	case 0x64: /* LD H, H */
+	PGB_OP(0x64): /* LD H, H */
 		break;
 
-	case 0x65: /* LD H, L */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.hl.bytes.l;
+	PGB_OP(0x65): /* LD H, L */
+		cpu->hl.bytes.h = cpu->hl.bytes.l;
 		break;
 
-	case 0x66: /* LD H, (HL) */
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OP(0x66): /* LD H, (HL) */
+		cpu->hl.bytes.h = __gb_read(gb, cpu->hl.reg);
 		break;
 
-	case 0x67: /* LD H, A */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.a;
+	PGB_OP(0x67): /* LD H, A */
+		cpu->hl.bytes.h = cpu->a;
 		break;
 
-	case 0x68: /* LD L, B */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.b;
+	PGB_OP(0x68): /* LD L, B */
+		cpu->hl.bytes.l = cpu->bc.bytes.b;
 		break;
 
-	case 0x69: /* LD L, C */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.c;
+	PGB_OP(0x69): /* LD L, C */
+		cpu->hl.bytes.l = cpu->bc.bytes.c;
 		break;
 
-	case 0x6A: /* LD L, D */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.d;
+	PGB_OP(0x6A): /* LD L, D */
+		cpu->hl.bytes.l = cpu->de.bytes.d;
 		break;
 
-	case 0x6B: /* LD L, E */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.e;
+	PGB_OP(0x6B): /* LD L, E */
+		cpu->hl.bytes.l = cpu->de.bytes.e;
 		break;
 
-	case 0x6C: /* LD L, H */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.hl.bytes.h;
+	PGB_OP(0x6C): /* LD L, H */
+		cpu->hl.bytes.l = cpu->hl.bytes.h;
 		break;
 
-	case 0x6D: /* LD L, L */
+	PGB_OP(0x6D): /* LD L, L */
 		break;
 
-	case 0x6E: /* LD L, (HL) */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OP(0x6E): /* LD L, (HL) */
+		cpu->hl.bytes.l = __gb_read(gb, cpu->hl.reg);
 		break;
 
-	case 0x6F: /* LD L, A */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.a;
+	PGB_OP(0x6F): /* LD L, A */
+		cpu->hl.bytes.l = cpu->a;
 		break;
 
-	case 0x70: /* LD (HL), B */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.b);
+	PGB_OP(0x70): /* LD (HL), B */
+		__gb_write(gb, cpu->hl.reg, cpu->bc.bytes.b);
 		break;
 
-	case 0x71: /* LD (HL), C */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.c);
+	PGB_OP(0x71): /* LD (HL), C */
+		__gb_write(gb, cpu->hl.reg, cpu->bc.bytes.c);
 		break;
 
-	case 0x72: /* LD (HL), D */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.d);
+	PGB_OP(0x72): /* LD (HL), D */
+		__gb_write(gb, cpu->hl.reg, cpu->de.bytes.d);
 		break;
 
-	case 0x73: /* LD (HL), E */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.e);
+	PGB_OP(0x73): /* LD (HL), E */
+		__gb_write(gb, cpu->hl.reg, cpu->de.bytes.e);
 		break;
 
-	case 0x74: /* LD (HL), H */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.h);
+	PGB_OP(0x74): /* LD (HL), H */
+		__gb_write(gb, cpu->hl.reg, cpu->hl.bytes.h);
 		break;
 
-	case 0x75: /* LD (HL), L */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.l);
+	PGB_OP(0x75): /* LD (HL), L */
+		__gb_write(gb, cpu->hl.reg, cpu->hl.bytes.l);
 		break;
 
-	case 0x76: /* HALT */
-	{
-		int_fast16_t halt_cycles = INT_FAST16_MAX;
-
+	PGB_OP(0x76): /* HALT */
 		/* TODO: Emulate HALT bug? */
-		gb->gb_halt = 1;
-
-		if (gb->hram_io[IO_IE] == 0)
-		{
-			/* Return program counter where this halt forever state started. */
-			/* This may be intentional, but this is required to stop an infinite
-			 * loop. */
-			(gb->gb_error)(gb, GB_HALT_FOREVER, gb->cpu_reg.pc.reg - 1);
-			PGB_UNREACHABLE();
-		}
-
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
-		{
-			int serial_cycles = SERIAL_CYCLES -
-				gb->counter.serial_count;
-
-			if(serial_cycles < halt_cycles)
-				halt_cycles = serial_cycles;
-		}
-
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			int tac_cycles = TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK] -
-				gb->counter.tima_count;
-
-			if(tac_cycles < halt_cycles)
-				halt_cycles = tac_cycles;
-		}
-
-		if((gb->hram_io[IO_LCDC] & LCDC_ENABLE))
-		{
-			int lcd_cycles;
-
-			/* If LCD is in HBlank, calculate the number of cycles
-			 * until the end of HBlank and the start of mode 2 or
-			 * mode 1. */
-			if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_HBLANK)
-			{
-				lcd_cycles = LCD_MODE_2_CYCLES -
-					     gb->counter.lcd_count;
-			}
-			else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_SEARCH_OAM)
-			{
-				lcd_cycles = LCD_MODE_3_CYCLES -
-					gb->counter.lcd_count;
-			}
-			else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_SEARCH_TRANSFER)
-			{
-				lcd_cycles = LCD_MODE_0_CYCLES -
-					gb->counter.lcd_count;
-			}
-			else
-			{
-				/* VBlank */
-				lcd_cycles =
-					LCD_LINE_CYCLES - gb->counter.lcd_count;
-			}
+		gb->gb_halt = 1;
 
-			if(lcd_cycles < halt_cycles)
-				halt_cycles = lcd_cycles;
+		if (gb->hram_io[IO_IE] == 0)
+		{
+			/* Return program counter where this halt forever state started. */
+			/* This may be intentional, but this is required to stop an infinite
+			 * loop. */
+			(gb->gb_error)(gb, GB_HALT_FOREVER, cpu->pc.reg - 1);
+			PGB_UNREACHABLE();
 		}
 
-		/* Some halt cycles may already be very high, so make sure we
-		 * don't underflow here. */
-		if(halt_cycles <= 0)
-			halt_cycles = 4;
-
-		inst_cycles = (uint_fast16_t)halt_cycles;
 		break;
-	}
 
-	case 0x77: /* LD (HL), A */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
+	PGB_OP(0x77): /* LD (HL), A */
+		__gb_write(gb, cpu->hl.reg, cpu->a);
 		break;
 
-	case 0x78: /* LD A, B */
-		gb->cpu_reg.a = gb->cpu_reg.bc.bytes.b;
+	PGB_OP(0x78): /* LD A, B */
+		cpu->a = cpu->bc.bytes.b;
 		break;
 
-	case 0x79: /* LD A, C */
-		gb->cpu_reg.a = gb->cpu_reg.bc.bytes.c;
+	PGB_OP(0x79): /* LD A, C */
+		cpu->a = cpu->bc.bytes.c;
 		break;
 
-	case 0x7A: /* LD A, D */
-		gb->cpu_reg.a = gb->cpu_reg.de.bytes.d;
+	PGB_OP(0x7A): /* LD A, D */
+		cpu->a = cpu->de.bytes.d;
 		break;
 
-	case 0x7B: /* LD A, E */
-		gb->cpu_reg.a = gb->cpu_reg.de.bytes.e;
+	PGB_OP(0x7B): /* LD A, E */
+		cpu->a = cpu->de.bytes.e;
 		break;
 
-	case 0x7C: /* LD A, H */
-		gb->cpu_reg.a = gb->cpu_reg.hl.bytes.h;
+	PGB_OP(0x7C): /* LD A, H */
+		cpu->a = cpu->hl.bytes.h;
 		break;
 
-	case 0x7D: /* LD A, L */
-		gb->cpu_reg.a = gb->cpu_reg.hl.bytes.l;
+	PGB_OP(0x7D): /* LD A, L */
+		cpu->a = cpu->hl.bytes.l;
 		break;
 
-	case 0x7E: /* LD A, (HL) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OP(0x7E): /* LD A, (HL) */
+		cpu->a = __gb_read(gb, cpu->hl.reg);
 		break;
 
-	case 0x7F: /* LD A, A */
+	PGB_OP(0x7F): /* LD A, A */
 		break;
 
-	case 0x80: /* ADD A, B */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.b, 0);
+	PGB_OP(0x80): /* ADD A, B */
+		PGB_INSTR_ADC_R8(cpu->bc.bytes.b, 0);
 		break;
 
-	case 0x81: /* ADD A, C */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.c, 0);
+	PGB_OP(0x81): /* ADD A, C */
+		PGB_INSTR_ADC_R8(cpu->bc.bytes.c, 0);
 		break;
 
-	case 0x82: /* ADD A, D */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.d, 0);
+	PGB_OP(0x82): /* ADD A, D */
+		PGB_INSTR_ADC_R8(cpu->de.bytes.d, 0);
 		break;
 
-	case 0x83: /* ADD A, E */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.e, 0);
+	PGB_OP(0x83): /* ADD A, E */
+		PGB_INSTR_ADC_R8(cpu->de.bytes.e, 0);
 		break;
 
-	case 0x84: /* ADD A, H */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.h, 0);
+	PGB_OP(0x84): /* ADD A, H */
+		PGB_INSTR_ADC_R8(cpu->hl.bytes.h, 0);
 		break;
 
-	case 0x85: /* ADD A, L */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.l, 0);
+	PGB_OP(0x85): /* ADD A, L */
+		PGB_INSTR_ADC_R8(cpu->hl.bytes.l, 0);
 		break;
 
-	case 0x86: /* ADD A, (HL) */
-		PGB_INSTR_ADC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), 0);
+	PGB_OP(0x86): /* ADD A, (HL) */
+		PGB_INSTR_ADC_R8(__gb_read(gb, cpu->hl.reg), 0);
 		break;
 
-	case 0x87: /* ADD A, A */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.a, 0);
+	PGB_OP(0x87): /* ADD A, A */
+		PGB_INSTR_ADC_R8(cpu->a, 0);
 		break;
 
-	case 0x88: /* ADC A, B */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.b, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x88): /* ADC A, B */
+		PGB_INSTR_ADC_R8(cpu->bc.bytes.b, cpu->f_bits.c);
 		break;
 
-	case 0x89: /* ADC A, C */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.c, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x89): /* ADC A, C */
+		PGB_INSTR_ADC_R8(cpu->bc.bytes.c, cpu->f_bits.c);
 		break;
 
-	case 0x8A: /* ADC A, D */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.d, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x8A): /* ADC A, D */
+		PGB_INSTR_ADC_R8(cpu->de.bytes.d, cpu->f_bits.c);
 		break;
 
-	case 0x8B: /* ADC A, E */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.e, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x8B): /* ADC A, E */
+		PGB_INSTR_ADC_R8(cpu->de.bytes.e, cpu->f_bits.c);
 		break;
 
-	case 0x8C: /* ADC A, H */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.h, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x8C): /* ADC A, H */
+		PGB_INSTR_ADC_R8(cpu->hl.bytes.h, cpu->f_bits.c);
 		break;
 
-	case 0x8D: /* ADC A, L */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.l, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x8D): /* ADC A, L */
+		PGB_INSTR_ADC_R8(cpu->hl.bytes.l, cpu->f_bits.c);
 		break;
 
-	case 0x8E: /* ADC A, (HL) */
-		PGB_INSTR_ADC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), gb->cpu_reg.f_bits.c);
+	PGB_OP(0x8E): /* ADC A, (HL) */
+		PGB_INSTR_ADC_R8(__gb_read(gb, cpu->hl.reg), cpu->f_bits.c);
 		break;
 
-	case 0x8F: /* ADC A, A */
-		PGB_INSTR_ADC_R8(gb->cpu_reg.a, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x8F): /* ADC A, A */
+		PGB_INSTR_ADC_R8(cpu->a, cpu->f_bits.c);
 		break;
 
-	case 0x90: /* SUB B */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.b, 0);
+	PGB_OP(0x90): /* SUB B */
+		PGB_INSTR_SBC_R8(cpu->bc.bytes.b, 0);
 		break;
 
-	case 0x91: /* SUB C */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.c, 0);
+	PGB_OP(0x91): /* SUB C */
+		PGB_INSTR_SBC_R8(cpu->bc.bytes.c, 0);
 		break;
 
-	case 0x92: /* SUB D */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.d, 0);
+	PGB_OP(0x92): /* SUB D */
+		PGB_INSTR_SBC_R8(cpu->de.bytes.d, 0);
 		break;
 
-	case 0x93: /* SUB E */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.e, 0);
+	PGB_OP(0x93): /* SUB E */
+		PGB_INSTR_SBC_R8(cpu->de.bytes.e, 0);
 		break;
 
-	case 0x94: /* SUB H */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.h, 0);
+	PGB_OP(0x94): /* SUB H */
+		PGB_INSTR_SBC_R8(cpu->hl.bytes.h, 0);
 		break;
 
-	case 0x95: /* SUB L */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.l, 0);
+	PGB_OP(0x95): /* SUB L */
+		PGB_INSTR_SBC_R8(cpu->hl.bytes.l, 0);
 		break;
 
-	case 0x96: /* SUB (HL) */
-		PGB_INSTR_SBC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), 0);
+	PGB_OP(0x96): /* SUB (HL) */
+		PGB_INSTR_SBC_R8(__gb_read(gb, cpu->hl.reg), 0);
 		break;
 
-	case 0x97: /* SUB A */
-		gb->cpu_reg.a = 0;
-		gb->cpu_reg.f_bits.z = 1;
-		gb->cpu_reg.f_bits.n = 1;
-		gb->cpu_reg.f_bits.h = 0;
-		gb->cpu_reg.f_bits.c = 0;
+	PGB_OP(0x97): /* SUB A */
+		cpu->a = 0;
+		cpu->f_bits.z = 1;
+		cpu->f_bits.n = 1;
+		cpu->f_bits.h = 0;
+		cpu->f_bits.c = 0;
 		break;
 
-	case 0x98: /* SBC A, B */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.b, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x98): /* SBC A, B */
+		PGB_INSTR_SBC_R8(cpu->bc.bytes.b, cpu->f_bits.c);
 		break;
 
-	case 0x99: /* SBC A, C */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.c, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x99): /* SBC A, C */
+		PGB_INSTR_SBC_R8(cpu->bc.bytes.c, cpu->f_bits.c);
 		break;
 
-	case 0x9A: /* SBC A, D */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.d, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x9A): /* SBC A, D */
+		PGB_INSTR_SBC_R8(cpu->de.bytes.d, cpu->f_bits.c);
 		break;
 
-	case 0x9B: /* SBC A, E */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.e, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x9B): /* SBC A, E */
+		PGB_INSTR_SBC_R8(cpu->de.bytes.e, cpu->f_bits.c);
 		break;
 
-	case 0x9C: /* SBC A, H */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.h, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x9C): /* SBC A, H */
+		PGB_INSTR_SBC_R8(cpu->hl.bytes.h, cpu->f_bits.c);
 		break;
 
-	case 0x9D: /* SBC A, L */
-		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.l, gb->cpu_reg.f_bits.c);
+	PGB_OP(0x9D): /* SBC A, L */
+		PGB_INSTR_SBC_R8(cpu->hl.bytes.l, cpu->f_bits.c);
 		break;
 
-	case 0x9E: /* SBC A, (HL) */
-		PGB_INSTR_SBC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), gb->cpu_reg.f_bits.c);
+	PGB_OP(0x9E): /* SBC A, (HL) */
+		PGB_INSTR_SBC_R8(__gb_read(gb, cpu->hl.reg), cpu->f_bits.c);
 		break;
 
-	case 0x9F: /* SBC A, A */
-		gb->cpu_reg.a = gb->cpu_reg.f_bits.c ? 0xFF : 0x00;
-		gb->cpu_reg.f_bits.z = !gb->cpu_reg.f_bits.c;
-		gb->cpu_reg.f_bits.n = 1;
-		gb->cpu_reg.f_bits.h = gb->cpu_reg.f_bits.c;
+	PGB_OP(0x9F): /* SBC A, A */
+		cpu->a = cpu->f_bits.c ? 0xFF : 0x00;
+		cpu->f_bits.z = !cpu->f_bits.c;
+		cpu->f_bits.n = 1;
+		cpu->f_bits.h = cpu->f_bits.c;
 		break;
 
-	case 0xA0: /* AND B */
-		PGB_INSTR_AND_R8(gb->cpu_reg.bc.bytes.b);
+	PGB_OP(0xA0): /* AND B */
+		PGB_INSTR_AND_R8(cpu->bc.bytes.b);
 		break;
 
-	case 0xA1: /* AND C */
-		PGB_INSTR_AND_R8(gb->cpu_reg.bc.bytes.c);
+	PGB_OP(0xA1): /* AND C */
+		PGB_INSTR_AND_R8(cpu->bc.bytes.c);
 		break;
 
-	case 0xA2: /* AND D */
-		PGB_INSTR_AND_R8(gb->cpu_reg.de.bytes.d);
+	PGB_OP(0xA2): /* AND D */
+		PGB_INSTR_AND_R8(cpu->de.bytes.d);
 		break;
 
-	case 0xA3: /* AND E */
-		PGB_INSTR_AND_R8(gb->cpu_reg.de.bytes.e);
+	PGB_OP(0xA3): /* AND E */
+		PGB_INSTR_AND_R8(cpu->de.bytes.e);
 		break;
 
-	case 0xA4: /* AND H */
-		PGB_INSTR_AND_R8(gb->cpu_reg.hl.bytes.h);
+	PGB_OP(0xA4): /* AND H */
+		PGB_INSTR_AND_R8(cpu->hl.bytes.h);
 		break;
 
-	case 0xA5: /* AND L */
-		PGB_INSTR_AND_R8(gb->cpu_reg.hl.bytes.l);
+	PGB_OP(0xA5): /* AND L */
+		PGB_INSTR_AND_R8(cpu->hl.bytes.l);
 		break;
 
-	case 0xA6: /* AND (HL) */
-		PGB_INSTR_AND_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
+	PGB_OP(0xA6): /* AND (HL) */
+		PGB_INSTR_AND_R8(__gb_read(gb, cpu->hl.reg));
 		break;
 
-	case 0xA7: /* AND A */
-		PGB_INSTR_AND_R8(gb->cpu_reg.a);
+	PGB_OP(0xA7): /* AND A */
+		PGB_INSTR_AND_R8(cpu->a);
 		break;
 
-	case 0xA8: /* XOR B */
-		PGB_INSTR_XOR_R8(gb->cpu_reg.bc.bytes.b);
+	PGB_OP(0xA8): /* XOR B */
+		PGB_INSTR_XOR_R8(cpu->bc.bytes.b);
 		break;
 
-	case 0xA9: /* XOR C */
-		PGB_INSTR_XOR_R8(gb->cpu_reg.bc.bytes.c);
+	PGB_OP(0xA9): /* XOR C */
+		PGB_INSTR_XOR_R8(cpu->bc.bytes.c);
 		break;
 
-	case 0xAA: /* XOR D */
-		PGB_INSTR_XOR_R8(gb->cpu_reg.de.bytes.d);
+	PGB_OP(0xAA): /* XOR D */
+		PGB_INSTR_XOR_R8(cpu->de.bytes.d);
 		break;
 
-	case 0xAB: /* XOR E */
-		PGB_INSTR_XOR_R8(gb->cpu_reg.de.bytes.e);
+	PGB_OP(0xAB): /* XOR E */
+		PGB_INSTR_XOR_R8(cpu->de.bytes.e);
 		break;
 
-	case 0xAC: /* XOR H */
-		PGB_INSTR_XOR_R8(gb->cpu_reg.hl.bytes.h);
+	PGB_OP(0xAC): /* XOR H */
+		PGB_INSTR_XOR_R8(cpu->hl.bytes.h);
 		break;
 
-	case 0xAD: /* XOR L */
-		PGB_INSTR_XOR_R8(gb->cpu_reg.hl.bytes.l);
+	PGB_OP(0xAD): /* XOR L */
+		PGB_INSTR_XOR_R8(cpu->hl.bytes.l);
 		break;
 
-	case 0xAE: /* XOR (HL) */
-		PGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
+	PGB_OP(0xAE): /* XOR (HL) */
+		PGB_INSTR_XOR_R8(__gb_read(gb, cpu->hl.reg));
 		break;
 
-	case 0xAF: /* XOR A */
-		PGB_INSTR_XOR_R8(gb->cpu_reg.a);
+	PGB_OP(0xAF): /* XOR A */
+		PGB_INSTR_XOR_R8(cpu->a);
 		break;
 
-	case 0xB0: /* OR B */
-		PGB_INSTR_OR_R8(gb->cpu_reg.bc.bytes.b);
+	PGB_OP(0xB0): /* OR B */
+		PGB_INSTR_OR_R8(cpu->bc.bytes.b);
 		break;
 
-	case 0xB1: /* OR C */
-		PGB_INSTR_OR_R8(gb->cpu_reg.bc.bytes.c);
+	PGB_OP(0xB1): /* OR C */
+		PGB_INSTR_OR_R8(cpu->bc.bytes.c);
 		break;
 
-	case 0xB2: /* OR D */
-		PGB_INSTR_OR_R8(gb->cpu_reg.de.bytes.d);
+	PGB_OP(0xB2): /* OR D */
+		PGB_INSTR_OR_R8(cpu->de.bytes.d);
 		break;
 
-	case 0xB3: /* OR E */
-		PGB_INSTR_OR_R8(gb->cpu_reg.de.bytes.e);
+	PGB_OP(0xB3): /* OR E */
+		PGB_INSTR_OR_R8(cpu->de.bytes.e);
 		break;
 
-	case 0xB4: /* OR H */
-		PGB_INSTR_OR_R8(gb->cpu_reg.hl.bytes.h);
+	PGB_OP(0xB4): /* OR H */
+		PGB_INSTR_OR_R8(cpu->hl.bytes.h);
 		break;
 
-	case 0xB5: /* OR L */
-		PGB_INSTR_OR_R8(gb->cpu_reg.hl.bytes.l);
+	PGB_OP(0xB5): /* OR L */
+		PGB_INSTR_OR_R8(cpu->hl.bytes.l);
 		break;
 
-	case 0xB6: /* OR (HL) */
-		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
+	PGB_OP(0xB6): /* OR (HL) */
+		PGB_INSTR_OR_R8(__gb_read(gb, cpu->hl.reg));
 		break;
 
-	case 0xB7: /* OR A */
-		PGB_INSTR_OR_R8(gb->cpu_reg.a);
+	PGB_OP(0xB7): /* OR A */
+		PGB_INSTR_OR_R8(cpu->a);
 		break;
 
-	case 0xB8: /* CP B */
-		PGB_INSTR_CP_R8(gb->cpu_reg.bc.bytes.b);
+	PGB_OP(0xB8): /* CP B */
+		PGB_INSTR_CP_R8(cpu->bc.bytes.b);
 		break;
 
-	case 0xB9: /* CP C */
-		PGB_INSTR_CP_R8(gb->cpu_reg.bc.bytes.c);
+	PGB_OP(0xB9): /* CP C */
+		PGB_INSTR_CP_R8(cpu->bc.bytes.c);
 		break;
 
-	case 0xBA: /* CP D */
-		PGB_INSTR_CP_R8(gb->cpu_reg.de.bytes.d);
+	PGB_OP(0xBA): /* CP D */
+		PGB_INSTR_CP_R8(cpu->de.bytes.d);
 		break;
 
-	case 0xBB: /* CP E */
-		PGB_INSTR_CP_R8(gb->cpu_reg.de.bytes.e);
+	PGB_OP(0xBB): /* CP E */
+		PGB_INSTR_CP_R8(cpu->de.bytes.e);
 		break;
 
-	case 0xBC: /* CP H */
-		PGB_INSTR_CP_R8(gb->cpu_reg.hl.bytes.h);
+	PGB_OP(0xBC): /* CP H */
+		PGB_INSTR_CP_R8(cpu->hl.bytes.h);
 		break;
 
-	case 0xBD: /* CP L */
-		PGB_INSTR_CP_R8(gb->cpu_reg.hl.bytes.l);
+	PGB_OP(0xBD): /* CP L */
+		PGB_INSTR_CP_R8(cpu->hl.bytes.l);
 		break;
 
-	case 0xBE: /* CP (HL) */
-		PGB_INSTR_CP_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
+	PGB_OP(0xBE): /* CP (HL) */
+		PGB_INSTR_CP_R8(__gb_read(gb, cpu->hl.reg));
 		break;
 
-	case 0xBF: /* CP A */
-		gb->cpu_reg.f_bits.z = 1;
-		gb->cpu_reg.f_bits.n = 1;
-		gb->cpu_reg.f_bits.h = 0;
-		gb->cpu_reg.f_bits.c = 0;
+	PGB_OP(0xBF): /* CP A */
+		cpu->f_bits.z = 1;
+		cpu->f_bits.n = 1;
+		cpu->f_bits.h = 0;
+		cpu->f_bits.c = 0;
 		break;
 
-	case 0xC0: /* RET NZ */
-		if(!gb->cpu_reg.f_bits.z)
+	PGB_OP(0xC0): /* RET NZ */
+		if(!cpu->f_bits.z)
 		{
-			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-			gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
+			cpu->pc.bytes.c = __gb_read(gb, cpu->sp.reg++);
+			cpu->pc.bytes.p = __gb_read(gb, cpu->sp.reg++);
 			inst_cycles += 12;
 		}
 
 		break;
 
-	case 0xC1: /* POP BC */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.sp.reg++);
+	PGB_OP(0xC1): /* POP BC */
+		cpu->bc.bytes.c = __gb_read(gb, cpu->sp.reg++);
+		cpu->bc.bytes.b = __gb_read(gb, cpu->sp.reg++);
 		break;
 
-	case 0xC2: /* JP NZ, imm */
-		if(!gb->cpu_reg.f_bits.z)
+	PGB_OP(0xC2): /* JP NZ, imm */
+		if(!cpu->f_bits.z)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
+			c = PGB_FETCH_IMM8();
+			p = PGB_FETCH_IMM8();
+			cpu->pc.bytes.c = c;
+			cpu->pc.bytes.p = p;
 			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			cpu->pc.reg += 2;
 
 		break;
 
-	case 0xC3: /* JP imm */
+	PGB_OP(0xC3): /* JP imm */
 	{
 		uint8_t p, c;
-		c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		p = __gb_read(gb, gb->cpu_reg.pc.reg);
-		gb->cpu_reg.pc.bytes.c = c;
-		gb->cpu_reg.pc.bytes.p = p;
+		c = PGB_FETCH_IMM8();
+		p = PGB_FETCH_IMM8();
+		cpu->pc.bytes.c = c;
+		cpu->pc.bytes.p = p;
 		break;
 	}
 
-	case 0xC4: /* CALL NZ imm */
-		if(!gb->cpu_reg.f_bits.z)
+	PGB_OP(0xC4): /* CALL NZ imm */
+		if(!cpu->f_bits.z)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
+			c = PGB_FETCH_IMM8();
+			p = PGB_FETCH_IMM8();
+			__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+			__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+			cpu->pc.bytes.c = c;
+			cpu->pc.bytes.p = p;
 			inst_cycles += 12;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			cpu->pc.reg += 2;
 
 		break;
 
-	case 0xC5: /* PUSH BC */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.b);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.c);
+	PGB_OP(0xC5): /* PUSH BC */
+		__gb_write(gb, --cpu->sp.reg, cpu->bc.bytes.b);
+		__gb_write(gb, --cpu->sp.reg, cpu->bc.bytes.c);
 		break;
 
-	case 0xC6: /* ADD A, imm */
+	PGB_OP(0xC6): /* ADD A, imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t val = PGB_FETCH_IMM8();
 		PGB_INSTR_ADC_R8(val, 0);
 		break;
 	}
 
-	case 0xC7: /* RST 0x0000 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0000;
+	PGB_OP(0xC7): /* RST 0x0000 */
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+		cpu->pc.reg = 0x0000;
 		break;
 
-	case 0xC8: /* RET Z */
-		if(gb->cpu_reg.f_bits.z)
+	PGB_OP(0xC8): /* RET Z */
+		if(cpu->f_bits.z)
 		{
-			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-			gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
+			cpu->pc.bytes.c = __gb_read(gb, cpu->sp.reg++);
+			cpu->pc.bytes.p = __gb_read(gb, cpu->sp.reg++);
 			inst_cycles += 12;
 		}
 		break;
 
-	case 0xC9: /* RET */
+	PGB_OP(0xC9): /* RET */
 	{
-		gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		cpu->pc.bytes.c = __gb_read(gb, cpu->sp.reg++);
+		cpu->pc.bytes.p = __gb_read(gb, cpu->sp.reg++);
 		break;
 	}
 
-	case 0xCA: /* JP Z, imm */
-		if(gb->cpu_reg.f_bits.z)
+	PGB_OP(0xCA): /* JP Z, imm */
+		if(cpu->f_bits.z)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
+			c = PGB_FETCH_IMM8();
+			p = PGB_FETCH_IMM8();
+			cpu->pc.bytes.c = c;
+			cpu->pc.bytes.p = p;
 			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			cpu->pc.reg += 2;
 
 		break;
 
-	case 0xCB: /* CB INST */
-		inst_cycles = __gb_execute_cb(gb);
+	PGB_OP(0xCB): /* CB INST */
+		inst_cycles = __gb_execute_cb(gb, cpu, PGB_FETCH_IMM8());
 		break;
 
-	case 0xCC: /* CALL Z, imm */
-		if(gb->cpu_reg.f_bits.z)
+	PGB_OP(0xCC): /* CALL Z, imm */
+		if(cpu->f_bits.z)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
+			c = PGB_FETCH_IMM8();
+			p = PGB_FETCH_IMM8();
+			__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+			__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+			cpu->pc.bytes.c = c;
+			cpu->pc.bytes.p = p;
 			inst_cycles += 12;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			cpu->pc.reg += 2;
 
 		break;
 
-	case 0xCD: /* CALL imm */
+	PGB_OP(0xCD): /* CALL imm */
 	{
 		uint8_t p, c;
-		c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.bytes.c = c;
-		gb->cpu_reg.pc.bytes.p = p;
+		c = PGB_FETCH_IMM8();
+		p = PGB_FETCH_IMM8();
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+		cpu->pc.bytes.c = c;
+		cpu->pc.bytes.p = p;
 	}
 	break;
 
-	case 0xCE: /* ADC A, imm */
+	PGB_OP(0xCE): /* ADC A, imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		PGB_INSTR_ADC_R8(val, gb->cpu_reg.f_bits.c);
+		uint8_t val = PGB_FETCH_IMM8();
+		PGB_INSTR_ADC_R8(val, cpu->f_bits.c);
 		break;
 	}
 
-	case 0xCF: /* RST 0x0008 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0008;
+	PGB_OP(0xCF): /* RST 0x0008 */
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+		cpu->pc.reg = 0x0008;
 		break;
 
-	case 0xD0: /* RET NC */
-		if(!gb->cpu_reg.f_bits.c)
+	PGB_OP(0xD0): /* RET NC */
+		if(!cpu->f_bits.c)
 		{
-			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-			gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
+			cpu->pc.bytes.c = __gb_read(gb, cpu->sp.reg++);
+			cpu->pc.bytes.p = __gb_read(gb, cpu->sp.reg++);
 			inst_cycles += 12;
 		}
 
 		break;
 
-	case 0xD1: /* POP DE */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.sp.reg++);
+	PGB_OP(0xD1): /* POP DE */
+		cpu->de.bytes.e = __gb_read(gb, cpu->sp.reg++);
+		cpu->de.bytes.d = __gb_read(gb, cpu->sp.reg++);
 		break;
 
-	case 0xD2: /* JP NC, imm */
-		if(!gb->cpu_reg.f_bits.c)
+	PGB_OP(0xD2): /* JP NC, imm */
+		if(!cpu->f_bits.c)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
+			c = PGB_FETCH_IMM8();
+			p = PGB_FETCH_IMM8();
+			cpu->pc.bytes.c = c;
+			cpu->pc.bytes.p = p;
 			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			cpu->pc.reg += 2;
 
 		break;
 
-	case 0xD4: /* CALL NC, imm */
-		if(!gb->cpu_reg.f_bits.c)
+	PGB_OP(0xD4): /* CALL NC, imm */
+		if(!cpu->f_bits.c)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
+			c = PGB_FETCH_IMM8();
+			p = PGB_FETCH_IMM8();
+			__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+			__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+			cpu->pc.bytes.c = c;
+			cpu->pc.bytes.p = p;
 			inst_cycles += 12;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			cpu->pc.reg += 2;
 
 		break;
 
-	case 0xD5: /* PUSH DE */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.d);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.e);
+	PGB_OP(0xD5): /* PUSH DE */
+		__gb_write(gb, --cpu->sp.reg, cpu->de.bytes.d);
+		__gb_write(gb, --cpu->sp.reg, cpu->de.bytes.e);
 		break;
 
-	case 0xD6: /* SUB imm */
+	PGB_OP(0xD6): /* SUB imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		uint16_t temp = gb->cpu_reg.a - val;
-		gb->cpu_reg.f_bits.z = ((temp & 0xFF) == 0x00);
-		gb->cpu_reg.f_bits.n = 1;
-		gb->cpu_reg.f_bits.h =
-			(gb->cpu_reg.a ^ val ^ temp) & 0x10 ? 1 : 0;
-		gb->cpu_reg.f_bits.c = (temp & 0xFF00) ? 1 : 0;
-		gb->cpu_reg.a = (temp & 0xFF);
+		uint8_t val = PGB_FETCH_IMM8();
+		uint16_t temp = cpu->a - val;
+		cpu->f_bits.z = ((temp & 0xFF) == 0x00);
+		cpu->f_bits.n = 1;
+		cpu->f_bits.h =
+			(cpu->a ^ val ^ temp) & 0x10 ? 1 : 0;
+		cpu->f_bits.c = (temp & 0xFF00) ? 1 : 0;
+		cpu->a = (temp & 0xFF);
 		break;
 	}
 
-	case 0xD7: /* RST 0x0010 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0010;
+	PGB_OP(0xD7): /* RST 0x0010 */
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+		cpu->pc.reg = 0x0010;
 		break;
 
-	case 0xD8: /* RET C */
-		if(gb->cpu_reg.f_bits.c)
+	PGB_OP(0xD8): /* RET C */
+		if(cpu->f_bits.c)
 		{
-			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-			gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
+			cpu->pc.bytes.c = __gb_read(gb, cpu->sp.reg++);
+			cpu->pc.bytes.p = __gb_read(gb, cpu->sp.reg++);
 			inst_cycles += 12;
 		}
 
 		break;
 
-	case 0xD9: /* RETI */
+	PGB_OP(0xD9): /* RETI */
 	{
-		gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		cpu->pc.bytes.c = __gb_read(gb, cpu->sp.reg++);
+		cpu->pc.bytes.p = __gb_read(gb, cpu->sp.reg++);
 		gb->gb_ime = 1;
 	}
 	break;
 
-	case 0xDA: /* JP C, imm */
-		if(gb->cpu_reg.f_bits.c)
+	PGB_OP(0xDA): /* JP C, imm */
+		if(cpu->f_bits.c)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
+			c = PGB_FETCH_IMM8();
+			p = PGB_FETCH_IMM8();
+			cpu->pc.bytes.c = c;
+			cpu->pc.bytes.p = p;
 			inst_cycles += 4;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			cpu->pc.reg += 2;
 
 		break;
 
-	case 0xDC: /* CALL C, imm */
-		if(gb->cpu_reg.f_bits.c)
+	PGB_OP(0xDC): /* CALL C, imm */
+		if(cpu->f_bits.c)
 		{
 			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
+			c = PGB_FETCH_IMM8();
+			p = PGB_FETCH_IMM8();
+			__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+			__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+			cpu->pc.bytes.c = c;
+			cpu->pc.bytes.p = p;
 			inst_cycles += 12;
 		}
 		else
-			gb->cpu_reg.pc.reg += 2;
+			cpu->pc.reg += 2;
 
 		break;
 
-	case 0xDE: /* SBC A, imm */
+	PGB_OP(0xDE): /* SBC A, imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		PGB_INSTR_SBC_R8(val, gb->cpu_reg.f_bits.c);
+		uint8_t val = PGB_FETCH_IMM8();
+		PGB_INSTR_SBC_R8(val, cpu->f_bits.c);
 		break;
 	}
 
-	case 0xDF: /* RST 0x0018 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0018;
+	PGB_OP(0xDF): /* RST 0x0018 */
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+		cpu->pc.reg = 0x0018;
 		break;
 
-	case 0xE0: /* LD (0xFF00+imm), A */
-		__gb_write(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++),
-			   gb->cpu_reg.a);
+	PGB_OP(0xE0): /* LD (0xFF00+imm), A */
+		__gb_write(gb, 0xFF00 | PGB_FETCH_IMM8(),
+			   cpu->a);
 		break;
 
-	case 0xE1: /* POP HL */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.sp.reg++);
+	PGB_OP(0xE1): /* POP HL */
+		cpu->hl.bytes.l = __gb_read(gb, cpu->sp.reg++);
+		cpu->hl.bytes.h = __gb_read(gb, cpu->sp.reg++);
 		break;
 
-	case 0xE2: /* LD (C), A */
-		__gb_write(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c, gb->cpu_reg.a);
+	PGB_OP(0xE2): /* LD (C), A */
+		__gb_write(gb, 0xFF00 | cpu->bc.bytes.c, cpu->a);
 		break;
 
-	case 0xE5: /* PUSH HL */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.h);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.l);
+	PGB_OP(0xE5): /* PUSH HL */
+		__gb_write(gb, --cpu->sp.reg, cpu->hl.bytes.h);
+		__gb_write(gb, --cpu->sp.reg, cpu->hl.bytes.l);
 		break;
 
-	case 0xE6: /* AND imm */
+	PGB_OP(0xE6): /* AND imm */
 		/* TODO: Optimisation? */
-		gb->cpu_reg.a = gb->cpu_reg.a & __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = 1;
-		gb->cpu_reg.f_bits.c = 0;
+		cpu->a = cpu->a & PGB_FETCH_IMM8();
+		cpu->f_bits.z = (cpu->a == 0x00);
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = 1;
+		cpu->f_bits.c = 0;
 		break;
 
-	case 0xE7: /* RST 0x0020 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0020;
+	PGB_OP(0xE7): /* RST 0x0020 */
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+		cpu->pc.reg = 0x0020;
 		break;
 
-	case 0xE8: /* ADD SP, imm */
+	PGB_OP(0xE8): /* ADD SP, imm */
 	{
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.f_bits.z = 0;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
-		gb->cpu_reg.sp.reg += offset;
+		int8_t offset = (int8_t) PGB_FETCH_IMM8();
+		cpu->f_bits.z = 0;
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = ((cpu->sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+		cpu->f_bits.c = ((cpu->sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
+		cpu->sp.reg += offset;
 		break;
 	}
 
-	case 0xE9: /* JP (HL) */
-		gb->cpu_reg.pc.reg = gb->cpu_reg.hl.reg;
+	PGB_OP(0xE9): /* JP (HL) */
+		cpu->pc.reg = cpu->hl.reg;
 		break;
 
-	case 0xEA: /* LD (imm), A */
+	PGB_OP(0xEA): /* LD (imm), A */
 	{
 		uint8_t h, l;
 		uint16_t addr;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		l = PGB_FETCH_IMM8();
+		h = PGB_FETCH_IMM8();
 		addr = PEANUT_GB_U8_TO_U16(h, l);
-		__gb_write(gb, addr, gb->cpu_reg.a);
+		__gb_write(gb, addr, cpu->a);
 		break;
 	}
 
-	case 0xEE: /* XOR imm */
-		PGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
+	PGB_OP(0xEE): /* XOR imm */
+		PGB_INSTR_XOR_R8(PGB_FETCH_IMM8());
 		break;
 
-	case 0xEF: /* RST 0x0028 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0028;
+	PGB_OP(0xEF): /* RST 0x0028 */
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+		cpu->pc.reg = 0x0028;
 		break;
 
-	case 0xF0: /* LD A, (0xFF00+imm) */
-		gb->cpu_reg.a =
-			__gb_read(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++));
+	PGB_OP(0xF0): /* LD A, (0xFF00+imm) */
+		cpu->a =
+			__gb_read(gb, 0xFF00 | PGB_FETCH_IMM8());
 		break;
 
-	case 0xF1: /* POP AF */
+	PGB_OP(0xF1): /* POP AF */
 	{
-		uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.f_bits.z = (temp_8 >> 7) & 1;
-		gb->cpu_reg.f_bits.n = (temp_8 >> 6) & 1;
-		gb->cpu_reg.f_bits.h = (temp_8 >> 5) & 1;
-		gb->cpu_reg.f_bits.c = (temp_8 >> 4) & 1;
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		uint8_t temp_8 = __gb_read(gb, cpu->sp.reg++);
+		cpu->f_bits.z = (temp_8 >> 7) & 1;
+		cpu->f_bits.n = (temp_8 >> 6) & 1;
+		cpu->f_bits.h = (temp_8 >> 5) & 1;
+		cpu->f_bits.c = (temp_8 >> 4) & 1;
+		cpu->a = __gb_read(gb, cpu->sp.reg++);
 		break;
 	}
 
-	case 0xF2: /* LD A, (C) */
-		gb->cpu_reg.a = __gb_read(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c);
+	PGB_OP(0xF2): /* LD A, (C) */
+		cpu->a = __gb_read(gb, 0xFF00 | cpu->bc.bytes.c);
 		break;
 
-	case 0xF3: /* DI */
+	PGB_OP(0xF3): /* DI */
 		gb->gb_ime = 0;
 		break;
 
-	case 0xF5: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
-		__gb_write(gb, --gb->cpu_reg.sp.reg,
-			   gb->cpu_reg.f_bits.z << 7 | gb->cpu_reg.f_bits.n << 6 |
-			   gb->cpu_reg.f_bits.h << 5 | gb->cpu_reg.f_bits.c << 4);
+	PGB_OP(0xF5): /* PUSH AF */
+		__gb_write(gb, --cpu->sp.reg, cpu->a);
+		__gb_write(gb, --cpu->sp.reg,
+			   cpu->f_bits.z << 7 | cpu->f_bits.n << 6 |
+			   cpu->f_bits.h << 5 | cpu->f_bits.c << 4);
 		break;
 
-	case 0xF6: /* OR imm */
-		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
+	PGB_OP(0xF6): /* OR imm */
+		PGB_INSTR_OR_R8(PGB_FETCH_IMM8());
 		break;
 
-	case 0xF7: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0030;
+	PGB_OP(0xF7): /* PUSH AF */
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+		cpu->pc.reg = 0x0030;
 		break;
 
-	case 0xF8: /* LD HL, SP+/-imm */
+	PGB_OP(0xF8): /* LD HL, SP+/-imm */
 	{
 		/* Taken from SameBoy, which is released under MIT Licence. */
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
-		gb->cpu_reg.f_bits.z = 0;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 :
+		int8_t offset = (int8_t) PGB_FETCH_IMM8();
+		cpu->hl.reg = cpu->sp.reg + offset;
+		cpu->f_bits.z = 0;
+		cpu->f_bits.n = 0;
+		cpu->f_bits.h = ((cpu->sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+		cpu->f_bits.c = ((cpu->sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 :
 				       0;
 		break;
 	}
 
-	case 0xF9: /* LD SP, HL */
-		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
+	PGB_OP(0xF9): /* LD SP, HL */
+		cpu->sp.reg = cpu->hl.reg;
 		break;
 
-	case 0xFA: /* LD A, (imm) */
+	PGB_OP(0xFA): /* LD A, (imm) */
 	{
 		uint8_t h, l;
 		uint16_t addr;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		l = PGB_FETCH_IMM8();
+		h = PGB_FETCH_IMM8();
 		addr = PEANUT_GB_U8_TO_U16(h, l);
-		gb->cpu_reg.a = __gb_read(gb, addr);
+		cpu->a = __gb_read(gb, addr);
 		break;
 	}
 
-	case 0xFB: /* EI */
+	PGB_OP(0xFB): /* EI */
 		gb->gb_ime = 1;
 		break;
 
-	case 0xFE: /* CP imm */
+	PGB_OP(0xFE): /* CP imm */
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint8_t val = PGB_FETCH_IMM8();
 		PGB_INSTR_CP_R8(val);
 		break;
 	}
 
-	case 0xFF: /* RST 0x0038 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0038;
+	PGB_OP(0xFF): /* RST 0x0038 */
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.p);
+		__gb_write(gb, --cpu->sp.reg, cpu->pc.bytes.c);
+		cpu->pc.reg = 0x0038;
 		break;
 
 	default:
+#if PEANUT_GB_THREADED_DISPATCH
+	op_invalid:
+#endif
 		/* Return address where invlid opcode that was read. */
-		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
+		(gb->gb_error)(gb, GB_INVALID_OPCODE, cpu->pc.reg - 1);
 		PGB_UNREACHABLE();
 	}
 
-	do
-	{
-		/* DIV register timing */
-		gb->counter.div_count += inst_cycles;
-		while(gb->counter.div_count >= DIV_CYCLES)
-		{
-			gb->hram_io[IO_DIV]++;
-			gb->counter.div_count -= DIV_CYCLES;
-		}
-
-		/* Check serial transmission. */
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
-		{
-			unsigned int serial_cycles = SERIAL_CYCLES_1KB;
+	gb->counter.pending += inst_cycles;
 
-			/* If new transfer, call TX function. */
-			if(gb->counter.serial_count == 0 &&
-				gb->gb_serial_tx != NULL)
-				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
+#if PEANUT_GB_THREADED_DISPATCH
+	/* Go straight on to the next instruction unless an event is due, the
+	 * CPU halted, an interrupt is to be taken or a JR cc may have closed an
+	 * idle loop. */
+	if(gb->counter.pending < gb->counter.next_event && !gb->gb_halt &&
+			!(gb->gb_ime && gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR) &&
+			!((opcode & 0xE7) == 0x20 && inst_cycles == 12 && gb->direct.idle_skip))
+		goto fetch;
 
-#if PEANUT_FULL_GBC_SUPPORT
-			if(gb->hram_io[IO_SC] & 0x3)
-				serial_cycles = SERIAL_CYCLES_32KB;
+	gb->cpu_reg = regs;
 #endif
 
-			gb->counter.serial_count += inst_cycles;
-
-			/* If it's time to receive byte, call RX function. */
-			if(gb->counter.serial_count >= serial_cycles)
-			{
-				/* If RX can be done, do it. */
-				/* If RX failed, do not change SB if using external
-				 * clock, or set to 0xFF if using internal clock. */
-				uint8_t rx;
-
-				if(gb->gb_serial_rx != NULL &&
-					(gb->gb_serial_rx(gb, &rx) ==
-						GB_SERIAL_RX_SUCCESS))
-				{
-					gb->hram_io[IO_SB] = rx;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
-				{
-					/* If using internal clock, and console is not
-					 * attached to any external peripheral, shifted
-					 * bits are replaced with logic 1. */
-					gb->hram_io[IO_SB] = 0xFF;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else
-				{
-					/* If using external clock, and console is not
-					 * attached to any external peripheral, bits are
-					 * not shifted, so SB is not modified. */
-				}
-
-				gb->counter.serial_count = 0;
-			}
-		}
-
-		/* TIMA register timing */
-		/* TODO: Change tac_enable to struct of TAC timer control bits. */
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+	/* If halted, jump from one event to the next until an interrupt
+	 * occurs. */
+	while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0)
+	{
+		if(gb->counter.pending < gb->counter.next_event)
 		{
-			gb->counter.tima_count += inst_cycles;
-
-			while(gb->counter.tima_count >=
-				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
-			{
-				gb->counter.tima_count -=
-					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
-
-				if(++gb->hram_io[IO_TIMA] == 0)
-				{
-					gb->hram_io[IO_IF] |= TIMER_INTR;
-					/* On overflow, set TMA to TIMA. */
-					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
-				}
-			}
+			gb->counter.idle_cycles +=
+				gb->counter.next_event - gb->counter.pending;
+			gb->counter.pending = gb->counter.next_event;
 		}
 
-		/* If LCD is off, don't update LCD state or increase the LCD
-		 * ticks. */
-		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
-			continue;
-
-		/* LCD Timing */
-#if PEANUT_FULL_GBC_SUPPORT
-        if (inst_cycles > 1)
-            gb->counter.lcd_count += (inst_cycles >> gb->cgb.doubleSpeed);
-        else
-#endif
-		gb->counter.lcd_count += inst_cycles;
-
-		/* New Scanline */
-		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
-		{
-			gb->counter.lcd_count -= LCD_LINE_CYCLES;
-
-			/* Next line */
-			gb->hram_io[IO_LY] = (gb->hram_io[IO_LY] + 1) % LCD_VERT_LINES;
-
-			/* LYC Update */
-			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
-			{
-				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
-
-				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
-			}
-			else
-				gb->hram_io[IO_STAT] &= 0xFB;
-
-			/* VBLANK Start */
-			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
-			{
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
-				gb->gb_frame = 1;
-				gb->hram_io[IO_IF] |= VBLANK_INTR;
-				gb->lcd_blank = 0;
-
-				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
-
-#if ENABLE_LCD
-				/* If frame skip is activated, check if we need to draw
-				 * the frame or skip it. */
-				if(gb->direct.frame_skip)
-				{
-					gb->display.frame_skip_count =
-						!gb->display.frame_skip_count;
-				}
+		__gb_sync<cgb_mode>(gb);
+	}
 
-				/* If interlaced is activated, change which lines get
-				 * updated. Also, only update lines on frames that are
-				 * actually drawn when frame skip is enabled. */
-				if(gb->direct.interlace &&
-						(!gb->direct.frame_skip ||
-						 gb->display.frame_skip_count))
-				{
-					gb->display.interlace_count =
-						!gb->display.interlace_count;
-				}
-#endif
-			}
-			/* Normal Line */
-			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
-			{
-				if(gb->hram_io[IO_LY] == 0)
-				{
-					/* Clear Screen */
-					gb->display.WY = gb->hram_io[IO_WY];
-					gb->display.window_clear = 0;
-				}
+	/* A taken JR cc may have closed a loop waiting for the next event. */
+	if(gb->direct.idle_skip && (opcode & 0xE7) == 0x20 &&
+			inst_cycles == 12 &&
+			gb->counter.pending < gb->counter.next_event)
+		__gb_skip_idle_loop(gb);
 
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+	/* Only catch up the timers and LCD when an event is due. */
+	if(gb->counter.pending >= gb->counter.next_event)
+		__gb_sync<cgb_mode>(gb);
+}
+#undef PGB_FETCH_IMM8
+#undef PGB_OP
 
+void __gb_step_cpu(struct gb_s *gb)
+{
 #if PEANUT_FULL_GBC_SUPPORT
-				//DMA GBC
-				if(gb->cgb.cgbMode && !gb->cgb.dmaActive && gb->cgb.dmaMode)
-				{
-					for (uint8_t i = 0; i < 0x10; i++)
-					{
-						__gb_write(gb, ((gb->cgb.dmaDest & 0x1FF0) | 0x8000) + i,
-								   __gb_read(gb, (gb->cgb.dmaSource & 0xFFF0) + i));
-					}
-					gb->cgb.dmaSource += 0x10;
-					gb->cgb.dmaDest += 0x10;
-					if(!(--gb->cgb.dmaSize)) gb->cgb.dmaActive = 1;
-				}
+	if(gb->cgb.cgbMode)
+	{
+		__gb_step_cpu<true>(gb);
+		return;
+	}
 #endif
-				if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
-
-				/* If halted immediately jump to next LCD mode. */
-				if(gb->counter.lcd_count < LCD_MODE_2_CYCLES)
-					inst_cycles = LCD_MODE_2_CYCLES - gb->counter.lcd_count;
-			}
-		}
-		/* OAM access */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_HBLANK &&
-				gb->counter.lcd_count >= LCD_MODE_2_CYCLES)
-		{
-			gb->hram_io[IO_STAT] =
-				(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_SEARCH_OAM;
-
-			if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
-				gb->hram_io[IO_IF] |= LCDC_INTR;
+	__gb_step_cpu<false>(gb);
+}
 
-			/* If halted immediately jump to next LCD mode. */
-			if (gb->counter.lcd_count < LCD_MODE_3_CYCLES)
-				inst_cycles = LCD_MODE_3_CYCLES - gb->counter.lcd_count;
-		}
-		/* Update LCD */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_SEARCH_OAM &&
-				gb->counter.lcd_count >= LCD_MODE_3_CYCLES)
-		{
-			gb->hram_io[IO_STAT] =
-				(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_SEARCH_TRANSFER;
-#if ENABLE_LCD
-			if(!gb->lcd_blank)
-				__gb_draw_line(gb);
-#endif
-			/* If halted immediately jump to next LCD mode. */
-			if (gb->counter.lcd_count < LCD_MODE_0_CYCLES)
-				inst_cycles = LCD_MODE_0_CYCLES - gb->counter.lcd_count;
-		}
-	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
-	/* If halted, loop until an interrupt occurs. */
+template<bool cgb_mode>
+static void __gb_run_frame(struct gb_s *gb)
+{
+	while(!gb->gb_frame)
+		__gb_step_cpu<cgb_mode>(gb);
 }
 
 void gb_run_frame(struct gb_s *gb)
 {
 	gb->gb_frame = 0;
+	gb->counter.idle_cycles = 0;
+	gb->counter.frame_cycles = 0;
 
-	while(!gb->gb_frame)
-		__gb_step_cpu(gb);
+	/* The mode is fixed by the cartridge header flag read in gb_init(). */
+#if PEANUT_FULL_GBC_SUPPORT
+	if(gb->cgb.cgbMode)
+	{
+		__gb_run_frame<true>(gb);
+		return;
+	}
+#endif
+	__gb_run_frame<false>(gb);
 }
 
 /**
@@ -3864,7 +4741,7 @@ uint_fast32_t gb_get_save_size(struct gb_s *gb)
 	const uint_fast16_t ram_size_location = 0x0149;
 	const uint_fast32_t ram_sizes[] =
 	{
-		0x00, 0x800, 0x2000, 0x8000, 0x20000
+		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
 	};
 	uint8_t ram_size = gb->gb_rom_read(gb, ram_size_location);
 
@@ -3909,9 +4786,13 @@ void gb_reset(struct gb_s *gb)
 	/* Initialise MBC values. */
 	gb->selected_rom_bank = 1;
 	gb->cart_ram_bank = 0;
+	gb->cart_ram_offset = 0;
 	gb->enable_cart_ram = 0;
 	gb->cart_mode_select = 0;
 
+	/* Everything uses the slow path until the memory map is rebuilt. */
+	__gb_map_pages(gb->map.read, gb->map.write, 0x0000, 0x100, NULL);
+
 	/* Use values as though the boot ROM was already executed. */
 	if(gb->gb_bootrom_read == NULL)
 	{
@@ -3965,6 +4846,9 @@ void gb_reset(struct gb_s *gb)
 	gb->counter.div_count = 0;
 	gb->counter.tima_count = 0;
 	gb->counter.serial_count = 0;
+	gb->counter.pending = 0;
+	gb->counter.idle_cycles = 0;
+	gb->counter.frame_cycles = 0;
 
 	gb->direct.joypad = 0xFF;
 	gb->hram_io[IO_JOYP] = 0xCF;
@@ -4015,6 +4899,12 @@ void gb_reset(struct gb_s *gb)
 	gb->cgb.dmaSource = 0;
 	gb->cgb.dmaDest = 0;
 #endif
+
+	__gb_map_all(gb);
+	__gb_schedule(gb);
+#if PEANUT_GB_ICACHE_SIZE
+	__gb_icache_flush(gb);
+#endif
 }
 
 enum gb_init_error_e gb_init(struct gb_s *gb,
@@ -4101,9 +4991,27 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 	/* Note that MBC2 will appear to have no RAM banks, but it actually
 	 * always has 512 half-bytes of RAM. Hence, gb->num_ram_banks must be
 	 * ignored for MBC2. */
+	gb->cart_ram_mask = gb_get_save_size(gb);
+	if(gb->cart_ram_mask)
+		gb->cart_ram_mask--;
 
 	gb->lcd_blank = 0;
 	gb->display.lcd_draw_line = NULL;
+	gb->display.lcd_queue_line = NULL;
+	gb->display.lcd_wait_lines = NULL;
+	gb->display.vram_queued = 0;
+	gb->display.framebuffer = NULL;
+	__gb_default_colours(gb->display.colours);
+	gb->direct.idle_skip = 0;
+	gb->direct.cart_ram_track = 0;
+
+	/* ROM and cart RAM are only directly mapped once the front-end calls
+	 * gb_init_memory_map(). */
+	gb->map.rom = NULL;
+	gb->map.cart_ram = NULL;
+#if PEANUT_GB_ROM_BANK_CACHE
+	gb->rom_cache.count = 0;
+#endif
 
 	gb_reset(gb);
 
@@ -4148,12 +5056,55 @@ void gb_init_lcd(struct gb_s *gb,
 	gb->display.interlace_count = 0;
 	gb->direct.frame_skip = 0;
 	gb->display.frame_skip_count = 0;
+	gb->direct.skip_frame = 0;
 
 	gb->display.window_clear = 0;
 	gb->display.WY = 0;
+	gb->display.sprites_dirty = 1;
 
 	return;
 }
+
+void gb_init_lcd_queue(struct gb_s *gb,
+		void (*lcd_queue_line)(struct gb_s *gb,
+			const struct gb_line_s *line),
+		void (*lcd_wait_lines)(struct gb_s *gb))
+{
+	gb->display.lcd_queue_line = lcd_queue_line;
+	gb->display.lcd_wait_lines = lcd_queue_line != NULL ? lcd_wait_lines : NULL;
+	gb->display.vram_queued = 0;
+	__gb_map_vram(gb);
+}
+
+void gb_init_lcd_framebuffer(struct gb_s *gb, uint8_t *framebuffer,
+		const uint8_t colours[3][4])
+{
+	gb->display.framebuffer = framebuffer;
+
+	if(colours != NULL)
+		memcpy(gb->display.colours, colours, sizeof(gb->display.colours));
+	else
+		__gb_default_colours(gb->display.colours);
+
+	__gb_set_palette(gb->display.bg_palette, gb->display.colours[2],
+			gb->hram_io[IO_BGP]);
+	__gb_set_palette(gb->display.sp_palette, gb->display.colours[0],
+			gb->hram_io[IO_OBP0]);
+	__gb_set_palette(gb->display.sp_palette + 4, gb->display.colours[1],
+			gb->hram_io[IO_OBP1]);
+}
+
+void gb_render_line(struct gb_s *gb, const struct gb_line_s *line)
+{
+#if PEANUT_FULL_GBC_SUPPORT
+	if(gb->cgb.cgbMode)
+	{
+		__gb_render_line<true>(gb, line);
+		return;
+	}
+#endif
+	__gb_render_line<false>(gb, line);
+}
 #endif
 
 void gb_set_bootrom(struct gb_s *gb,
@@ -4162,6 +5113,329 @@ void gb_set_bootrom(struct gb_s *gb,
 	gb->gb_bootrom_read = gb_bootrom_read;
 }
 
+void gb_init_memory_map(struct gb_s *gb, const uint8_t *rom,
+		uint8_t *cart_ram)
+{
+	gb->map.rom = rom;
+	gb->map.cart_ram = cart_ram;
+#if PEANUT_GB_ROM_BANK_CACHE
+	/* Cached banks may belong to a different ROM, so the cache stays off
+	 * until gb_init_rom_bank_cache() is called again. */
+	gb->rom_cache.count = 0;
+#endif
+	__gb_map_all(gb);
+#if PEANUT_GB_ICACHE_SIZE
+	__gb_icache_flush(gb);
+#endif
+}
+
+void gb_cart_ram_clean(struct gb_s *gb, uint_fast32_t addr,
+		uint_fast32_t len)
+{
+	for(uint_fast16_t i = 0; i < 0x20; i++)
+	{
+		const uint_fast32_t offset = (gb->cart_ram_offset +
+				i * MAP_PAGE_SIZE) & gb->cart_ram_mask;
+
+		if(offset < addr + len && offset + MAP_PAGE_SIZE > addr)
+			gb->map.write[MAP_PAGE(CART_RAM_ADDR) + i] = NULL;
+	}
+}
+
+static uint8_t *__gb_state_put(uint8_t *p, uint_fast32_t v,
+		uint_fast8_t bytes)
+{
+	while(bytes--)
+	{
+		*p++ = v;
+		v >>= 8;
+	}
+
+	return p;
+}
+
+static uint_fast32_t __gb_state_get(const uint8_t **p, uint_fast8_t bytes)
+{
+	uint_fast32_t v = 0;
+
+	for(uint_fast8_t i = 0; i < bytes; i++)
+		v |= (uint_fast32_t)*(*p)++ << (i * 8);
+
+	return v;
+}
+
+uint8_t *gb_state_memory(struct gb_s *gb, const uint32_t id,
+		uint_fast32_t *size)
+{
+#if PEANUT_FULL_GBC_SUPPORT
+	const uint_fast8_t cgb = gb->cgb.cgbMode;
+#else
+	const uint_fast8_t cgb = 0;
+#endif
+
+	switch(id)
+	{
+	case GB_STATE_IO:
+		*size = HRAM_IO_SIZE;
+		return gb->hram_io;
+
+	case GB_STATE_OAM:
+		*size = OAM_SIZE;
+		return gb->oam;
+
+	/* DMG games only use the first bank of each. */
+	case GB_STATE_VRAM:
+		*size = cgb ? VRAM_SIZE : VRAM_BANK_SIZE;
+		return gb->vram;
+
+	case GB_STATE_WRAM:
+		*size = cgb ? WRAM_SIZE : WRAM_BANK_SIZE * 2;
+		return gb->wram;
+
+	default:
+		*size = 0;
+		return NULL;
+	}
+}
+
+bool gb_state_save(struct gb_s *gb,
+		bool (*write)(void *ctx, uint32_t id, const void *data,
+			uint_fast32_t size),
+		void *ctx)
+{
+	static const uint32_t memory[] = {
+		GB_STATE_IO, GB_STATE_OAM, GB_STATE_VRAM, GB_STATE_WRAM
+	};
+	uint8_t buf[GB_STATE_PACKED_MAX];
+	uint8_t *p;
+
+	p = buf;
+	*p++ = gb->cpu_reg.a;
+	*p++ = gb->cpu_reg.f_bits.z << 7 | gb->cpu_reg.f_bits.n << 6 |
+		gb->cpu_reg.f_bits.h << 5 | gb->cpu_reg.f_bits.c << 4;
+	p = __gb_state_put(p, gb->cpu_reg.bc.reg, 2);
+	p = __gb_state_put(p, gb->cpu_reg.de.reg, 2);
+	p = __gb_state_put(p, gb->cpu_reg.hl.reg, 2);
+	p = __gb_state_put(p, gb->cpu_reg.sp.reg, 2);
+	p = __gb_state_put(p, gb->cpu_reg.pc.reg, 2);
+	*p++ = gb->gb_halt | gb->gb_ime << 1;
+	p = __gb_state_put(p, gb->counter.lcd_count, 4);
+	p = __gb_state_put(p, gb->counter.div_count, 4);
+	p = __gb_state_put(p, gb->counter.tima_count, 4);
+	p = __gb_state_put(p, gb->counter.serial_count, 4);
+	p = __gb_state_put(p, gb->counter.pending, 4);
+	p = __gb_state_put(p, gb->counter.frame_cycles, 4);
+	if(!write(ctx, GB_STATE_CPU, buf, p - buf))
+		return false;
+
+	p = buf;
+	p = __gb_state_put(p, gb->selected_rom_bank, 2);
+	*p++ = gb->cart_ram_bank;
+	*p++ = gb->enable_cart_ram;
+	*p++ = gb->cart_mode_select;
+	memcpy(p, gb->cart_rtc, sizeof(gb->cart_rtc));
+	p += sizeof(gb->cart_rtc);
+	if(!write(ctx, GB_STATE_MBC, buf, p - buf))
+		return false;
+
+	p = buf;
+	*p++ = gb->lcd_blank;
+	*p++ = gb->display.window_clear;
+	*p++ = gb->display.WY;
+	if(!write(ctx, GB_STATE_LCD, buf, p - buf))
+		return false;
+
+#if PEANUT_FULL_GBC_SUPPORT
+	p = buf;
+	*p++ = gb->cgb.doubleSpeed;
+	*p++ = gb->cgb.doubleSpeedPrep;
+	*p++ = gb->cgb.wramBank;
+	*p++ = gb->cgb.vramBank;
+	*p++ = gb->cgb.BGPaletteID;
+	*p++ = gb->cgb.BGPaletteInc;
+	*p++ = gb->cgb.OAMPaletteID;
+	*p++ = gb->cgb.OAMPaletteInc;
+	*p++ = gb->cgb.dmaActive;
+	*p++ = gb->cgb.dmaMode;
+	*p++ = gb->cgb.dmaSize;
+	p = __gb_state_put(p, gb->cgb.dmaSource, 2);
+	p = __gb_state_put(p, gb->cgb.dmaDest, 2);
+	memcpy(p, gb->cgb.BGPalette, sizeof(gb->cgb.BGPalette));
+	p += sizeof(gb->cgb.BGPalette);
+	memcpy(p, gb->cgb.OAMPalette, sizeof(gb->cgb.OAMPalette));
+	p += sizeof(gb->cgb.OAMPalette);
+	if(!write(ctx, GB_STATE_CGB, buf, p - buf))
+		return false;
+#endif
+
+	for(uint_fast8_t i = 0; i < sizeof(memory) / sizeof(memory[0]); i++)
+	{
+		uint_fast32_t size;
+		const uint8_t *mem = gb_state_memory(gb, memory[i], &size);
+
+		if(!write(ctx, memory[i], mem, size))
+			return false;
+	}
+
+	return true;
+}
+
+bool gb_state_load(struct gb_s *gb, const uint32_t id, const uint8_t *data,
+		const uint_fast32_t size)
+{
+	const uint8_t *p = data;
+
+	/* Fields are only ever appended, so longer chunks saved by a later
+	 * version load too. */
+	switch(id)
+	{
+	case GB_STATE_CPU:
+		if(size < 37)
+			return false;
+
+		gb->cpu_reg.a = *p++;
+		gb->cpu_reg.f_bits.z = (*p >> 7) & 1;
+		gb->cpu_reg.f_bits.n = (*p >> 6) & 1;
+		gb->cpu_reg.f_bits.h = (*p >> 5) & 1;
+		gb->cpu_reg.f_bits.c = (*p++ >> 4) & 1;
+		gb->cpu_reg.bc.reg = __gb_state_get(&p, 2);
+		gb->cpu_reg.de.reg = __gb_state_get(&p, 2);
+		gb->cpu_reg.hl.reg = __gb_state_get(&p, 2);
+		gb->cpu_reg.sp.reg = __gb_state_get(&p, 2);
+		gb->cpu_reg.pc.reg = __gb_state_get(&p, 2);
+		gb->gb_halt = *p & 1;
+		gb->gb_ime = (*p++ >> 1) & 1;
+		gb->counter.lcd_count = __gb_state_get(&p, 4);
+		gb->counter.div_count = __gb_state_get(&p, 4);
+		gb->counter.tima_count = __gb_state_get(&p, 4);
+		gb->counter.serial_count = __gb_state_get(&p, 4);
+		gb->counter.pending = __gb_state_get(&p, 4);
+		gb->counter.frame_cycles = __gb_state_get(&p, 4);
+		return true;
+
+	case GB_STATE_MBC:
+		if(size < 10)
+			return false;
+
+		gb->selected_rom_bank = __gb_state_get(&p, 2);
+		gb->cart_ram_bank = *p++;
+		gb->enable_cart_ram = *p++;
+		gb->cart_mode_select = *p++;
+		memcpy(gb->cart_rtc, p, sizeof(gb->cart_rtc));
+		return true;
+
+	case GB_STATE_LCD:
+		if(size < 3)
+			return false;
+
+		gb->lcd_blank = *p++;
+		gb->display.window_clear = *p++;
+		gb->display.WY = *p++;
+		return true;
+
+#if PEANUT_FULL_GBC_SUPPORT
+	case GB_STATE_CGB:
+		if(size < 143)
+			return false;
+
+		gb->cgb.doubleSpeed = *p++;
+		gb->cgb.doubleSpeedPrep = *p++;
+		gb->cgb.wramBank = *p++;
+		gb->cgb.vramBank = *p++;
+		gb->cgb.BGPaletteID = *p++;
+		gb->cgb.BGPaletteInc = *p++;
+		gb->cgb.OAMPaletteID = *p++;
+		gb->cgb.OAMPaletteInc = *p++;
+		gb->cgb.dmaActive = *p++;
+		gb->cgb.dmaMode = *p++;
+		gb->cgb.dmaSize = *p++;
+		gb->cgb.dmaSource = __gb_state_get(&p, 2);
+		gb->cgb.dmaDest = __gb_state_get(&p, 2);
+		memcpy(gb->cgb.BGPalette, p, sizeof(gb->cgb.BGPalette));
+		p += sizeof(gb->cgb.BGPalette);
+		memcpy(gb->cgb.OAMPalette, p, sizeof(gb->cgb.OAMPalette));
+		return true;
+#endif
+
+	default:
+		return true;
+	}
+}
+
+void gb_state_loaded(struct gb_s *gb)
+{
+	/* Work out everything the chunks leave out from what they hold. */
+	__gb_write(gb, 0xFF47, gb->hram_io[IO_BGP]);
+	__gb_write(gb, 0xFF48, gb->hram_io[IO_OBP0]);
+	__gb_write(gb, 0xFF49, gb->hram_io[IO_OBP1]);
+
+#if PEANUT_FULL_GBC_SUPPORT
+	gb->cgb.wramBankOffset = WRAM_1_ADDR - (1 << 12);
+	if(gb->cgb.cgbMode && (gb->cgb.wramBank & 7) > 0)
+		gb->cgb.wramBankOffset = WRAM_1_ADDR -
+			((gb->cgb.wramBank & 7) << 12);
+
+	gb->cgb.vramBankOffset = VRAM_ADDR;
+	if(gb->cgb.cgbMode)
+	{
+		gb->cgb.vramBankOffset = VRAM_ADDR - (gb->cgb.vramBank << 13);
+
+		for(uint_fast8_t i = 0; i < 0x40; i++)
+			__gb_fix_palette(gb, i);
+	}
+#endif
+
+	gb->display.sprites_dirty = 1;
+	__gb_map_all(gb);
+	__gb_schedule(gb);
+#if PEANUT_GB_ICACHE_SIZE
+	__gb_icache_flush(gb);
+#endif
+}
+
+#if PEANUT_GB_ROM_BANK_CACHE
+void gb_init_rom_bank_cache(struct gb_s *gb, uint8_t *slots,
+		uint_fast8_t count,
+		void (*fill)(struct gb_s*, uint8_t *dst, uint_fast16_t bank))
+{
+	if(count > PEANUT_GB_ROM_BANK_CACHE + 1)
+		count = PEANUT_GB_ROM_BANK_CACHE + 1;
+
+	/* Bank 0 and at least one switchable bank, or no cache at all. */
+	if(slots == NULL || count < 2)
+		count = 0;
+
+	gb->rom_cache.slots = slots;
+	gb->rom_cache.count = count;
+	gb->rom_cache.fill = fill;
+	gb->rom_cache.tick = 0;
+	gb->rom_cache.mapped = -1;
+	gb->rom_cache.hits = 0;
+	gb->rom_cache.misses = 0;
+
+	for(uint_fast8_t i = 0; i <= PEANUT_GB_ROM_BANK_CACHE; i++)
+	{
+		gb->rom_cache.bank[i] = -1;
+		gb->rom_cache.last_used[i] = 0;
+	}
+
+	if(count != 0 && gb->map.rom != NULL)
+	{
+		if(fill != NULL)
+			fill(gb, slots, 0);
+		else
+			memcpy(slots, gb->map.rom, ROM_BANK_SIZE);
+
+		gb->rom_cache.bank[0] = 0;
+	}
+
+	__gb_map_all(gb);
+#if PEANUT_GB_ICACHE_SIZE
+	__gb_icache_flush(gb);
+#endif
+}
+#endif
+
 /**
  * This was taken from SameBoy, which is released under MIT Licence.
  */
@@ -4243,7 +5517,8 @@ void gb_run_frame(struct gb_s *gb);
 
 /**
  * Internal function used to step the CPU. Used mainly for testing.
- * Use gb_run_frame() instead.
+ * Use gb_run_frame() instead. With PEANUT_GB_THREADED_DISPATCH, a single call
+ * runs until the next event, HALT or interrupt.
  *
  * \param	An initialised emulator context. Must not be NULL.
  */
@@ -4277,6 +5552,57 @@ void gb_init_lcd(struct gb_s *gb,
 		void (*lcd_draw_line)(struct gb_s *gb,
 			const uint8_t *pixels,
 			const uint_fast8_t line));
+
+/**
+ * Defers drawing lines, so that a front-end can draw them on another core.
+ * Instead of drawing each line during gb_run_frame(), the emulator captures
+ * the registers the line depends on and passes them to lcd_queue_line. The
+ * front-end must copy them, as they do not outlive the call, and later pass
+ * them to gb_render_line(), in order, which calls lcd_draw_line as usual.
+ * Queued lines are drawn from VRAM and OAM at the time they are rendered, so
+ * lcd_wait_lines is called before either changes and must not return until
+ * every queued line has been rendered.
+ * gb_render_line() may run concurrently with gb_run_frame(). Nothing else may.
+ * This function can be called at any time after gb_init_lcd(), with no lines
+ * queued. A NULL lcd_queue_line draws lines directly again.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param lcd_queue_line Pointer to function that queues a line.
+ * \param lcd_wait_lines Pointer to function that waits until all queued lines
+ *		are rendered. Must not be NULL if lcd_queue_line is set.
+ */
+void gb_init_lcd_queue(struct gb_s *gb,
+		void (*lcd_queue_line)(struct gb_s *gb,
+			const struct gb_line_s *line),
+		void (*lcd_wait_lines)(struct gb_s *gb));
+
+/**
+ * Draws lines straight into a framebuffer of 144 rows of LCD_WIDTH bytes,
+ * instead of passing them to lcd_draw_line. If lcd_draw_line is set, it is
+ * still called after each line is drawn, with pixels pointing at the row.
+ * The front-end may change gb->display.framebuffer from lcd_draw_line, for
+ * example on the last line to swap buffers, and the next line goes there.
+ * In a DMG game each shade of OBJ0, OBJ1 and BG is written as the value
+ * colours gives it, indexed as LCD_PALETTE_ALL >> 4 then shade, so that no
+ * translation is needed afterwards. CGB games write their palette indices
+ * 0x00-0x3F as lcd_draw_line receives them.
+ * This function can be called at any time after gb_init_lcd().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param framebuffer First row of the framebuffer, or NULL to stop.
+ * \param colours	Pixel values, or NULL for the default layout described
+ *		in gb_init_lcd().
+ */
+void gb_init_lcd_framebuffer(struct gb_s *gb, uint8_t *framebuffer,
+		const uint8_t colours[3][4]);
+
+/**
+ * Renders a line queued through gb_init_lcd_queue().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param line	Registers of the line as passed to lcd_queue_line.
+ */
+void gb_render_line(struct gb_s *gb, const struct gb_line_s *line);
 #endif
 
 /**
@@ -4350,6 +5676,93 @@ void gb_set_rtc(struct gb_s *gb, const struct tm * const time);
 void gb_set_bootrom(struct gb_s *gb,
 	uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t));
 
+/**
+ * Give the emulator direct access to ROM and cart RAM so that CPU reads and
+ * writes to them bypass the gb_rom_read() and gb_cart_ram_*() callbacks.
+ * Must be called again after gb_init(), or after the context is overwritten,
+ * as those reset the pointers to NULL.
+ *
+ * \param gb 	An initialised emulator context. Must not be NULL.
+ * \param rom	Whole ROM image, or NULL to keep using gb_rom_read().
+ * \param cart_ram	Cart RAM of gb_get_save_size() bytes, or NULL to keep
+ *			using the cart RAM callbacks.
+ */
+void gb_init_memory_map(struct gb_s *gb, const uint8_t *rom,
+	uint8_t *cart_ram);
+
+/**
+ * Mark part of cart RAM as saved. With direct.cart_ram_track set, the next
+ * write to it goes through gb_cart_ram_write() again.
+ *
+ * \param gb 	An initialised emulator context. Must not be NULL.
+ * \param addr	Offset into the save.
+ * \param len	Number of bytes saved.
+ */
+void gb_cart_ram_clean(struct gb_s *gb, uint_fast32_t addr,
+	uint_fast32_t len);
+
+/**
+ * Pass the emulation state to "write" one chunk at a time: CPU, MBC and RTC,
+ * LCD and CGB registers packed little endian, then IO, OAM, VRAM and WRAM, the
+ * last two sized to the model. Cart RAM, the APU and pointers set by the
+ * front-end are left out. Call between frames.
+ *
+ * \param gb 	An initialised emulator context. Must not be NULL.
+ * \param write	Called with each chunk id and its data, which is only valid
+ *			during the call. Returns false to stop.
+ * \param ctx	Passed to write.
+ * \returns	false if write returned false.
+ */
+bool gb_state_save(struct gb_s *gb,
+	bool (*write)(void *ctx, uint32_t id, const void *data,
+		uint_fast32_t size),
+	void *ctx);
+
+/**
+ * Where memory chunk "id" is read straight into when loading a state, and its
+ * size for the current model.
+ *
+ * \returns	NULL if "id" is not a memory chunk.
+ */
+uint8_t *gb_state_memory(struct gb_s *gb, const uint32_t id,
+	uint_fast32_t *size);
+
+/**
+ * Load a packed chunk saved by gb_state_save(). Chunks left out of the state
+ * keep their values, so reset the context first. Call gb_state_loaded() once
+ * every chunk is loaded.
+ *
+ * \returns	false if the chunk is too short for its id, and was ignored. Unknown
+ *		chunks, from a later version, are ignored too but return true.
+ */
+bool gb_state_load(struct gb_s *gb, const uint32_t id, const uint8_t *data,
+	const uint_fast32_t size);
+
+/**
+ * Rebuild the palettes, memory map and event schedule from a loaded state.
+ */
+void gb_state_loaded(struct gb_s *gb);
+
+#if PEANUT_GB_ROM_BANK_CACHE
+/**
+ * Cache ROM banks in fast RAM in front of the ROM given to
+ * gb_init_memory_map(). Bank 0 is copied to the first slot and stays there;
+ * the remaining slots hold the most recently selected switchable banks.
+ * Call after gb_init_memory_map(), and again after gb_init() or after the
+ * context is overwritten.
+ *
+ * \param gb 	An initialised emulator context. Must not be NULL.
+ * \param slots	count * ROM_BANK_SIZE bytes of RAM, or NULL to disable.
+ * \param count	Number of slots including the one for bank 0, at most
+ *		PEANUT_GB_ROM_BANK_CACHE + 1.
+ * \param fill	Function that copies a whole ROM bank into a slot, for
+ *		example by DMA. NULL copies from the memory mapped ROM.
+ */
+void gb_init_rom_bank_cache(struct gb_s *gb, uint8_t *slots,
+	uint_fast8_t count,
+	void (*fill)(struct gb_s*, uint8_t *dst, uint_fast16_t bank));
+#endif
+
 /* Undefine CPU Flag helper functions. */
 #undef PEANUT_GB_CPUFLAG_MASK_CARRY
 #undef PEANUT_GB_CPUFLAG_MASK_HALFC
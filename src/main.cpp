@@ -22,12 +22,14 @@
 
 
 /* C Headers */
+#include <cstddef>
 #include <cstdio>
 #include <cstring>
 
 /* RP2040 Headers */
 #include "pico/runtime.h"
 #include <hardware/sync.h>
+#include <hardware/dma.h>
 #include <hardware/flash.h>
 #include <hardware/timer.h>
 #include <hardware/vreg.h>
@@ -49,6 +51,7 @@
 #include "graphics.h"
 #include "f_util.h"
 #include "ff.h"
+#include "diskio.h"
 
 
 #include "nespad.h"
@@ -64,18 +67,101 @@
 #define HOME_DIR (char*)"\\GB"
 extern char __flash_binary_end;
 #define FLASH_TARGET_OFFSET (((((uintptr_t)&__flash_binary_end - XIP_BASE) / FLASH_SECTOR_SIZE) + 4) * FLASH_SECTOR_SIZE)
-static const uint8_t* rom = (const uint8_t *)(XIP_BASE + FLASH_TARGET_OFFSET);
+static const uint8_t* rom_flash = (const uint8_t *)(XIP_BASE + FLASH_TARGET_OFFSET);
+static const uint8_t* rom = rom_flash;
 
-static uint8_t ram[32768];
+/**
+ * Flash above the firmware keeps several ROMs, so picking a game that is already there does not
+ * program it again. The area is split into ROM_SLOT_UNIT sized units and each stored ROM takes
+ * consecutive units. A directory in the last flash sector records where each ROM is. The sector
+ * holds several copies of it written one after another, so it is only erased when they run out.
+ */
+#define ROM_SLOT_UNIT (256 << 10)
+#define ROM_SLOTS 16
+#define ROM_SLOT_MAX_UNITS (PICO_FLASH_SIZE_BYTES / ROM_SLOT_UNIT)
+#define ROM_DIR_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+/* Changed along with rom_slot_t, so that a directory in the old layout reads as empty. */
+#define ROM_DIR_MAGIC 0x324D4F52
+#define ROM_DIR_STRIDE ((sizeof(rom_directory_t) + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1))
+#define ROM_DIR_COPIES (FLASH_SECTOR_SIZE / ROM_DIR_STRIDE)
+/* SD reads per flash programming round, whole 512 byte sectors read straight into the buffer. */
+#define ROM_LOAD_CHUNK (16 << 10)
+/* Everything up to the end of the cartridge header. */
+#define ROM_HEADER_SIZE 0x150
+/* Path of the ROM run last, which may have run from SRAM rather than flash. */
+#define PREVIOUS_ROM_FILE "/GB/previous.txt"
+
+typedef struct {
+    uint32_t crc; // of the whole file, taken while it is programmed
+    uint32_t size;
+    uint16_t global_checksum;
+    uint8_t header_checksum;
+    uint8_t first_unit;
+    uint16_t fdate;
+    uint16_t ftime;
+    uint32_t last_used; // 0 if the slot is empty
+} rom_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    rom_slot_t slots[ROM_SLOTS];
+    uint16_t erase_count[ROM_SLOT_MAX_UNITS];
+    uint32_t crc;
+} rom_directory_t;
+
+static rom_directory_t rom_directory;
+static int rom_directory_copy = -1;
+
+/**
+ * SRAM shared by cart RAM and ROM. The save, gb_get_save_size() bytes, sits at the end. The rest
+ * holds the whole ROM when it fits, so small games are never programmed into flash. Otherwise it
+ * caches ROM banks copied from flash, so that games hopping between banks do not thrash the XIP
+ * cache; the first slot always holds bank 0. Games with small saves get more banks cached.
+ */
+#if PEANUT_GB_ROM_BANK_CACHE
+static uint8_t __aligned(4) cart_arena[(PEANUT_GB_ROM_BANK_CACHE + 1) * ROM_BANK_SIZE];
+#else
+static uint8_t __aligned(4) cart_arena[32768];
+#endif
+static uint8_t* cart_ram = cart_arena;
+
+/**
+ * Battery saves go to <ROMNAME>.sav, a contiguous file whose sectors are written straight to the
+ * card. The first write to each 512 byte sector marks it dirty, and the dirty ones are written back
+ * once the game has not dirtied another for SAVE_FLUSH_QUIET_US, one sector per frame.
+ */
+#define SAVE_SECTOR_SIZE 512
+#define SAVE_FLUSH_QUIET_US 2000000
+static uint32_t save_dirty[sizeof(cart_arena) / SAVE_SECTOR_SIZE / 32];
+static uint64_t save_dirty_us = 0;
+static LBA_t save_lba = 0;
+static uint32_t save_sectors = 0;
 
 semaphore vga_start_semaphore;
 
 gb_s gb;
 
-uint8_t SCREEN[LCD_HEIGHT][LCD_WIDTH];
+/* Lines queued by core0 for core1 to draw, core0 only moves the head and core1 the tail. */
+#define LINE_RING_SIZE 16
+static gb_line_s line_ring[LINE_RING_SIZE];
+static volatile uint32_t line_ring_head = 0, line_ring_tail = 0;
+
+/* Lines are drawn into one framebuffer while the display shows another. With three, the display has a
+ * whole frame to pick up the newest one before the buffer it showed is drawn over. */
+#if PICO_RP2350
+#define FRAMEBUFFERS 3
+#else
+#define FRAMEBUFFERS 2
+#endif
+uint8_t SCREEN[FRAMEBUFFERS][LCD_HEIGHT][LCD_WIDTH];
+static uint8_t draw_buffer_index = 1;
 static FATFS fs;
 
 uint16_t stream[AUDIO_BUFFER_SIZE_BYTES];
+static i2s_config_t i2s_config;
+/* Frames core1 may have left to synthesise before core0 waits for it. */
+#define AUDIO_FRAMES_AHEAD 2
 
 #if TFT
 #define RGB565_TO_RGB888(rgb565) (rgb565)
@@ -83,8 +169,8 @@ uint16_t stream[AUDIO_BUFFER_SIZE_BYTES];
 #define RGB565_TO_RGB888(rgb565) ((((rgb565) & 0xF800) << 8) | (((rgb565) & 0x07E0) << 5) | (((rgb565) & 0x001F) << 3))
 #endif
 
-typedef uint32_t palette222_t[3][4];
-static palette222_t palette;
+/* Graphics palette entry of each DMG shade, for OBJ0, OBJ1 and BG. */
+static uint8_t palette[3][4];
 static palette_t palette16; // Colour palette
 static uint8_t manual_palette_selected = 0; // auto
 
@@ -100,6 +186,33 @@ struct input_bits_t {
 };
 
 static uint8_t swap_ab = 0;
+static uint8_t idle_skip = 1;
+
+/* One Game Boy frame is 70224 cycles at 4.194304 MHz. */
+#define FRAME_BUDGET_US 16742
+/* Auto mode never skips more frames in a row than this. */
+#define FRAME_SKIP_AUTO_MAX 3
+/* Palette entries above the 64 colour CGB range, for the skip counter and messages. */
+#define OSD_COLOR_FG 0x40
+#define OSD_COLOR_BG 0x41
+
+enum frame_skip_mode_t : uint8_t {
+    FRAME_SKIP_AUTO,
+    FRAME_SKIP_OFF,
+    FRAME_SKIP_FIXED, // and above, skip (mode - FRAME_SKIP_OFF) frames after each drawn one
+};
+
+static uint8_t frame_skip_mode = FRAME_SKIP_AUTO;
+static uint8_t skip_counter = 0;
+/* Frames drawn and skipped over the last 60, and the percentage of their time the CPU spent skipped
+ * over in HALT or idle loops, written by core0 and shown by core1. */
+static volatile uint8_t osd_drawn = 0, osd_skipped = 0, osd_idle = 0;
+/* Message shown under the game for OSD_MESSAGE_FRAMES drawn frames. Core0 writes the text into the
+ * buffer after the current one and then bumps the sequence number. Core1 starts counting down when it
+ * sees the number change, so each side only writes its own variables. */
+#define OSD_MESSAGE_FRAMES 120
+static char osd_message[2][LCD_WIDTH / 6 + 1];
+static volatile uint32_t osd_message_sequence = 0;
 static input_bits_t keyboard = { false, false, false, false, false, false, false, false }; //Keyboard
 static input_bits_t gamepad_bits = { false, false, false, false, false, false, false, false }; //Joypad
 //-----------------------------------------------------------------------------
@@ -137,6 +250,7 @@ static bool isInReport(hid_keyboard_report_t const* report, const unsigned char
 static volatile bool altPressed = false;
 static volatile bool ctrlPressed = false;
 static volatile uint8_t fxPressedV = 0;
+static volatile bool rewindPressed = false;
 
 void
 __not_in_flash_func(process_kbd_report)(hid_keyboard_report_t const* report, hid_keyboard_report_t const* prev_report) {
@@ -162,6 +276,7 @@ __not_in_flash_func(process_kbd_report)(hid_keyboard_report_t const* report, hid
 
     altPressed = isInReport(report, HID_KEY_ALT_LEFT) || isInReport(report, HID_KEY_ALT_RIGHT);
     ctrlPressed = isInReport(report, HID_KEY_CONTROL_LEFT) || isInReport(report, HID_KEY_CONTROL_RIGHT);
+    rewindPressed = isInReport(report, HID_KEY_R);
     
     if (altPressed && ctrlPressed && isInReport(report, HID_KEY_DELETE)) {
         watchdog_enable(10, true);
@@ -196,18 +311,74 @@ uint8_t __not_in_flash_func(gb_rom_read)(struct gb_s* gb, const uint_fast32_t ad
     return rom[addr];
 }
 
+#if PEANUT_GB_ROM_BANK_CACHE
+static int rom_bank_dma = -1;
+static uint64_t rom_bank_fill_us = 0;
+
+/**
+ * Copies a ROM bank from flash into a cache slot by DMA.
+ */
+void __not_in_flash_func(gb_rom_bank_fill)(struct gb_s* gb, uint8_t* dst, const uint_fast16_t bank) {
+    const uint64_t start = time_us_64();
+    /* Read through the non-allocating alias so the copy does not evict code from the XIP cache. */
+    const auto* src = (const uint8_t *)((uintptr_t)rom_flash + bank * ROM_BANK_SIZE - XIP_BASE + XIP_NOCACHE_NOALLOC_BASE);
+
+    if (rom_bank_dma < 0)
+        rom_bank_dma = dma_claim_unused_channel(true);
+
+    dma_channel_config config = dma_channel_get_default_config(rom_bank_dma);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, true);
+    dma_channel_configure(rom_bank_dma, &config, dst, src, ROM_BANK_SIZE / 4, true);
+    dma_channel_wait_for_finish_blocking(rom_bank_dma);
+
+    rom_bank_fill_us += time_us_64() - start;
+}
+#endif
+
+/**
+ * Lets the core read ROM and cart RAM directly, caching ROM banks in the arena
+ * the save leaves free when the ROM is in flash. The save must fit the arena.
+ */
+static void init_memory_map() {
+    const uint32_t save_size = gb_get_save_size(&gb);
+    cart_ram = cart_arena + sizeof(cart_arena) - save_size;
+    gb_init_memory_map(&gb, rom, cart_ram);
+#if PEANUT_GB_ROM_BANK_CACHE
+    if (rom == rom_flash)
+        gb_init_rom_bank_cache(&gb, cart_arena, (sizeof(cart_arena) - save_size) / ROM_BANK_SIZE, &gb_rom_bank_fill);
+#endif
+}
+
+/**
+ * Cart RAM a ROM header asks for, the same as gb_get_save_size() once the game is initialised.
+ */
+static uint32_t rom_header_save_size(const uint8_t* header) {
+    static const uint32_t ram_sizes[] = { 0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+    /* MBC2 always has 512 half-bytes of cart RAM. */
+    if (header[0x147] == 0x05 || header[0x147] == 0x06)
+        return 0x200;
+    return header[0x149] < count_of(ram_sizes) ? ram_sizes[header[0x149]] : 0;
+}
+
 /**
- * Returns a byte from the cartridge RAM at the given address.
+ * Returns a byte from the cartridge RAM at the given address. The core wraps it into the save.
  */
 uint8_t __not_in_flash_func(gb_cart_ram_read)(struct gb_s* gb, const uint_fast32_t addr) {
-    return ram[addr];
+    return cart_ram[addr];
 }
 
 /**
- * Writes a given byte to the cartridge RAM at the given address.
+ * Writes a given byte to the cartridge RAM at the given address. The core wraps it into the save.
  */
 void __not_in_flash_func(gb_cart_ram_write)(struct gb_s* gb, const uint_fast32_t addr, const uint8_t val) {
-    ram[addr] = val;
+    cart_ram[addr] = val;
+    const uint32_t sector = addr / SAVE_SECTOR_SIZE;
+    if (!(save_dirty[sector / 32] & 1u << sector % 32)) {
+        save_dirty[sector / 32] |= 1u << sector % 32;
+        save_dirty_us = time_us_64();
+    }
 }
 
 /**
@@ -223,12 +394,35 @@ void gb_error(struct gb_s* gb, const enum gb_error_e gb_err, const uint16_t addr
     printf("Error %d occurred: %s at %04X\n.\n", gb_err, gb_err_str[gb_err], addr);
 }
 
+/**
+ * Hands a line over to core1, waiting if it is a full ring behind.
+ */
+void __time_critical_func(lcd_queue_line)(struct gb_s* gb, const struct gb_line_s* line) {
+    const uint32_t head = line_ring_head;
+
+    while (head - line_ring_tail == LINE_RING_SIZE)
+        tight_loop_contents();
+
+    line_ring[head % LINE_RING_SIZE] = *line;
+    __dmb();
+    line_ring_head = head + 1;
+}
+
+/**
+ * Waits for core1 to draw every queued line, before VRAM or OAM change under it.
+ */
+void __time_critical_func(lcd_wait_lines)(struct gb_s* gb) {
+    while (line_ring_tail != line_ring_head)
+        tight_loop_contents();
+    __dmb();
+}
+
 /* Renderer loop on Pico's second core */
 void __time_critical_func(render_core)() {
     multicore_lockout_victim_init();
     graphics_init();
 
-    const auto buffer = (uint8_t *)SCREEN;
+    const auto buffer = (uint8_t *)SCREEN[0];
     graphics_set_buffer(buffer, LCD_WIDTH, LCD_HEIGHT);
     graphics_set_textbuffer(buffer);
     graphics_set_bgcolor(0x000000);
@@ -254,6 +448,18 @@ void __time_critical_func(render_core)() {
 #endif
     uint64_t last_input_tick = tick;
     while (true) {
+        while (line_ring_tail != line_ring_head) {
+            __dmb();
+            gb_render_line(&gb, &line_ring[line_ring_tail % LINE_RING_SIZE]);
+            __dmb();
+            line_ring_tail = line_ring_tail + 1;
+        }
+        /* Sound is synthesised here from the register writes core0 queues, as they come. */
+        audio_synthesise();
+        while (audio_frames_pending()) {
+            audio_callback(NULL, reinterpret_cast<int16_t *>(stream), AUDIO_BUFFER_SIZE_BYTES);
+            i2s_dma_resample(&i2s_config, reinterpret_cast<const int16_t *>(stream), AUDIO_SAMPLES);
+        }
 #ifdef TFT
         if (tick >= last_renderer_tick + frame_tick) {
             refresh_lcd();
@@ -278,80 +484,176 @@ void __time_critical_func(render_core)() {
 
 
 /**
- * Draws scanline into framebuffer.
+ * Prints text in the 6x8 font with its top left corner at x, y of a finished frame.
  */
-void __always_inline lcd_draw_line(struct gb_s* gb, const uint8_t pixels[160], const uint_fast8_t y) {
-    // memcpy((uint32_t *)SCREEN[y], (uint32_t *)pixels, 160);
-    //         screen[y][x] = palette[(pixels[x] & LCD_PALETTE_ALL) >> 4][pixels[x] & 3];
-    if (gb->cgb.cgbMode) {
-        memcpy((uint32_t *)SCREEN[y], (uint32_t *)pixels, 160);
+static void __time_critical_func(draw_osd_text)(uint8_t (*const screen)[LCD_WIDTH], const char* text,
+                                                const size_t length, const int x, const int y) {
+    for (int row = 0; row < 8; row++) {
+        uint8_t* output = &screen[y + row][x];
+        for (size_t i = 0; i < length; i++) {
+            uint8_t glyph_row = font_6x8[text[i] * 8 + row];
+            for (int bit = 6; bit--;) {
+                *output++ = glyph_row & 1 ? OSD_COLOR_FG : OSD_COLOR_BG;
+                glyph_row >>= 1;
+            }
+        }
     }
-    else {
-        for (unsigned int x = 0; x < LCD_WIDTH; x++)
-            SCREEN[y][x] = palette[(pixels[x] & LCD_PALETTE_ALL) >> 4][pixels[x] & 3];
+}
+
+/**
+ * Prints the drawn and skipped frame counts and the idle percentage in the top left corner of a
+ * finished frame.
+ */
+static void __time_critical_func(draw_skip_counter)(uint8_t (*const screen)[LCD_WIDTH]) {
+    const uint8_t drawn = osd_drawn, skipped = osd_skipped, idle = osd_idle;
+    const char text[] = {
+        (char)('0' + drawn / 10), (char)('0' + drawn % 10), '/',
+        (char)('0' + skipped / 10), (char)('0' + skipped % 10), ' ',
+        (char)('0' + idle / 10), (char)('0' + idle % 10), '%'
+    };
+
+    draw_osd_text(screen, text, sizeof(text), 1, 1);
+}
+
+/**
+ * Shows a message in the bottom left corner for the next OSD_MESSAGE_FRAMES drawn frames.
+ */
+static void show_osd_message(const char* format, const int slot) {
+    const uint32_t sequence = osd_message_sequence + 1;
+    snprintf(osd_message[sequence & 1], sizeof(osd_message[0]), format, slot);
+    __dmb();
+    osd_message_sequence = sequence;
+}
+
+/**
+ * Called after each line is drawn into the framebuffer. Hands a finished frame to the display.
+ */
+void __always_inline lcd_draw_line(struct gb_s* gb, const uint8_t pixels[160], const uint_fast8_t y) {
+    /* Frame complete, the display switches to it at its next vertical blank. */
+    if (y == LCD_HEIGHT - 1) {
+        uint8_t (*const screen)[LCD_WIDTH] = SCREEN[draw_buffer_index];
+        if (skip_counter)
+            draw_skip_counter(screen);
+        static uint32_t osd_message_seen = 0;
+        static uint8_t osd_message_frames = 0;
+        const uint32_t sequence = osd_message_sequence;
+        if (sequence != osd_message_seen) {
+            __dmb();
+            osd_message_seen = sequence;
+            osd_message_frames = OSD_MESSAGE_FRAMES;
+        }
+        if (osd_message_frames) {
+            const char* const message = osd_message[sequence & 1];
+            draw_osd_text(screen, message, strlen(message), 1, LCD_HEIGHT - 9);
+            osd_message_frames--;
+        }
+        graphics_set_buffer((uint8_t *)screen, LCD_WIDTH, LCD_HEIGHT);
+        draw_buffer_index = (draw_buffer_index + 1) % FRAMEBUFFERS;
+        gb->display.framebuffer = &SCREEN[draw_buffer_index][0][0];
     }
 }
 
 /**
- * Load a save file from the SD card
+ * Load the save file from the SD card, and make sure <ROMNAME>.sav is a contiguous file of the save
+ * size so it can be written back by sector. A save from before .sav files is taken over. A .sav of
+ * another size is kept as it is, and written back whole.
  */
 void read_cart_ram_file(struct gb_s* gb) {
     char filename[24];
+    char pathname[40];
     uint_fast32_t save_size;
     UINT br;
 
     gb_get_rom_name(gb, filename);
+    sprintf(pathname, "%s\\%s.sav", HOME_DIR, filename);
     save_size = gb_get_save_size(gb);
-    if (save_size > 0) {
-        FIL fil;
-        FRESULT fr = f_open(&fil, filename, FA_READ);
-        if (fr == FR_OK) {
-            f_read(&fil, ram, f_size(&fil), &br);
-        }
-        else {
-            printf("E f_open(%s) error: %s (%d)\n", filename, FRESULT_str(fr), fr);
-        }
+    memset(save_dirty, 0, sizeof(save_dirty));
+    save_dirty_us = 0;
+    save_sectors = 0;
+    if (save_size == 0)
+        return;
+
+    FIL fil;
+    DWORD linkmap[4] = { count_of(linkmap) };
+    bool contiguous = false, loaded = false;
+    memset(cart_ram, 0, save_size);
+    FRESULT fr = f_open(&fil, pathname, FA_READ | FA_WRITE);
+    const bool exists = fr == FR_OK;
+    if (exists) {
+        /* A save of another size, such as one with another emulator's RTC footer, loads as far as it
+         * goes and is only ever written whole, so what follows the save stays as it is. */
+        const FSIZE_t file_size = f_size(&fil);
+        const UINT length = file_size < save_size ? file_size : save_size;
+        loaded = FR_OK == f_read(&fil, cart_ram, length, &br) && br == length && file_size == save_size;
+        /* A link map this size only fits a file in one fragment. */
+        fil.cltbl = linkmap;
+        contiguous = loaded && FR_OK == f_lseek(&fil, CREATE_LINKMAP);
+        f_close(&fil);
+    }
+    else if (FR_OK == f_open(&fil, filename, FA_READ)) {
+        f_read(&fil, cart_ram, save_size, &br);
+        f_close(&fil);
+    }
 
-        fr = f_close(&fil);
-        if (fr != FR_OK) {
-            printf("E f_close error: %s (%d)\n", FRESULT_str(fr), fr);
+    /* Created, or made contiguous, only with the save already in cart RAM. */
+    if (!contiguous && (!exists || loaded)) {
+        UINT bw;
+        fr = f_open(&fil, pathname, FA_CREATE_ALWAYS | FA_READ | FA_WRITE);
+        if (fr == FR_OK) {
+            /* Without a contiguous run free, the file is still written, just not by sector. */
+            contiguous = FR_OK == f_expand(&fil, save_size, 1);
+            fr = f_write(&fil, cart_ram, save_size, &bw);
+            fil.cltbl = linkmap;
+            contiguous = contiguous && fr == FR_OK && bw == save_size && FR_OK == f_lseek(&fil, CREATE_LINKMAP);
+            f_close(&fil);
         }
     }
-    printf("I read_cart_ram_file(%s) COMPLETE (%u bytes)\n", filename, save_size);
+
+    save_sectors = save_size / SAVE_SECTOR_SIZE;
+    save_lba = contiguous ? fs.database + (LBA_t)fs.csize * (linkmap[2] - 2) : 0;
+    gb->direct.cart_ram_track = 1;
+    gb_cart_ram_clean(gb, 0, save_size);
+    printf("I read_cart_ram_file(%s) COMPLETE (%u bytes, %s)\n", pathname, save_size,
+           contiguous ? "by sector" : FRESULT_str(fr));
 }
 
 /**
- * Write a save file to the SD card
+ * Write dirty sectors of the save to the SD card, all of them or just the first so a frame is never
+ * held up by more than one sector write. Returns false when there was nothing to write.
  */
-void write_cart_ram_file(struct gb_s* gb) {
-    char filename[16];
-    uint_fast32_t save_size;
-    UINT bw;
+static bool write_cart_ram_file(struct gb_s* gb, const bool all) {
+    /* A fragmented file is only written whole, and not in the middle of a game. */
+    if (!save_lba && !all)
+        return false;
 
-    gb_get_rom_name(gb, filename);
-    save_size = gb_get_save_size(gb);
-    if (save_size > 0) {
-        FRESULT fr = f_mount(&fs, "", 1);
-        if (FR_OK != fr) {
-            printf("E f_mount error: %s (%d)\n", FRESULT_str(fr), fr);
-            return;
+    bool written = false;
+    for (uint32_t sector = 0; sector < save_sectors; sector++) {
+        if (!(save_dirty[sector / 32] & 1u << sector % 32))
+            continue;
+
+        save_dirty[sector / 32] &= ~(1u << sector % 32);
+        gb_cart_ram_clean(gb, sector * SAVE_SECTOR_SIZE, SAVE_SECTOR_SIZE);
+        written = true;
+        if (save_lba) {
+            if (disk_write(fs.pdrv, cart_ram + sector * SAVE_SECTOR_SIZE, save_lba + sector, 1) != RES_OK)
+                printf("E write_cart_ram_file sector %lu failed\n", (unsigned long)sector);
+            if (!all)
+                break;
         }
+    }
 
+    if (written && !save_lba) {
+        char filename[24];
+        char pathname[40];
         FIL fil;
-        fr = f_open(&fil, filename, FA_CREATE_ALWAYS | FA_WRITE);
-        if (fr == FR_OK) {
-            f_write(&fil, ram, save_size, &bw);
-        }
-        else {
-            printf("E f_open(%s) error: %s (%d)\n", filename, FRESULT_str(fr), fr);
-        }
-
-        fr = f_close(&fil);
-        if (fr != FR_OK) {
-            printf("E f_close error: %s (%d)\n", FRESULT_str(fr), fr);
-        }
+        UINT bw;
+        gb_get_rom_name(gb, filename);
+        sprintf(pathname, "%s\\%s.sav", HOME_DIR, filename);
+        if (FR_OK == f_open(&fil, pathname, FA_OPEN_EXISTING | FA_WRITE))
+            f_write(&fil, cart_ram, save_sectors * SAVE_SECTOR_SIZE, &bw);
+        f_close(&fil);
     }
-    printf("I write_cart_ram_file(%s) COMPLETE (%u bytes)\n", filename, save_size);
+    return written;
 }
 
 
@@ -363,7 +665,17 @@ typedef struct __attribute__((__packed__)) {
 } file_item_t;
 
 constexpr int max_files = 500;
+#if REWIND_BUFFER_SIZE
+/* The file list is done with once a game starts, so the rewind buffer shares its memory. */
+static union {
+    file_item_t items[max_files];
+    uint32_t rewind[REWIND_BUFFER_SIZE / 4];
+} browser_memory;
+static file_item_t* const fileItems = browser_memory.items;
+static uint32_t* const rewind_buffer = browser_memory.rewind;
+#else
 static file_item_t fileItems[max_files];
+#endif
 
 int compareFileItems(const void* a, const void* b) {
     const auto* itemA = (file_item_t *)a;
@@ -398,6 +710,148 @@ bool isExecutable(const char pathname[255],const char *extensions) {
     return false;
 }
 
+static constexpr struct crc32_table_t {
+    uint32_t entries[256];
+
+    constexpr crc32_table_t() : entries() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = crc >> 1 ^ (0xEDB88320 & -(crc & 1));
+            entries[i] = crc;
+        }
+    }
+} crc32_table;
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t length) {
+    while (length--)
+        crc = crc >> 8 ^ crc32_table.entries[(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+static inline uint32_t rom_slot_units() {
+    return (ROM_DIR_OFFSET - FLASH_TARGET_OFFSET) / ROM_SLOT_UNIT;
+}
+
+static inline const uint8_t* rom_slot_address(const rom_slot_t* slot) {
+    return (const uint8_t *)(XIP_BASE + FLASH_TARGET_OFFSET + slot->first_unit * ROM_SLOT_UNIT);
+}
+
+/**
+ * Reads the newest intact copy of the ROM slot directory, and points rom at the ROM used last.
+ */
+static void rom_directory_read() {
+    memset(&rom_directory, 0, sizeof(rom_directory));
+    rom_directory_copy = -1;
+
+    for (int i = 0; i < ROM_DIR_COPIES; i++) {
+        const auto* copy = (const rom_directory_t *)(XIP_BASE + ROM_DIR_OFFSET + i * ROM_DIR_STRIDE);
+
+        if (copy->magic != ROM_DIR_MAGIC)
+            break;
+
+        rom_directory_copy = i;
+        /* Skip a copy torn by a power loss. */
+        if (copy->crc == crc32_update(0, (const uint8_t *)copy, offsetof(rom_directory_t, crc)))
+            rom_directory = *copy;
+    }
+
+    /* Nothing valid, the sector may hold anything, so erase it on the first write. */
+    if (rom_directory.magic != ROM_DIR_MAGIC)
+        rom_directory_copy = ROM_DIR_COPIES - 1;
+
+    const rom_slot_t* latest = nullptr;
+    for (const auto& slot: rom_directory.slots)
+        if (slot.last_used && (!latest || slot.last_used > latest->last_used))
+            latest = &slot;
+
+    if (latest)
+        rom = rom_flash = rom_slot_address(latest);
+}
+
+/**
+ * Appends the directory to the flash sector. Core1 must be locked out.
+ */
+static void __not_in_flash_func(rom_directory_write)() {
+    uint8_t buffer[ROM_DIR_STRIDE];
+    int copy = rom_directory_copy + 1;
+
+    rom_directory.magic = ROM_DIR_MAGIC;
+    rom_directory.crc = crc32_update(0, (const uint8_t *)&rom_directory, offsetof(rom_directory_t, crc));
+    memset(buffer, 0xFF, sizeof(buffer));
+    memcpy(buffer, &rom_directory, sizeof(rom_directory));
+
+    const uint32_t ints = save_and_disable_interrupts();
+    if (copy >= ROM_DIR_COPIES) {
+        flash_range_erase(ROM_DIR_OFFSET, FLASH_SECTOR_SIZE);
+        copy = 0;
+    }
+    flash_range_program(ROM_DIR_OFFSET + copy * ROM_DIR_STRIDE, buffer, ROM_DIR_STRIDE);
+    restore_interrupts(ints);
+
+    rom_directory_copy = copy;
+}
+
+/**
+ * Identifies a ROM file by its size, modification time and header checksums, all of which come
+ * without reading past the header, so that a ROM already in flash starts at once. The header
+ * global checksum is not enough on its own: patched ROMs and hacks often leave it alone, but
+ * patching one changes its modification time.
+ */
+static void rom_slot_key(const FILINFO* fileinfo, const uint8_t header[ROM_HEADER_SIZE], rom_slot_t* key) {
+    memset(key, 0, sizeof(rom_slot_t));
+    key->size = fileinfo->fsize;
+    key->fdate = fileinfo->fdate;
+    key->ftime = fileinfo->ftime;
+    /* The header checksum is at 0x14D, the big endian global checksum at 0x14E. */
+    key->header_checksum = header[0x14D];
+    key->global_checksum = header[0x14E] << 8 | header[0x14F];
+}
+
+static inline bool rom_slot_same(const rom_slot_t* slot, const rom_slot_t* key) {
+    return slot->size == key->size && slot->fdate == key->fdate && slot->ftime == key->ftime &&
+           slot->header_checksum == key->header_checksum && slot->global_checksum == key->global_checksum;
+}
+
+/**
+ * Chooses where a new ROM of the given number of units goes. Prefers the place whose most recently
+ * used ROM is the oldest, then the one whose units were erased the fewest times.
+ */
+static int rom_slot_place(const uint32_t units) {
+    int best = -1;
+    uint32_t best_used = UINT32_MAX, best_wear = UINT32_MAX;
+
+    for (uint32_t first = 0; first + units <= rom_slot_units(); first++) {
+        uint32_t used = 0, wear = 0;
+
+        for (const auto& slot: rom_directory.slots) {
+            const uint32_t slot_units = (slot.size + ROM_SLOT_UNIT - 1) / ROM_SLOT_UNIT;
+            if (slot.last_used && slot.first_unit < first + units && first < slot.first_unit + slot_units)
+                used = used > slot.last_used ? used : slot.last_used;
+        }
+        for (uint32_t unit = first; unit < first + units; unit++)
+            wear += rom_directory.erase_count[unit];
+
+        if (used < best_used || (used == best_used && wear < best_wear)) {
+            best = first;
+            best_used = used;
+            best_wear = wear;
+        }
+    }
+
+    return best;
+}
+
+static void draw_progress(const int x, const int y, const int width, const uint32_t done, const uint32_t total) {
+    char bar[TEXTMODE_COLS + 1];
+    const int filled = total ? (uint64_t)done * width / total : width;
+
+    memset(bar, '\xDB', filled);
+    memset(bar + filled, '\xB1', width - filled);
+    bar[width] = '\0';
+    draw_text(bar, x, y, 10, 1);
+}
+
 bool __not_in_flash_func(filebrowser_loadfile)(const char pathname[256]) {
     UINT bytes_read = 0;
     FIL file;
@@ -410,7 +864,8 @@ bool __not_in_flash_func(filebrowser_loadfile)(const char pathname[256]) {
     FILINFO fileinfo;
     f_stat(pathname, &fileinfo);
 
-    if (16384 - 64 << 10 < fileinfo.fsize) {
+    const uint32_t units = (fileinfo.fsize + ROM_SLOT_UNIT - 1) / ROM_SLOT_UNIT;
+    if (units > rom_slot_units()) {
         draw_text("ERROR: ROM too large! Canceled!!", window_x + 1, window_y + 2, 13, 1);
         sleep_ms(5000);
         return false;
@@ -418,41 +873,168 @@ bool __not_in_flash_func(filebrowser_loadfile)(const char pathname[256]) {
 
 
     draw_text("Loading...", window_x + 1, window_y + 2, 10, 1);
-    sleep_ms(500);
+    const uint64_t load_start = time_us_64();
+
+#if PEANUT_GB_ROM_BANK_CACHE
+    /* Small ROMs run from SRAM, which is faster to load and does not wear the flash. */
+    if (fileinfo.fsize <= sizeof(cart_arena)) {
+        bool loaded = FR_OK == f_open(&file, pathname, FA_READ) &&
+                      FR_OK == f_read(&file, cart_arena, fileinfo.fsize, &bytes_read) &&
+                      bytes_read == fileinfo.fsize &&
+                      fileinfo.fsize + rom_header_save_size(cart_arena) <= sizeof(cart_arena);
+        f_close(&file);
+
+        if (loaded) {
+            rom = cart_arena;
+            printf("ROM %s loaded to SRAM in %llu ms\n", pathname, (time_us_64() - load_start) / 1000);
+            return true;
+        }
+    }
+#endif
 
+    uint8_t header[ROM_HEADER_SIZE];
+    if (FR_OK != f_open(&file, pathname, FA_READ) ||
+        FR_OK != f_read(&file, header, sizeof(header), &bytes_read) || bytes_read != sizeof(header) ||
+        FR_OK != f_lseek(&file, 0)) {
+        f_close(&file);
+        draw_text("ERROR: Can't read ROM! Canceled!!", window_x + 1, window_y + 2, 13, 1);
+        sleep_ms(5000);
+        return false;
+    }
 
-    multicore_lockout_start_blocking();
-    auto flash_target_offset = FLASH_TARGET_OFFSET;
-    const uint32_t ints = save_and_disable_interrupts();
-    flash_range_erase(flash_target_offset, fileinfo.fsize);
-    restore_interrupts(ints);
+    /* Not worth programming a game whose save does not fit the cart RAM arena. */
+    if (rom_header_save_size(header) > sizeof(cart_arena)) {
+        f_close(&file);
+        draw_text("ERROR: Save RAM too large! Canceled!!", window_x + 1, window_y + 2, 13, 1);
+        sleep_ms(5000);
+        return false;
+    }
 
-    if (FR_OK == f_open(&file, pathname, FA_READ)) {
-        uint8_t buffer[FLASH_PAGE_SIZE];
+    rom_slot_t key;
+    rom_slot_key(&fileinfo, header, &key);
 
-        do {
-            f_read(&file, &buffer, FLASH_PAGE_SIZE, &bytes_read);
+    multicore_lockout_start_blocking();
+
+    /* Already in flash, only record that it was used. */
+    for (auto& slot: rom_directory.slots) {
+        if (slot.last_used && rom_slot_same(&slot, &key)) {
+            slot.last_used = ++rom_directory.sequence;
+            rom_directory_write();
+            multicore_lockout_end_blocking();
+            f_close(&file);
 
-            if (bytes_read) {
-                const uint32_t ints = save_and_disable_interrupts();
-                flash_range_program(flash_target_offset, buffer, FLASH_PAGE_SIZE);
-                restore_interrupts(ints);
+            rom = rom_flash = rom_slot_address(&slot);
+            printf("ROM %s found in flash in %llu ms\n", pathname, (time_us_64() - load_start) / 1000);
+            return true;
+        }
+    }
 
-                gpio_put(PICO_DEFAULT_LED_PIN, flash_target_offset >> 13 & 1);
+    /* Drop the ROMs in the way, and the least recently used one if the directory is full, before
+     * their flash is overwritten. */
+    const int first_unit = rom_slot_place(units);
+    rom_slot_t* free_slot = nullptr;
+    for (auto& slot: rom_directory.slots) {
+        const uint32_t slot_units = (slot.size + ROM_SLOT_UNIT - 1) / ROM_SLOT_UNIT;
+        if (slot.last_used && slot.first_unit < first_unit + units && first_unit < slot.first_unit + slot_units)
+            slot.last_used = 0;
+        if (!free_slot || slot.last_used < free_slot->last_used)
+            free_slot = &slot;
+    }
+    free_slot->last_used = 0;
+    rom_directory_write();
+
+    /* The emulator is stopped, so a framebuffer serves as the read buffer. Not SCREEN[0], that is the
+     * text buffer showing this window. */
+    uint8_t* const buffer = &SCREEN[1][0][0];
+    const uint32_t flash_start = FLASH_TARGET_OFFSET + first_unit * ROM_SLOT_UNIT;
+    const uint32_t flash_end = flash_start + ((fileinfo.fsize + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1));
+    uint32_t erased_end = flash_start;
+
+    for (uint32_t unit = first_unit; unit < first_unit + units; unit++)
+        rom_directory.erase_count[unit]++;
+
+    static_assert(sizeof(SCREEN[1]) >= ROM_LOAD_CHUNK);
+    uint32_t flash_target_offset;
+    for (flash_target_offset = flash_start; flash_target_offset < flash_end; flash_target_offset += bytes_read) {
+        /* FatFs reads whole sectors of a large request straight into the buffer, cluster by cluster. */
+        if (FR_OK != f_read(&file, buffer, ROM_LOAD_CHUNK, &bytes_read) || !bytes_read)
+            break;
+        key.crc = crc32_update(key.crc, buffer, bytes_read);
+        memset(buffer + bytes_read, 0xFF, -bytes_read & (FLASH_PAGE_SIZE - 1));
+        bytes_read = (bytes_read + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+
+        /* Erase just ahead of programming, 64 KB blocks erase faster than 4 KB sectors. */
+        while (erased_end < flash_target_offset + bytes_read) {
+            const uint32_t length = flash_end - erased_end >= FLASH_BLOCK_SIZE ? FLASH_BLOCK_SIZE : FLASH_SECTOR_SIZE;
+            const uint32_t ints = save_and_disable_interrupts();
+            flash_range_erase(erased_end, length);
+            restore_interrupts(ints);
+            erased_end += length;
+        }
 
-                flash_target_offset += FLASH_PAGE_SIZE;
-            }
+        for (uint32_t offset = 0; offset < bytes_read; offset += FLASH_SECTOR_SIZE) {
+            const uint32_t length = bytes_read - offset < FLASH_SECTOR_SIZE ? bytes_read - offset : FLASH_SECTOR_SIZE;
+            const uint32_t ints = save_and_disable_interrupts();
+            flash_range_program(flash_target_offset + offset, buffer + offset, length);
+            restore_interrupts(ints);
         }
-        while (bytes_read != 0);
 
-        gpio_put(PICO_DEFAULT_LED_PIN, true);
+        gpio_put(PICO_DEFAULT_LED_PIN, flash_target_offset >> 15 & 1);
+        draw_progress(window_x + 1, window_y + 3, 41, flash_target_offset + bytes_read - flash_start, flash_end - flash_start);
     }
+
+    gpio_put(PICO_DEFAULT_LED_PIN, true);
     f_close(&file);
+
+    /* Check the flash against what was read, a slot that does not match is left empty. */
+    if (flash_target_offset < flash_end ||
+        key.crc != crc32_update(0, (const uint8_t *)(XIP_BASE + flash_start), fileinfo.fsize)) {
+        multicore_lockout_end_blocking();
+        draw_text("ERROR: Can't read ROM! Canceled!!", window_x + 1, window_y + 2, 13, 1);
+        sleep_ms(5000);
+        return false;
+    }
+
+    *free_slot = key;
+    free_slot->first_unit = first_unit;
+    free_slot->last_used = ++rom_directory.sequence;
+    rom_directory_write();
+
     multicore_lockout_end_blocking();
     // restore_interrupts(ints);
+    rom = rom_flash = rom_slot_address(free_slot);
+    printf("ROM %s programmed to flash in %llu ms\n", pathname, (time_us_64() - load_start) / 1000);
     return true;
 }
 
+/**
+ * Records the path of the ROM being started, for "Run previous". The flash directory cannot tell
+ * which game ran last, as small ROMs run from SRAM without an entry in it.
+ */
+static void previous_rom_write(const char pathname[256]) {
+    FIL file;
+    UINT bytes_written;
+    if (FR_OK == f_open(&file, PREVIOUS_ROM_FILE, FA_CREATE_ALWAYS | FA_WRITE)) {
+        f_write(&file, pathname, strlen(pathname), &bytes_written);
+        f_close(&file);
+    }
+}
+
+/**
+ * Reads the path recorded by previous_rom_write(), if that ROM is still on the SD card.
+ */
+static bool previous_rom_read(char pathname[256]) {
+    FIL file;
+    FILINFO fileinfo;
+    UINT bytes_read = 0;
+    if (FR_OK != f_open(&file, PREVIOUS_ROM_FILE, FA_READ))
+        return false;
+    f_read(&file, pathname, 255, &bytes_read);
+    f_close(&file);
+    pathname[bytes_read] = '\0';
+    return bytes_read && FR_OK == f_stat(pathname, &fileinfo);
+}
+
 void __not_in_flash_func(filebrowser)(const char pathname[256], const char executables[11]) {
     bool debounce = true;
     char basepath[256];
@@ -540,6 +1122,10 @@ void __not_in_flash_func(filebrowser)(const char pathname[256], const char execu
 
             // ESCAPE
             if (gamepad_bits.select) {
+                /* Run previous. Without a record it is the ROM in flash used last. */
+                char previous[256];
+                if (previous_rom_read(previous))
+                    filebrowser_loadfile(previous);
                 return;
             }
 
@@ -601,7 +1187,8 @@ void __not_in_flash_func(filebrowser)(const char pathname[256], const char execu
                 if (file_at_cursor.is_executable) {
                     sprintf(tmp, "%s\\%s", basepath, file_at_cursor.filename);
 
-                    filebrowser_loadfile(tmp);
+                    if (filebrowser_loadfile(tmp))
+                        previous_rom_write(tmp);
                     return;
                 }
             }
@@ -691,53 +1278,837 @@ bool overclock() {
 #endif
 }
 
-static bool save() {
-    char pathname[255];
+/**
+ * Save states are a STATE_MAGIC, STATE_VERSION header and then chunks, each a little endian id,
+ * size and CRC-32 of its data, then the data. The core's chunks are followed by the ROM header the
+ * state belongs to, the APU and the cart RAM, and STATE_END closes the file. Unknown chunks are
+ * skipped, so adding a chunk needs no new version. STATE_VERSION only goes up when the encoding
+ * changes, and load() refuses states from a newer version. Memory chunks with STATE_RLE set in
+ * their size are run length encoded, and the CRC covers the encoded bytes. They came with
+ * version 2.
+ */
+#define STATE_MAGIC GB_STATE_ID('G', 'B', 'S', 'T')
+#define STATE_VERSION 2
+#define STATE_ROM GB_STATE_ID('R', 'O', 'M', ' ')
+#define STATE_APU GB_STATE_ID('A', 'P', 'U', ' ')
+#define STATE_CRAM GB_STATE_ID('C', 'R', 'A', 'M')
+#define STATE_END GB_STATE_ID('E', 'N', 'D', ' ')
+#define STATE_RLE 0x80000000u
+/* Title, licensee, cartridge type, sizes and checksums. */
+#define STATE_ROM_HEADER 0x134
+#define STATE_ROM_HEADER_SIZE (0x150 - STATE_ROM_HEADER)
+
+/**
+ * A save takes a snapshot of the whole state file into this buffer within the frame, and the main
+ * loop writes it out STATE_WRITE_BYTES per frame while the game runs on. The menu reads the
+ * selected slot's file into it in advance, so loading only has to apply it. A state that does not
+ * fit, such as most CGB states on RP2040, is streamed to and from its file through state_fd
+ * instead, with the buffer as the read window, and the game waits for it.
+ */
+#if PICO_RP2350
+#define STATE_BUFFER_SIZE 65536
+#else
+#define STATE_BUFFER_SIZE 16384
+#endif
+#define STATE_WRITE_BYTES 4096
+static uint8_t __aligned(4) state_buffer[STATE_BUFFER_SIZE];
+/* Slot whose state file the buffer holds, or -1. */
+static int state_buffer_slot = -1;
+/* Bytes of the file in the buffer, and how many of those are on the card. */
+static uint32_t state_length = 0;
+static uint32_t state_written = 0;
+static FIL state_fd;
+
+static void state_path(char* pathname, const int slot) {
     char filename[24];
     gb_get_rom_name(&gb, filename);
 
-    if (save_slot) {
-        sprintf(pathname, "%s\\%s_%d.save", HOME_DIR, filename, save_slot);
+    if (slot) {
+        sprintf(pathname, "%s\\%s_%d.save", HOME_DIR, filename, slot);
     }
     else {
         sprintf(pathname, "%s\\%s.save", HOME_DIR, filename);
     }
+}
 
-    FRESULT fr = f_mount(&fs, "", 1);
-    FIL fd;
-    fr = f_open(&fd, pathname, FA_CREATE_ALWAYS | FA_WRITE);
+/**
+ * Waits until core1 has drawn every queued line and synthesised every ended frame, so the state
+ * is only touched by core0.
+ */
+static void state_sync() {
+    lcd_wait_lines(&gb);
+    while (audio_frames_pending())
+        tight_loop_contents();
+}
+
+/**
+ * PackBits style run length encoding: a control byte below 0x80 is followed by that many plus one
+ * literal bytes, and one from 0x80 repeats the next byte control - 0x80 + 3 times. Returns the
+ * encoded length, or 0 if it would not fit in room bytes.
+ */
+static uint32_t state_rle_encode(const uint8_t* src, const uint32_t size, uint8_t* dst, const uint32_t room) {
+    uint32_t in = 0, out = 0;
+
+    while (in < size) {
+        uint32_t run = 1;
+        while (in + run < size && run < 130 && src[in + run] == src[in])
+            run++;
+
+        if (run >= 3) {
+            if (out + 2 > room)
+                return 0;
+            dst[out++] = 0x80 + run - 3;
+            dst[out++] = src[in];
+            in += run;
+            continue;
+        }
+
+        /* Literals up to the next run of three. */
+        uint32_t literals = 0;
+        while (in + literals < size && literals < 128 &&
+               !(in + literals + 2 < size && src[in + literals] == src[in + literals + 1] &&
+                 src[in + literals] == src[in + literals + 2]))
+            literals++;
+
+        if (out + 1 + literals > room)
+            return 0;
+        dst[out++] = literals - 1;
+        memcpy(&dst[out], &src[in], literals);
+        out += literals;
+        in += literals;
+    }
+    return out;
+}
+
+/**
+ * Appends a chunk to the snapshot in the buffer, encoding memory chunks when that makes them
+ * smaller. Returns false if the buffer is full.
+ */
+static bool state_snapshot_chunk(void* ctx, uint32_t id, const void* data, uint_fast32_t size) {
+    uint32_t header[3];
+    uint8_t* const out = state_buffer + state_length + sizeof(header);
+    uint_fast32_t memory_size;
+
+    if (state_length + sizeof(header) > STATE_BUFFER_SIZE)
+        return false;
+    const uint32_t room = STATE_BUFFER_SIZE - state_length - sizeof(header);
+
+    uint32_t stored = 0;
+    if (size > 1 && (id == STATE_CRAM || gb_state_memory(&gb, id, &memory_size) != nullptr))
+        stored = state_rle_encode((const uint8_t *)data, size, out, room < size - 1 ? room : size - 1);
+
+    if (stored) {
+        header[1] = STATE_RLE | stored;
+    }
+    else {
+        if (size > room)
+            return false;
+        if (size)
+            memcpy(out, data, size);
+        header[1] = stored = size;
+    }
+    header[0] = id;
+    header[2] = crc32_update(0, out, stored);
+    memcpy(state_buffer + state_length, header, sizeof(header));
+    state_length += sizeof(header) + stored;
+    return true;
+}
+
+/**
+ * Writes a chunk straight to the state file open in ctx, without encoding it.
+ */
+static bool state_stream_chunk(void* ctx, uint32_t id, const void* data, uint_fast32_t size) {
+    FIL* const fd = (FIL *)ctx;
+    const uint32_t header[3] = { id, (uint32_t)size, crc32_update(0, (const uint8_t *)data, size) };
+    UINT bw;
+
+    return f_write(fd, header, sizeof(header), &bw) == FR_OK && bw == sizeof(header) &&
+           (size == 0 || (f_write(fd, data, size, &bw) == FR_OK && bw == size));
+}
+
+/**
+ * Passes the whole state after the file header to a chunk writer.
+ */
+static bool state_serialise(bool (*write)(void* ctx, uint32_t id, const void* data, uint_fast32_t size),
+                            void* ctx) {
+    uint8_t apu[AUDIO_STATE_SIZE];
+    audio_state_save(apu);
+
+    return write(ctx, STATE_ROM, rom + STATE_ROM_HEADER, STATE_ROM_HEADER_SIZE) &&
+           gb_state_save(&gb, write, ctx) &&
+           write(ctx, STATE_APU, apu, sizeof(apu)) &&
+           (gb_get_save_size(&gb) == 0 || write(ctx, STATE_CRAM, cart_ram, gb_get_save_size(&gb))) &&
+           write(ctx, STATE_END, nullptr, 0);
+}
+
+/**
+ * Writes up to max bytes more of the snapshot in the buffer to its file, opening the file first.
+ * Returns true while there is more to write.
+ */
+static bool write_state_file(const uint32_t max) {
+    if (state_written == state_length)
+        return false;
+
+    FRESULT fr = FR_OK;
+    if (state_written == 0) {
+        char pathname[255];
+        state_path(pathname, state_buffer_slot);
+        fr = f_open(&state_fd, pathname, FA_CREATE_ALWAYS | FA_WRITE);
+        if (fr != FR_OK) {
+            state_written = state_length;
+            show_osd_message("State %d not saved", state_buffer_slot);
+            return false;
+        }
+    }
+
+    const uint32_t length = state_length - state_written < max ? state_length - state_written : max;
     UINT bw;
+    fr = f_write(&state_fd, state_buffer + state_written, length, &bw);
+    state_written += length;
+    if (fr == FR_OK && bw == length && state_written < state_length)
+        return true;
+
+    /* Done, or nothing more can be written. */
+    state_written = state_length;
+    if (f_close(&state_fd) == FR_OK && fr == FR_OK && bw == length) {
+        show_osd_message("State %d saved", state_buffer_slot);
+    }
+    else {
+        show_osd_message("State %d not saved", state_buffer_slot);
+        state_buffer_slot = -1;
+    }
+    return false;
+}
+
+/**
+ * Reads the state file of a slot into the buffer, if it fits. Any snapshot still in the buffer is
+ * written out first.
+ */
+static bool read_state_file(const int slot) {
+    while (write_state_file(UINT32_MAX)) {
+    }
+    state_buffer_slot = -1;
 
-    f_write(&fd, &gb, sizeof(gb), &bw);
-    f_write(&fd, ram, sizeof(ram), &bw);
+    char pathname[255];
+    state_path(pathname, slot);
+    FIL fd;
+    if (f_open(&fd, pathname, FA_READ) != FR_OK)
+        return false;
+
+    UINT br = 0;
+    const uint32_t size = f_size(&fd);
+    const bool fits = size <= STATE_BUFFER_SIZE &&
+                      f_read(&fd, state_buffer, size, &br) == FR_OK && br == size;
     f_close(&fd);
 
+    if (fits) {
+        state_buffer_slot = slot;
+        state_length = state_written = size;
+    }
+    return fits;
+}
+
+static bool save() {
+    /* The buffer is about to be taken over. */
+    while (write_state_file(UINT32_MAX)) {
+    }
+
+    state_sync();
+    const uint32_t header[2] = { STATE_MAGIC, STATE_VERSION };
+    memcpy(state_buffer, header, sizeof(header));
+    state_length = sizeof(header);
+    state_written = 0;
+    state_buffer_slot = save_slot;
+    if (state_serialise(state_snapshot_chunk, nullptr))
+        return true;
+
+    /* Too big for the buffer even encoded, so write it out now, chunk by chunk. */
+    state_length = 0;
+    state_buffer_slot = -1;
+
+    char pathname[255];
+    state_path(pathname, save_slot);
+    bool ok = f_open(&state_fd, pathname, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK;
+    if (ok) {
+        UINT bw;
+        ok = f_write(&state_fd, header, sizeof(header), &bw) == FR_OK && bw == sizeof(header) &&
+             state_serialise(state_stream_chunk, &state_fd);
+        ok = f_close(&state_fd) == FR_OK && ok;
+    }
+    show_osd_message(ok ? "State %d saved" : "State %d not saved", save_slot);
+    return ok;
+}
+
+/**
+ * Reads a state file from the buffer, and keeps a CRC of what it read. With fd set, the buffer is a
+ * window refilled from that file.
+ */
+typedef struct {
+    const uint8_t* data;
+    uint32_t pos;
+    uint32_t length;
+    uint32_t crc;
+    FIL* fd;
+} state_reader_t;
+
+/**
+ * Refills the window with the file from the first unread byte on. Returns false at the end.
+ */
+static bool state_refill(state_reader_t* reader) {
+    const uint32_t kept = reader->length - reader->pos;
+    UINT br = 0;
+
+    if (reader->fd == nullptr)
+        return false;
+
+    memmove(state_buffer, reader->data + reader->pos, kept);
+    reader->data = state_buffer;
+    reader->pos = 0;
+    reader->length = kept;
+    if (f_read(reader->fd, state_buffer + kept, STATE_BUFFER_SIZE - kept, &br) != FR_OK)
+        return false;
+    reader->length += br;
+    return br != 0;
+}
+
+/**
+ * Reads len bytes to dst, or skips them if dst is NULL.
+ */
+static bool state_read(state_reader_t* reader, void* dst, uint32_t len) {
+    auto* out = (uint8_t *)dst;
+
+    while (len > reader->length - reader->pos) {
+        const uint32_t part = reader->length - reader->pos;
+        reader->crc = crc32_update(reader->crc, reader->data + reader->pos, part);
+        if (out) {
+            memcpy(out, reader->data + reader->pos, part);
+            out += part;
+        }
+        reader->pos += part;
+        len -= part;
+        if (!state_refill(reader))
+            return false;
+    }
+
+    reader->crc = crc32_update(reader->crc, reader->data + reader->pos, len);
+    if (out)
+        memcpy(out, reader->data + reader->pos, len);
+    reader->pos += len;
     return true;
 }
 
+/**
+ * Returns the next len bytes in one piece without reading them, or NULL if there are not as many.
+ */
+static const uint8_t* state_peek(state_reader_t* reader, const uint32_t len) {
+    while (len > reader->length - reader->pos)
+        if (len > STATE_BUFFER_SIZE || !state_refill(reader))
+            return nullptr;
+    return reader->data + reader->pos;
+}
+
+/**
+ * Goes back to the first chunk, after the file header.
+ */
+static bool state_rewind(state_reader_t* reader) {
+    reader->pos = 2 * sizeof(uint32_t);
+    if (reader->fd == nullptr)
+        return true;
+
+    reader->length = reader->pos;
+    return f_lseek(reader->fd, reader->pos) == FR_OK;
+}
+
+/**
+ * Reads the next chunk header, or returns false at the end of the file.
+ */
+static bool state_read_chunk(state_reader_t* reader, uint32_t header[3]) {
+    return state_read(reader, header, 3 * sizeof(uint32_t)) && header[0] != STATE_END;
+}
+
+/**
+ * Decodes a chunk of stored bytes encoded by state_rle_encode() into size bytes at dst, or only
+ * checks that it decodes to exactly that many if dst is NULL.
+ */
+static bool state_read_rle(state_reader_t* reader, uint8_t* dst, const uint32_t size, uint32_t stored) {
+    uint32_t out = 0;
+
+    while (stored >= 2) {
+        uint8_t control[2];
+        if (!state_read(reader, control, 1))
+            return false;
+
+        if (control[0] < 0x80) {
+            const uint32_t n = control[0] + 1;
+            if (n > stored - 1 || out + n > size || !state_read(reader, dst ? dst + out : nullptr, n))
+                return false;
+            out += n;
+            stored -= 1 + n;
+        }
+        else {
+            const uint32_t n = control[0] - 0x80 + 3;
+            if (out + n > size || !state_read(reader, &control[1], 1))
+                return false;
+            if (dst)
+                memset(dst + out, control[1], n);
+            out += n;
+            stored -= 2;
+        }
+    }
+    return stored == 0 && out == size;
+}
+
+/**
+ * Checks every chunk's CRC, that the state is for this ROM and that memory chunks fill exactly the
+ * memory of this model, before anything is loaded.
+ */
+static bool state_check(state_reader_t* reader) {
+    uint32_t header[3];
+    uint8_t rom_header[STATE_ROM_HEADER_SIZE];
+    bool rom_matches = false;
+
+    while (state_read_chunk(reader, header)) {
+        const uint32_t stored = header[1] & ~STATE_RLE;
+        uint_fast32_t memory_size = 0;
+        const bool memory = gb_state_memory(&gb, header[0], &memory_size) != nullptr;
+        if (header[0] == STATE_CRAM)
+            memory_size = gb_get_save_size(&gb);
+
+        if ((memory || header[0] == STATE_CRAM) && !(header[1] & STATE_RLE) && stored != memory_size)
+            return false;
+        if ((header[1] & STATE_RLE) && !memory && header[0] != STATE_CRAM)
+            return false;
+        if (header[0] == STATE_APU && stored < AUDIO_STATE_SIZE)
+            return false;
+
+        const bool is_rom = header[0] == STATE_ROM && stored == STATE_ROM_HEADER_SIZE;
+        reader->crc = 0;
+        const bool read = header[1] & STATE_RLE ? state_read_rle(reader, nullptr, memory_size, stored)
+                                                : state_read(reader, is_rom ? rom_header : nullptr, stored);
+        if (!read || reader->crc != header[2])
+            return false;
+
+        if (is_rom)
+            rom_matches = memcmp(rom_header, rom + STATE_ROM_HEADER, STATE_ROM_HEADER_SIZE) == 0;
+    }
+    return rom_matches && header[0] == STATE_END;
+}
+
+/**
+ * Loads the selected slot's state, only once all of it has been checked. A state in the buffer is
+ * applied from there. One too large for it is read from the card twice, to check and then to apply,
+ * and the game starts over from power on if the card fails in between.
+ */
 static bool load() {
-    char pathname[255];
-    char filename[24];
-    gb_get_rom_name(&gb, filename);
+    state_reader_t reader = {};
+    reader.data = state_buffer;
+    reader.length = state_length;
+
+    /* The buffer may already hold the slot, from the menu or from saving it. */
+    if (state_buffer_slot != save_slot && !read_state_file(save_slot)) {
+        char pathname[255];
+        state_path(pathname, save_slot);
+        if (f_open(&state_fd, pathname, FA_READ) != FR_OK) {
+            show_osd_message("No state %d", save_slot);
+            return false;
+        }
+        /* The buffer becomes the read window. */
+        state_length = state_written = 0;
+        reader.length = 0;
+        reader.fd = &state_fd;
+    }
 
-    if (save_slot) {
-        sprintf(pathname, "GB\\%s_%d.save", filename, save_slot);
+    uint32_t header[3];
+    /* States from before the chunked format are raw structs, and are refused here. */
+    bool ok = state_read(&reader, header, 2 * sizeof(uint32_t)) &&
+              header[0] == STATE_MAGIC && header[1] <= STATE_VERSION && state_check(&reader);
+
+    if (ok)
+        ok = state_rewind(&reader);
+
+    if (ok) {
+        state_sync();
+        /* A streamed state can still fail to read after cart RAM is overwritten, so the save file
+         * has to be up to date to restore it from. */
+        if (reader.fd != nullptr)
+            write_cart_ram_file(&gb, true);
+        /* Anything the state leaves out starts from power on. */
+        gb_reset(&gb);
+
+        while (ok && state_read_chunk(&reader, header)) {
+            const uint32_t stored = header[1] & ~STATE_RLE;
+            uint_fast32_t memory_size;
+            uint8_t* memory = gb_state_memory(&gb, header[0], &memory_size);
+            if (header[0] == STATE_CRAM) {
+                memory = cart_ram;
+                memory_size = gb_get_save_size(&gb);
+            }
+
+            if (memory != nullptr && (header[1] & STATE_RLE)) {
+                ok = state_read_rle(&reader, memory, memory_size, stored);
+            }
+            else if (memory != nullptr) {
+                ok = state_read(&reader, memory, stored);
+            }
+            else {
+                const uint8_t* const data = state_peek(&reader, stored);
+                ok = data != nullptr &&
+                     (header[0] == STATE_APU ? audio_state_load(data, stored)
+                                             : gb_state_load(&gb, header[0], data, stored)) &&
+                     state_read(&reader, nullptr, stored);
+            }
+        }
+
+        if (ok) {
+            gb_state_loaded(&gb);
+
+            /* The whole battery save may have changed. */
+            memset(save_dirty, 0xFF, sizeof(save_dirty));
+            save_dirty_us = time_us_64();
+        }
+        else {
+            /* A core chunk too short for what it holds, and the game starts over from power on
+             * instead. Cart RAM comes after those and was checked in full. Only a card that fails
+             * on the second read of a streamed state leaves it part way loaded, so then it is read
+             * back from the save file. */
+            gb_reset(&gb);
+            if (reader.fd != nullptr)
+                read_cart_ram_file(&gb);
+        }
+    }
+
+    if (reader.fd != nullptr)
+        f_close(reader.fd);
+    show_osd_message(ok ? "State %d loaded" : "State %d not loaded", save_slot);
+    return ok;
+}
+
+#if REWIND_BUFFER_SIZE
+/**
+ * Rewind takes a snapshot of the state every REWIND_INTERVAL frames. The newest one is kept whole,
+ * as an image at the front of the rewind buffer, and the rest of the buffer is a ring of deltas
+ * back to the ones before it. A delta is the XOR of two snapshots, run length encoded in words: a
+ * control word n skips n unchanged words, and one with REWIND_LITERAL set is followed by n words
+ * to XOR in. Stepping back XORs the newest delta into the image and loads it. The oldest deltas
+ * make way for new ones. Sound is left out, as taking it would wait for core1 to catch up.
+ */
+#define REWIND_INTERVAL 30
+/* Holding the rewind key steps back a snapshot every this many frames. */
+#define REWIND_STEP_FRAMES 4
+/* Snapshots wait for a frame with this much time to spare. */
+#define REWIND_BUDGET_US 500
+#define REWIND_ENTRIES 256
+#define REWIND_LITERAL 0x80000000u
+/* Compression is logged every this many snapshots. */
+#define REWIND_LOG_SNAPSHOTS 120
+
+typedef struct {
+    uint32_t id;
+    uint32_t size;
+    uint32_t word;
+} rewind_chunk_t;
+
+/* Where each chunk of a snapshot sits in the image, in the order gb_state_save() passes them. At
+ * most eight come from the core, then the cart RAM. */
+#define REWIND_CHUNKS 9
+static rewind_chunk_t rewind_chunks[REWIND_CHUNKS];
+static uint32_t rewind_chunk_count = 0;
+/* Words of the image, 0 when rewind is off, and of the ring after it. */
+static uint32_t rewind_image_words = 0;
+static uint32_t rewind_ring_words = 0;
+/* Ring positions only count up, and wrap when used. Deltas run from their start to the next
+ * one's, the newest to rewind_head. */
+static uint32_t rewind_start[REWIND_ENTRIES];
+static uint32_t rewind_first = 0, rewind_count = 0, rewind_head = 0;
+/* Whether the image holds a snapshot yet, and frames run since it was taken. */
+static bool rewind_primed = false;
+static uint32_t rewind_frames = 0, rewind_held = 0;
+/* For the log. */
+static uint32_t rewind_snapshots = 0, rewind_stored = 0, rewind_worst_us = 0;
+
+typedef struct {
+    uint32_t chunk;
+    uint32_t start;
+    /* Unchanged words not yet written as a run, the open literal run and its control word. */
+    uint32_t zeros;
+    uint32_t literals;
+    uint32_t control;
+    bool overflow;
+} rewind_encoder_t;
+
+static bool rewind_layout_chunk(void* ctx, uint32_t id, const void* data, uint_fast32_t size) {
+    if (rewind_chunk_count == REWIND_CHUNKS)
+        return false;
+
+    rewind_chunk_t* const chunk = &rewind_chunks[rewind_chunk_count++];
+    chunk->id = id;
+    chunk->size = size;
+    chunk->word = rewind_image_words;
+    rewind_image_words += (size + 3) / 4;
+    return true;
+}
+
+/**
+ * Lays the image out for the game just started and forgets any snapshots. Rewind is off if the
+ * image would leave less than a quarter of the buffer for deltas.
+ */
+static void rewind_reset() {
+    rewind_chunk_count = rewind_image_words = 0;
+    rewind_first = rewind_count = rewind_head = 0;
+    rewind_primed = false;
+    rewind_frames = rewind_held = 0;
+    rewind_snapshots = rewind_stored = rewind_worst_us = 0;
+
+    const bool laid_out = gb_state_save(&gb, rewind_layout_chunk, nullptr) &&
+                          (gb_get_save_size(&gb) == 0 ||
+                           rewind_layout_chunk(nullptr, STATE_CRAM, cart_ram, gb_get_save_size(&gb)));
+    if (!laid_out || rewind_image_words > REWIND_BUFFER_SIZE / 4 / 4 * 3) {
+        printf("I rewind off, %lu byte snapshots\n", (unsigned long)rewind_image_words * 4);
+        rewind_image_words = 0;
+        return;
+    }
+    rewind_ring_words = REWIND_BUFFER_SIZE / 4 - rewind_image_words;
+}
+
+/**
+ * Claims the next ring word for the delta being encoded, dropping the oldest deltas to make room.
+ * Returns false once the delta has outgrown the whole ring.
+ */
+static bool rewind_claim(rewind_encoder_t* encoder, uint32_t* position) {
+    if (encoder->overflow)
+        return false;
+
+    while (rewind_head - (rewind_count ? rewind_start[rewind_first % REWIND_ENTRIES] : encoder->start) >=
+           rewind_ring_words) {
+        if (rewind_count == 0) {
+            encoder->overflow = true;
+            return false;
+        }
+        rewind_first++;
+        rewind_count--;
+    }
+    *position = rewind_head++;
+    return true;
+}
+
+/**
+ * Ends the open literal run, and writes out the unchanged words since.
+ */
+static void rewind_end_run(rewind_encoder_t* encoder) {
+    uint32_t position;
+
+    if (encoder->literals)
+        rewind_buffer[rewind_image_words + encoder->control % rewind_ring_words] =
+            REWIND_LITERAL | encoder->literals;
+    encoder->literals = 0;
+
+    if (encoder->zeros && rewind_claim(encoder, &position))
+        rewind_buffer[rewind_image_words + position % rewind_ring_words] = encoder->zeros;
+    encoder->zeros = 0;
+}
+
+static void rewind_emit(rewind_encoder_t* encoder, const uint32_t delta) {
+    uint32_t position;
+
+    if (encoder->zeros || !encoder->literals) {
+        rewind_end_run(encoder);
+        if (!rewind_claim(encoder, &encoder->control))
+            return;
+    }
+    if (rewind_claim(encoder, &position)) {
+        rewind_buffer[rewind_image_words + position % rewind_ring_words] = delta;
+        encoder->literals++;
+    }
+}
+
+/**
+ * Brings a chunk of the image up to date, and appends what changed to the delta being encoded.
+ */
+static bool rewind_snapshot_chunk(void* ctx, uint32_t id, const void* data, uint_fast32_t size) {
+    auto* encoder = (rewind_encoder_t *)ctx;
+    if (encoder->chunk == rewind_chunk_count)
+        return false;
+    const rewind_chunk_t* chunk = &rewind_chunks[encoder->chunk++];
+    if (chunk->id != id || chunk->size != size)
+        return false;
+
+    uint32_t* const image = rewind_buffer + chunk->word;
+    const auto* src = (const uint8_t *)data;
+    const uint32_t words = (size + 3) / 4;
+    /* Counted here rather than in the encoder, which could alias the image. */
+    uint32_t zeros = encoder->zeros;
+    for (uint32_t i = 0; i < words; i++) {
+        uint32_t word = 0;
+        if (i < size / 4)
+            memcpy(&word, src + i * 4, 4);
+        else
+            memcpy(&word, src + i * 4, size % 4);
+
+        const uint32_t delta = word ^ image[i];
+        if (delta) {
+            image[i] = word;
+            encoder->zeros = zeros;
+            rewind_emit(encoder, delta);
+            zeros = 0;
+        }
+        else {
+            zeros++;
+        }
+    }
+    encoder->zeros = zeros;
+    return true;
+}
+
+/**
+ * Takes a snapshot into the image, keeping the delta back to the one before.
+ */
+static void rewind_snapshot() {
+    const uint64_t start = time_us_64();
+    rewind_encoder_t encoder = {};
+
+    if (rewind_count == REWIND_ENTRIES) {
+        rewind_first++;
+        rewind_count--;
+    }
+    encoder.start = rewind_head;
+    /* The first snapshot only fills the image. */
+    encoder.overflow = !rewind_primed;
+
+    const bool ok = gb_state_save(&gb, rewind_snapshot_chunk, &encoder) &&
+                    (gb_get_save_size(&gb) == 0 ||
+                     rewind_snapshot_chunk(&encoder, STATE_CRAM, cart_ram, gb_get_save_size(&gb)));
+    encoder.zeros = 0;
+    rewind_end_run(&encoder);
+
+    if (!ok) {
+        rewind_image_words = 0;
+        return;
+    }
+    if (encoder.overflow) {
+        /* Nothing before this snapshot can be reached any more. */
+        rewind_count = 0;
+        rewind_head = encoder.start;
     }
     else {
-        sprintf(pathname, "GB\\%s.save", filename);
+        rewind_start[(rewind_first + rewind_count++) % REWIND_ENTRIES] = encoder.start;
+        rewind_stored += rewind_head - encoder.start;
+        rewind_snapshots++;
     }
+    rewind_primed = true;
+    rewind_frames = 0;
+
+    const uint32_t us = time_us_64() - start;
+    if (us > rewind_worst_us)
+        rewind_worst_us = us;
+    if (rewind_snapshots && rewind_snapshots % REWIND_LOG_SNAPSHOTS == 0 && !encoder.overflow) {
+        char romname[24];
+        gb_get_rom_name(&gb, romname);
+        const uint64_t raw = (uint64_t)rewind_snapshots * rewind_image_words;
+        const uint64_t ratio = raw * 10 / (rewind_stored ? rewind_stored : 1);
+        printf("I rewind %s: %lu byte snapshots, deltas %lu bytes on average (%lu.%lu:1), %lu us worst, %lu kept\n",
+               romname, (unsigned long)rewind_image_words * 4, (unsigned long)(rewind_stored / rewind_snapshots * 4),
+               (unsigned long)(ratio / 10), (unsigned long)(ratio % 10), (unsigned long)rewind_worst_us,
+               (unsigned long)rewind_count);
+    }
+}
 
-    FRESULT fr = f_mount(&fs, "", 1);
-    FIL fd;
-    fr = f_open(&fd, pathname, FA_READ);
-    UINT br;
+/**
+ * Loads the snapshot in the image.
+ */
+static void rewind_restore() {
+    lcd_wait_lines(&gb);
+
+    for (uint32_t i = 0; i < rewind_chunk_count; i++) {
+        const rewind_chunk_t* chunk = &rewind_chunks[i];
+        const auto* data = (const uint8_t *)(rewind_buffer + chunk->word);
+        uint_fast32_t memory_size;
+        uint8_t* memory = gb_state_memory(&gb, chunk->id, &memory_size);
+
+        if (chunk->id == STATE_CRAM) {
+            /* Only the sectors that change need writing back to the card. */
+            for (uint32_t offset = 0; offset < chunk->size; offset += SAVE_SECTOR_SIZE) {
+                const uint32_t length = chunk->size - offset < SAVE_SECTOR_SIZE ? chunk->size - offset : SAVE_SECTOR_SIZE;
+                const uint32_t sector = offset / SAVE_SECTOR_SIZE;
+                if (memcmp(cart_ram + offset, data + offset, length) != 0) {
+                    memcpy(cart_ram + offset, data + offset, length);
+                    save_dirty[sector / 32] |= 1u << sector % 32;
+                    save_dirty_us = time_us_64();
+                }
+            }
+        }
+        else if (memory != nullptr) {
+            memcpy(memory, data, chunk->size);
+        }
+        else {
+            gb_state_load(&gb, chunk->id, data, chunk->size);
+        }
+    }
+    gb_state_loaded(&gb);
+}
 
-    f_read(&fd, &gb, sizeof(gb), &br);
-    f_read(&fd, ram, sizeof(ram), &br);
-    f_close(&fd);
+/**
+ * Goes back to the last snapshot, or to the one before it if that is where the game already is.
+ * Returns false when there is nothing further back.
+ */
+static bool rewind_step() {
+    if (!rewind_primed)
+        return false;
 
+    if (rewind_frames == 0) {
+        if (rewind_count == 0)
+            return false;
+
+        const uint32_t start = rewind_start[(rewind_first + --rewind_count) % REWIND_ENTRIES];
+        uint32_t word = 0;
+        for (uint32_t position = start; position != rewind_head;) {
+            const uint32_t control = rewind_buffer[rewind_image_words + position++ % rewind_ring_words];
+            uint32_t n = control & ~REWIND_LITERAL;
+            if (control & REWIND_LITERAL) {
+                while (n--)
+                    rewind_buffer[word++] ^= rewind_buffer[rewind_image_words + position++ % rewind_ring_words];
+            }
+            else {
+                word += n;
+            }
+        }
+        rewind_head = start;
+    }
+    rewind_restore();
+    rewind_frames = 0;
     return true;
 }
+
+/**
+ * Runs before each frame. Holding the rewind key steps back through the snapshots, and the game
+ * plays on from wherever it is let go.
+ */
+static void rewind_input(const bool held) {
+    if (!rewind_image_words)
+        return;
+
+    if (!held) {
+        rewind_held = 0;
+    }
+    else if (rewind_held++ % REWIND_STEP_FRAMES == 0) {
+        if (rewind_step())
+            show_osd_message("Rewind %d", rewind_count);
+        else
+            show_osd_message("Rewind end", 0);
+    }
+}
+
+/**
+ * Runs after each frame, taking a snapshot once one is due if the frame has the time to spare
+ * before its deadline.
+ */
+static void rewind_frame_end(const uint64_t deadline) {
+    if (!rewind_image_words || rewind_held)
+        return;
+
+    if (++rewind_frames >= REWIND_INTERVAL && time_us_64() + REWIND_BUDGET_US <= deadline)
+        rewind_snapshot();
+}
+#endif
 #if SOFTTV
 typedef struct tv_out_mode_t {
     // double color_freq;
@@ -767,6 +2138,9 @@ const MenuItem menu_items[] = {
     //{ "Player 1: %s",        ARRAY, &player_1_input, 2, { "Keyboard ", "Gamepad 1", "Gamepad 2" }},
     //{ "Player 2: %s",        ARRAY, &player_2_input, 2, { "Keyboard ", "Gamepad 1", "Gamepad 2" }},
     { "Swap AB <> BA: %s", ARRAY, &swap_ab,  nullptr, 1, {"NO ", "YES"}},
+    { "Idle loop skip: %s", ARRAY, &idle_skip, nullptr, 1, {"NO ", "YES"}},
+    { "Frame skip: %s", ARRAY, &frame_skip_mode, nullptr, 4, {"AUTO", "OFF ", "1   ", "2   ", "3   "}},
+    { "Skip counter: %s", ARRAY, &skip_counter, nullptr, 1, {"NO ", "YES"}},
     { "Palette: %s ", ARRAY, &manual_palette_selected, nullptr, 12,
         {
             "0 - AUTO      ",
@@ -813,6 +2187,9 @@ static void f_load_conf(void) {
         UINT br;
         f_read(&f, &swap_ab, 1, &br);
         f_read(&f, &manual_palette_selected, 1, &br);
+        f_read(&f, &frame_skip_mode, 1, &br);
+        f_read(&f, &skip_counter, 1, &br);
+        f_read(&f, &idle_skip, 1, &br);
         f_close(&f);
     }
 }
@@ -824,11 +2201,22 @@ static void f_save_conf(void) {
     UINT br;
     f_write(&f, &swap_ab, 1, &br);
     f_write(&f, &manual_palette_selected, 1, &br);
+    f_write(&f, &frame_skip_mode, 1, &br);
+    f_write(&f, &skip_counter, 1, &br);
+    f_write(&f, &idle_skip, 1, &br);
     f_close(&f);
 }
 
 void menu() {
     bool exit = false;
+    lcd_wait_lines(&gb);
+    write_cart_ram_file(&gb, true);
+    /* Finishes any save state still being written, and has the selected one ready to load. */
+    while (write_state_file(UINT32_MAX)) {
+    }
+    int prefetched_slot = save_slot;
+    if (state_buffer_slot != save_slot)
+        read_state_file(save_slot);
     graphics_set_mode(TEXTMODE_DEFAULT);
     char footer[TEXTMODE_COLS];
     snprintf(footer, TEXTMODE_COLS, ":: %s ::", PICO_PROGRAM_NAME);
@@ -836,6 +2224,12 @@ void menu() {
     snprintf(footer, TEXTMODE_COLS, ":: %s build %s %s ::", PICO_PROGRAM_VERSION_STRING, __DATE__,
              __TIME__);
     draw_text(footer, TEXTMODE_COLS / 2 - strlen(footer) / 2, TEXTMODE_ROWS - 1, 11, 1);
+#if PEANUT_GB_ROM_BANK_CACHE
+    snprintf(footer, TEXTMODE_COLS, "ROM cache: %lu hits, %lu misses, %lu ms filling",
+             (unsigned long)gb.rom_cache.hits, (unsigned long)gb.rom_cache.misses,
+             (unsigned long)(rom_bank_fill_us / 1000));
+    draw_text(footer, TEXTMODE_COLS / 2 - strlen(footer) / 2, TEXTMODE_ROWS - 2, 7, 0);
+#endif
     uint current_item = 0;
 
     while (!exit) {
@@ -914,6 +2308,12 @@ void menu() {
                 current_item--;
         }
 
+        if (save_slot != prefetched_slot) {
+            prefetched_slot = save_slot;
+            if (state_buffer_slot != save_slot)
+                read_state_file(save_slot);
+        }
+
         sleep_ms(125);
     }
     if (manual_palette_selected > 0) {
@@ -931,6 +2331,36 @@ void menu() {
     graphics_set_mode(GRAPHICSMODE_DEFAULT);
 }
 
+/**
+ * Decides whether the next frame is skipped. In auto mode frames are skipped while emulation runs behind
+ * real time, either by the time the last frames took over budget or because audio already ran dry.
+ */
+static bool frame_skip_next(const uint32_t frame_us, const bool audio_starved) {
+    static uint8_t skipped_in_row = 0;
+    static int32_t late_us = 0;
+
+    bool skip;
+    if (frame_skip_mode == FRAME_SKIP_OFF) {
+        skip = false;
+    }
+    else if (frame_skip_mode >= FRAME_SKIP_FIXED) {
+        skip = skipped_in_row < frame_skip_mode - FRAME_SKIP_OFF;
+    }
+    else {
+        /* Bounded, so a single stall does not cost a second of skipped frames. */
+        late_us += (int32_t)frame_us - FRAME_BUDGET_US;
+        if (late_us < 0)
+            late_us = 0;
+        else if (late_us > 4 * FRAME_BUDGET_US)
+            late_us = 4 * FRAME_BUDGET_US;
+
+        skip = (late_us > FRAME_BUDGET_US / 2 || audio_starved) && skipped_in_row < FRAME_SKIP_AUTO_MAX;
+    }
+
+    skipped_in_row = skip ? skipped_in_row + 1 : 0;
+    return skip;
+}
+
 int main() {
     overclock();
 
@@ -951,15 +2381,18 @@ int main() {
     }
 
     // Initialize I2S sound driver
-    i2s_config_t i2s_config = i2s_get_default_config();
+    i2s_config = i2s_get_default_config();
     i2s_config.sample_freq = AUDIO_SAMPLE_RATE;
-    i2s_config.dma_trans_count = AUDIO_SAMPLES;
+    /* Half a frame per DMA buffer, so the ring level the resampler steers by moves in small steps */
+    i2s_config.dma_trans_count = AUDIO_SAMPLES / 2;
     i2s_volume(&i2s_config, 0);
     i2s_init(&i2s_config);
 
     // Initialize audio emulation
     audio_init();
 
+    rom_directory_read();
+
     FRESULT fr = f_mount(&fs, "", 1);
     if (FR_OK != fr) {
         printf("E f_mount error: %s (%d)\n", FRESULT_str(fr), fr);
@@ -980,10 +2413,29 @@ int main() {
         gb_init_error_e ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
                                       &gb_cart_ram_write, &gb_error, nullptr);
 
-        if (ret != GB_INIT_NO_ERROR) {
-            while (1) draw_text("error", 1, 1, 1, 2);
+        /* The save has to fit the cart RAM arena. The ROM may be one left in flash, so go back to the
+         * file browser rather than run it. */
+        if (ret != GB_INIT_NO_ERROR || gb_get_save_size(&gb) > sizeof(cart_arena)) {
+            constexpr int window_y = (TEXTMODE_ROWS - 5) / 2;
+            constexpr int window_x = (TEXTMODE_COLS - 43) / 2;
+
+            graphics_set_mode(TEXTMODE_DEFAULT);
+            draw_window("Error", window_x, window_y, 43, 5);
+            draw_text(ret != GB_INIT_NO_ERROR ? "ERROR: Can't start ROM!" : "ERROR: Save RAM too large!",
+                      window_x + 1, window_y + 2, 13, 1);
+            sleep_ms(5000);
+            /* Without an SD card there is nothing else to run. */
+            while (FR_OK != fr)
+                tight_loop_contents();
+            continue;
         }
 
+        /* ROM is memory mapped XIP flash or SRAM, so let the core read it directly. */
+#if PEANUT_GB_ROM_BANK_CACHE
+        rom_bank_fill_us = 0;
+#endif
+        init_memory_map();
+
         /* Automatically assign a colour palette to the game */
         if (!manual_palette_selected) {
             char rom_title[16];
@@ -1000,11 +2452,27 @@ int main() {
                     palette[i][j] = i * 4 + j;
                 }
         //palette[i][j] = convertRGB565toRGB222(palette16[i][j]);
+        graphics_set_palette(OSD_COLOR_FG, RGB565_TO_RGB888(0xFFFF));
+        graphics_set_palette(OSD_COLOR_BG, RGB565_TO_RGB888(0x0000));
 
         gb_init_lcd(&gb, &lcd_draw_line);
+        /* Lines are drawn straight into the back buffer as graphics palette entries. */
+        gb_init_lcd_framebuffer(&gb, &SCREEN[draw_buffer_index][0][0], palette);
+        /* Core1 draws the lines while core0 runs the next ones. */
+        gb_init_lcd_queue(&gb, &lcd_queue_line, &lcd_wait_lines);
         /* Load Save File. */
         read_cart_ram_file(&gb);
+        /* Save states in the buffer belong to the previous game. */
+        state_buffer_slot = -1;
+        state_length = state_written = 0;
+#if REWIND_BUFFER_SIZE
+        rewind_reset();
+#endif
 
+        uint8_t frames = 0, frames_skipped = 0;
+        uint32_t idle_cycles = 0, frame_cycles = 0;
+        uint32_t last_underruns = i2s_dma_underruns(&i2s_config);
+        uint64_t frame_deadline = time_us_64();
         //=============================================================================
         while (!restart) {
             //------------------------------------------------------------------------------
@@ -1025,6 +2493,7 @@ int main() {
             gb.direct.joypad_bits.b = !gamepad_bits.b;
             gb.direct.joypad_bits.select = !gamepad_bits.select;
             gb.direct.joypad_bits.start = !gamepad_bits.start;
+            gb.direct.idle_skip = idle_skip;
 
             //gb.direct.joypad = nespad_state;
             //------------------------------------------------------------------------------
@@ -1066,15 +2535,53 @@ int main() {
                 save();
             }
 
+#if REWIND_BUFFER_SIZE
+            rewind_input(rewindPressed || (nespad_state & DPAD_Y) != 0);
+#endif
+
             //-----------------------------------------------------------------
+            const uint64_t frame_start = time_us_64();
             gb_run_frame(&gb);
 
             //gb.direct.interlace = 1;
 
-            if (!gb.direct.frame_skip) {
-                audio_callback(NULL, reinterpret_cast<int16_t *>(stream), AUDIO_BUFFER_SIZE_BYTES);
-                i2s_dma_write(&i2s_config, reinterpret_cast<const int16_t *>(stream));
+            audio_end_frame();
+            const uint32_t frame_us = time_us_64() - frame_start;
+            const uint32_t underruns = i2s_dma_underruns(&i2s_config);
+            const bool audio_starved = underruns != last_underruns;
+            last_underruns = underruns;
+            /* Battery saves go out a sector per frame once the game stops dirtying new ones. */
+            if (save_dirty_us && time_us_64() - save_dirty_us > SAVE_FLUSH_QUIET_US) {
+                if (!write_cart_ram_file(&gb, false))
+                    save_dirty_us = 0;
+            }
+            /* Otherwise a save state snapshot goes out a few KB per frame. */
+            else {
+                write_state_file(STATE_WRITE_BYTES);
+            }
+            /* Emulation keeps to the Game Boy frame rate by the clock, and the resampler steers the
+             * audio ring around whatever drift that leaves. A frame more than two behind is not caught up. */
+            frame_deadline += FRAME_BUDGET_US;
+            if (time_us_64() > frame_deadline + 2 * FRAME_BUDGET_US)
+                frame_deadline = time_us_64();
+#if REWIND_BUFFER_SIZE
+            rewind_frame_end(frame_deadline);
+#endif
+            while (time_us_64() < frame_deadline || audio_frames_pending() > AUDIO_FRAMES_AHEAD)
+                tight_loop_contents();
+
+            frames_skipped += gb.direct.skip_frame;
+            /* Idle cycles are CPU cycles, twice as many per frame at double speed. */
+            idle_cycles += gb.counter.idle_cycles >> gb.cgb.doubleSpeed;
+            frame_cycles += gb.counter.frame_cycles;
+            if (++frames == 60) {
+                osd_drawn = frames - frames_skipped;
+                osd_skipped = frames_skipped;
+                osd_idle = frame_cycles ? MIN(99, (uint64_t)idle_cycles * 100 / frame_cycles) : 0;
+                frames = frames_skipped = 0;
+                idle_cycles = frame_cycles = 0;
             }
+            gb.direct.skip_frame = frame_skip_next(frame_us, audio_starved);
         }
         restart = false;
     }
@@ -0,0 +1,411 @@
+/**
+ * Host benchmark for the emulator core. Each table runs every ROM for a number of frames in each
+ * column's build of the core, and shows millions of Game Boy instructions per second, with the
+ * geometric mean speedup over the first column underneath. Host figures are no substitute for
+ * timing on a Pico, but they show what a change does to the interpreter.
+ *
+ * Usage: bench [-f frames] [-r runs] [-t table] rom...
+ */
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "bench.h"
+
+BENCH_DECLARE_VARIANT(switch_dispatch)
+BENCH_DECLARE_VARIANT(per_instruction)
+BENCH_DECLARE_VARIANT(switch_ic512)
+BENCH_DECLARE_VARIANT(switch_ic2048)
+BENCH_DECLARE_VARIANT(threaded_dispatch)
+BENCH_DECLARE_VARIANT(threaded_ic2048)
+BENCH_DECLARE_VARIANT(switch_rom_cache)
+
+typedef struct {
+    const char* label;
+    bench_result_t (*run)(const bench_options_t* options);
+    bool callbacks;
+} bench_column_t;
+
+typedef struct {
+    const char* name;
+    const char* title;
+    std::vector<bench_column_t> columns;
+    /* Follow each figure with the instruction cache hit rate, and list the fetch counts after. */
+    bool icache;
+} bench_table_t;
+
+static const bench_table_t tables[] = {
+    {
+        "map", "memory map",
+        {
+            /* ROM and cart RAM through the callbacks, as before the memory map. WRAM and VRAM
+             * are mapped either way. */
+            { "callbacks", switch_dispatch::run, true },
+            { "map", switch_dispatch::run, false },
+        },
+        false
+    },
+    {
+        /* Catching up after every instruction is how the core kept time before the scheduler,
+         * so the state has to come out the same. */
+        "schedule", "timers and LCD caught up after every instruction against only when an event is due",
+        {
+            { "per-instr", per_instruction::run, false },
+            { "events", switch_dispatch::run, false },
+        },
+        false
+    },
+    {
+        /* The host reads ROM from RAM, so this shows the cost of the lookup more than the XIP
+         * misses it saves on a Pico. The hit rate carries over. */
+        "icache", "instruction cache, hit rate of all fetches",
+        {
+            { "off", switch_dispatch::run, false },
+            { "512", switch_ic512::run, false },
+            { "2048", switch_ic2048::run, false },
+        },
+        true
+    },
+    {
+        "dispatch", "switch against threaded dispatch, without and with the 2048 entry instruction cache",
+        {
+            { "switch", switch_dispatch::run, false },
+            { "threaded", threaded_dispatch::run, false },
+            { "sw+icache", switch_ic2048::run, false },
+            { "thr+icache", threaded_ic2048::run, false },
+        },
+        false
+    },
+};
+
+typedef struct {
+    const char* name;
+    std::vector<uint8_t> data;
+    bench_result_t counted;
+} bench_rom_t;
+
+/* Switchable slot counts for the ROM bank cache table, up to the RP2350's 10. */
+static const int rom_cache_slots[] = { 1, 2, 4, 8, 10 };
+
+static bool read_rom(const char* path, std::vector<uint8_t>& rom) {
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    rom.resize(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    const bool ok = !rom.empty() && fread(rom.data(), 1, rom.size(), file) == rom.size();
+    fclose(file);
+    return ok;
+}
+
+/**
+ * Prints one table, and returns false if any build ended in a different state from the count.
+ */
+static bool run_table(const bench_table_t& table, const std::vector<bench_rom_t>& roms, bench_options_t options) {
+    const int width = table.icache ? 16 : 10;
+    std::vector<std::vector<bench_result_t>> results(roms.size());
+    bool same_state = true;
+
+    printf("\n%s\n%-16s %9s", table.title, "rom", "Minstr");
+    for (const auto& column : table.columns)
+        printf(" %*s", width, column.label);
+    printf("\n");
+
+    std::vector<double> log_speedup(table.columns.size());
+    for (size_t r = 0; r < roms.size(); r++) {
+        const bench_rom_t& rom = roms[r];
+        options.rom = rom.data.data();
+        options.size = rom.data.size();
+        printf("%-16s %9.1f", rom.name, rom.counted.instructions / 1e6);
+
+        double first = 0;
+        for (size_t c = 0; c < table.columns.size(); c++) {
+            options.callbacks = table.columns[c].callbacks;
+            const bench_result_t result = table.columns[c].run(&options);
+            const double mips = rom.counted.instructions / result.seconds / 1e6;
+            /* Every build has to end up in the same state. */
+            const bool same = result.hash == rom.counted.hash;
+            same_state &= same;
+            results[r].push_back(result);
+
+            if (table.icache) {
+                const uint64_t fetches = result.icache_hits + result.icache_misses + result.icache_bypass;
+                if (fetches)
+                    printf(" %9.1f %5.1f%%", mips, 100.0 * result.icache_hits / fetches);
+                else
+                    printf(" %9.1f %6s", mips, "-");
+            }
+            else {
+                printf(" %9.1f", mips);
+            }
+            printf("%c", same ? ' ' : '!');
+
+            if (c == 0)
+                first = mips;
+            log_speedup[c] += log(mips / first);
+        }
+        printf("\n");
+    }
+
+    printf("%-16s %9s", "geomean", "");
+    for (size_t c = 0; c < table.columns.size(); c++)
+        printf(" %*.2fx", width - 1, exp(log_speedup[c] / roms.size()));
+    printf("\n");
+
+    if (table.icache) {
+        printf("\nthousands of fetches, hits/misses/bypass\n%-16s", "rom");
+        for (const auto& column : table.columns)
+            printf(" %20s", column.label);
+        printf("\n");
+        for (size_t r = 0; r < roms.size(); r++) {
+            printf("%-16s", roms[r].name);
+            for (const auto& result : results[r]) {
+                char counts[64];
+                snprintf(counts, sizeof(counts), "%llu/%llu/%llu", (unsigned long long)result.icache_hits / 1000,
+                         (unsigned long long)result.icache_misses / 1000, (unsigned long long)result.icache_bypass / 1000);
+                printf(" %20s", result.icache_hits + result.icache_misses + result.icache_bypass ? counts : "-");
+            }
+            printf("\n");
+        }
+    }
+    return same_state;
+}
+
+/**
+ * Replays the banks selected into the switchable ROM window the way the core's ROM bank cache
+ * handles them: bank 0 has a slot of its own, and a miss replaces the least recently selected of
+ * the switchable slots.
+ */
+static void replay_rom_cache(const std::vector<uint16_t>& banks, const int slots, uint64_t& hits, uint64_t& misses) {
+    std::vector<int> slot_bank(slots, -1);
+    std::vector<uint64_t> last_used(slots, 0);
+    uint64_t tick = 0;
+
+    hits = misses = 0;
+    for (const uint16_t bank : banks) {
+        if (bank == 0)
+            continue;
+
+        tick++;
+        int victim = 0;
+        bool hit = false;
+        for (int i = 0; i < slots && !hit; i++) {
+            if (slot_bank[i] == bank) {
+                last_used[i] = tick;
+                hit = true;
+            }
+            else if (last_used[i] < last_used[victim]) {
+                victim = i;
+            }
+        }
+
+        if (hit) {
+            hits++;
+        }
+        else {
+            misses++;
+            slot_bank[victim] = bank;
+            last_used[victim] = tick;
+        }
+    }
+}
+
+/**
+ * Prints the ROM bank cache hits and misses for the bank switches recorded by the count, at several
+ * slot counts, and checks them against the core's own counters. Returns false if the core ended in
+ * a different state or counted differently.
+ */
+static bool run_rom_cache(const std::vector<bench_rom_t>& roms, bench_options_t options) {
+    bool same = true;
+
+    printf("\nROM bank cache, hits/misses by switchable slots\n%-16s %9s", "rom", "switches");
+    for (const int slots : rom_cache_slots)
+        printf(" %12d ", slots);
+    printf("\n");
+
+    for (const auto& rom : roms) {
+        options.rom = rom.data.data();
+        options.size = rom.data.size();
+        options.callbacks = false;
+        printf("%-16s %9zu", rom.name, rom.counted.banks.size() - 1);
+
+        for (const int slots : rom_cache_slots) {
+            uint64_t hits, misses;
+            replay_rom_cache(rom.counted.banks, slots, hits, misses);
+
+            options.rom_cache_slots = slots;
+            const bench_result_t result = switch_rom_cache::run(&options);
+            const bool agree = result.hash == rom.counted.hash &&
+                               result.rom_cache_hits == hits && result.rom_cache_misses == misses;
+            same &= agree;
+
+            char counts[64];
+            snprintf(counts, sizeof(counts), "%llu/%llu", (unsigned long long)hits, (unsigned long long)misses);
+            printf(" %12s%c", counts, agree ? ' ' : '!');
+        }
+        printf("\n");
+    }
+    return same;
+}
+
+/**
+ * Prints the time per frame on the emulating thread with sound synthesised after each frame, as
+ * core0 did before synthesis moved to core1, and with it on a second thread. Uses the firmware's
+ * build of the core. Returns false if a run ended in a different state from the count.
+ */
+static bool run_audio(const std::vector<bench_rom_t>& roms, bench_options_t options) {
+    /* With one CPU the threads take turns, and the emulation spins on a full event ring. */
+    const bool threads = std::thread::hardware_concurrency() > 1;
+    bool same = true;
+
+    printf("\nsound synthesis, microseconds per frame on the emulating thread\n%-16s %9s %10s %10s %10s %10s\n",
+           "rom", "", "emulate", "synthesis", "inline", "threaded");
+
+    for (const auto& rom : roms) {
+        options.rom = rom.data.data();
+        options.size = rom.data.size();
+        options.callbacks = false;
+
+        options.audio_thread = false;
+        const bench_result_t inline_result = threaded_ic2048::run(&options);
+        bool agree = inline_result.hash == rom.counted.hash;
+
+        const double us = 1e6 / options.frames;
+        printf("%-16s %9s %10.1f %10.1f %10.1f", rom.name, "",
+               (inline_result.seconds - inline_result.synthesis_seconds) * us, inline_result.synthesis_seconds * us,
+               inline_result.seconds * us);
+        if (threads) {
+            options.audio_thread = true;
+            const bench_result_t thread_result = threaded_ic2048::run(&options);
+            agree &= thread_result.hash == rom.counted.hash;
+            printf(" %10.1f", (thread_result.seconds - thread_result.wait_seconds) * us);
+        }
+        else {
+            printf(" %10s", "-");
+        }
+        printf("%c\n", agree ? ' ' : '!');
+        same &= agree;
+    }
+
+    if (!threads)
+        printf("one CPU, so no threaded runs\n");
+    return same;
+}
+
+/**
+ * Prints the time per frame with lines drawn as they are reached, and with them queued and drawn
+ * later as core1 does, which the core has to wait for before VRAM or OAM change. With one thread the
+ * queued lines are drawn at the wait, so every wait that finds lines queued is a stall, where on the
+ * Pico it is one only if core1 is still behind. Uses the firmware's build of the core. Returns false
+ * if a run ended in a different state from the count.
+ */
+static bool run_lines(const std::vector<bench_rom_t>& roms, bench_options_t options) {
+    bool same = true;
+
+    printf("\nline queue, microseconds per frame, and waits and stalls per frame\n%-16s %9s %10s %10s %10s %10s\n",
+           "rom", "", "direct", "queued", "waits", "stalls");
+
+    for (const auto& rom : roms) {
+        options.rom = rom.data.data();
+        options.size = rom.data.size();
+        options.callbacks = false;
+
+        options.line_queue = false;
+        const bench_result_t direct = threaded_dispatch::run(&options);
+        options.line_queue = true;
+        const bench_result_t queued = threaded_dispatch::run(&options);
+        const bool agree = direct.hash == rom.counted.hash && queued.hash == rom.counted.hash;
+        same &= agree;
+
+        const double us = 1e6 / options.frames;
+        printf("%-16s %9s %10.1f %10.1f %10.1f %10.1f%c\n", rom.name, "", direct.seconds * us, queued.seconds * us,
+               (double)queued.line_waits / options.frames, (double)queued.line_stalls / options.frames,
+               agree ? ' ' : '!');
+    }
+    return same;
+}
+
+static int usage(const char* name) {
+    fprintf(stderr, "usage: %s [-f frames] [-r runs] [-t table] rom...\ntables:", name);
+    for (const auto& table : tables)
+        fprintf(stderr, " %s", table.name);
+    fprintf(stderr, " romcache audio lines\n");
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    bench_options_t options = {};
+    options.frames = 3000;
+    options.runs = 3;
+    const char* only = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:r:t:")) != -1) {
+        switch (opt) {
+            case 'f':
+                options.frames = atoi(optarg);
+                break;
+            case 'r':
+                options.runs = atoi(optarg);
+                break;
+            case 't':
+                only = optarg;
+                break;
+            default:
+                return usage(argv[0]);
+        }
+    }
+    if (optind == argc || options.frames < 1 || options.runs < 1)
+        return usage(argv[0]);
+
+    std::vector<bench_rom_t> roms(argc - optind);
+    for (int i = optind; i < argc; i++) {
+        bench_rom_t& rom = roms[i - optind];
+        if (!read_rom(argv[i], rom.data)) {
+            fprintf(stderr, "cannot read %s\n", argv[i]);
+            return 1;
+        }
+        rom.name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+
+        /* Instructions are counted once, on the reference build. */
+        options.rom = rom.data.data();
+        options.size = rom.data.size();
+        options.callbacks = false;
+        rom.counted = switch_dispatch::count(&options);
+    }
+
+    printf("%d frames, best of %d runs, millions of instructions per second\n", options.frames, options.runs);
+
+    bool same_state = true;
+    bool found = false;
+    for (const auto& table : tables) {
+        if (only != nullptr && strcmp(only, table.name) != 0)
+            continue;
+        found = true;
+        same_state &= run_table(table, roms, options);
+    }
+    if (only == nullptr || strcmp(only, "romcache") == 0) {
+        found = true;
+        same_state &= run_rom_cache(roms, options);
+    }
+    if (only == nullptr || strcmp(only, "audio") == 0) {
+        found = true;
+        same_state &= run_audio(roms, options);
+    }
+    if (only == nullptr || strcmp(only, "lines") == 0) {
+        found = true;
+        same_state &= run_lines(roms, options);
+    }
+    if (!found)
+        return usage(argv[0]);
+
+    if (!same_state)
+        printf("! ended in a different state from the switch build\n");
+    return same_state ? 0 : 1;
+}
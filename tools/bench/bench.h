@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+typedef struct {
+    const uint8_t* rom;
+    size_t size;
+    int frames;
+    /* Timed runs, of which the fastest counts. */
+    int runs;
+    /* ROM and cart RAM go through the callbacks instead of the memory map. */
+    bool callbacks;
+    /* Switchable slots of the ROM bank cache, in builds with it. Zero leaves it off. */
+    int rom_cache_slots;
+    /* Synthesise sound on a second thread, as core1 does, instead of after each frame. */
+    bool audio_thread;
+    /* Queue lines to be drawn later, as core0 hands them to core1, instead of drawing them. */
+    bool line_queue;
+} bench_options_t;
+
+typedef struct {
+    double seconds;
+    /* Of the fastest run, the time spent synthesising sound on the emulating thread, and waiting for
+     * the synthesis thread to catch up. */
+    double synthesis_seconds;
+    double wait_seconds;
+    /* Instructions executed, only counted by count(). */
+    uint64_t instructions;
+    /* Of the screen and memory after the last frame, the same in every build. */
+    uint64_t hash;
+    /* Instruction cache fetches in the last run, zero in builds without it. */
+    uint64_t icache_hits;
+    uint64_t icache_misses;
+    uint64_t icache_bypass;
+    /* ROM bank cache selections in the last run, zero in builds without it. */
+    uint64_t rom_cache_hits;
+    uint64_t rom_cache_misses;
+    /* Calls to the line queue's wait hook in the last run, and those that found lines queued. */
+    uint64_t line_waits;
+    uint64_t line_stalls;
+    /* Banks in the switchable ROM window, a new entry each time it changes. Only kept by count(). */
+    std::vector<uint16_t> banks;
+} bench_result_t;
+
+/*
+ * Each build of the core is compiled from bench_variant.cpp into its own namespace, and provides
+ * these. count() steps one instruction at a time, so only builds with switch dispatch have it.
+ */
+#define BENCH_DECLARE_VARIANT(name)                                   \
+    namespace name {                                                  \
+        bench_result_t run(const bench_options_t* options);           \
+        bench_result_t count(const bench_options_t* options);         \
+    }
@@ -0,0 +1,232 @@
+/**
+ * One build of the core for the benchmark. CMake compiles this once per variant, with that
+ * variant's configuration, into the namespace BENCH_VARIANT.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+#include "graphics.h"
+#include "pico/runtime.h"
+#include "minigb_apu.h"
+#include "bench.h"
+
+#define ENABLE_LCD 1
+#define ENABLE_SOUND 1
+
+namespace BENCH_VARIANT {
+#include "peanut_gb.h"
+
+static const bench_options_t* options;
+static gb_s gb;
+static uint8_t cart_ram[0x20000];
+static uint8_t screen[LCD_HEIGHT][LCD_WIDTH];
+static int16_t stream[AUDIO_SAMPLES * 2];
+/* Frames the emulation may run ahead of the synthesis thread, as in the firmware. */
+#define AUDIO_FRAMES_AHEAD 2
+#if PEANUT_GB_ROM_BANK_CACHE
+static uint8_t rom_bank_slots[PEANUT_GB_ROM_BANK_CACHE + 1][ROM_BANK_SIZE];
+#endif
+/* Lines queued as the firmware queues them for core1, drawn when the core waits for them and at the
+ * end of each frame. */
+#define LINE_RING_SIZE 16
+static gb_line_s line_ring[LINE_RING_SIZE];
+static uint32_t line_head, line_tail;
+static uint64_t line_waits, line_stalls;
+
+static uint8_t rom_read(gb_s*, const uint_fast32_t addr) {
+    return options->rom[addr % options->size];
+}
+
+static uint8_t cart_ram_read(gb_s*, const uint_fast32_t addr) {
+    return cart_ram[addr % sizeof(cart_ram)];
+}
+
+static void cart_ram_write(gb_s*, const uint_fast32_t addr, const uint8_t val) {
+    cart_ram[addr % sizeof(cart_ram)] = val;
+}
+
+static void error(gb_s*, const enum gb_error_e error, const uint16_t addr) {
+    fprintf(stderr, "gb_error %d at %04X\n", error, addr);
+    exit(2);
+}
+
+static void draw_queued_lines() {
+    while (line_tail != line_head)
+        gb_render_line(&gb, &line_ring[line_tail++ % LINE_RING_SIZE]);
+}
+
+static void queue_line(gb_s*, const gb_line_s* line) {
+    if (line_head - line_tail == LINE_RING_SIZE)
+        gb_render_line(&gb, &line_ring[line_tail++ % LINE_RING_SIZE]);
+    line_ring[line_head++ % LINE_RING_SIZE] = *line;
+}
+
+static void wait_lines(gb_s*) {
+    line_waits++;
+    if (line_tail != line_head) {
+        line_stalls++;
+        draw_queued_lines();
+    }
+}
+
+static void start() {
+    /* gb_init() leaves memory as it was, so every run starts from a clean context. */
+    memset(&gb, 0, sizeof(gb));
+    memset(cart_ram, 0, sizeof(cart_ram));
+    memset(screen, 0, sizeof(screen));
+    audio_init();
+    if (gb_init(&gb, rom_read, cart_ram_read, cart_ram_write, error, nullptr) != GB_INIT_NO_ERROR) {
+        fprintf(stderr, "gb_init failed\n");
+        exit(2);
+    }
+    gb_init_lcd(&gb, nullptr);
+    gb_init_lcd_framebuffer(&gb, &screen[0][0], nullptr);
+    if (!options->callbacks)
+        gb_init_memory_map(&gb, options->rom, cart_ram);
+    line_head = line_tail = 0;
+    line_waits = line_stalls = 0;
+    if (options->line_queue)
+        gb_init_lcd_queue(&gb, queue_line, wait_lines);
+#if PEANUT_GB_ROM_BANK_CACHE
+    if (options->rom_cache_slots)
+        gb_init_rom_bank_cache(&gb, &rom_bank_slots[0][0], options->rom_cache_slots + 1, nullptr);
+#endif
+}
+
+/**
+ * The bank in the switchable ROM window, as __gb_map_rom() works it out.
+ */
+static uint16_t mapped_bank() {
+    uint16_t bank = gb.selected_rom_bank;
+    if (gb.mbc == 1 && gb.cart_mode_select)
+        bank &= 0x1F;
+    return bank;
+}
+
+/**
+ * Ends a frame, and returns the time spent on sound after the emulation, synthesising it or waiting
+ * for the thread doing that.
+ */
+static double end_frame() {
+    draw_queued_lines();
+    const auto begin = std::chrono::steady_clock::now();
+    audio_end_frame();
+    if (options->audio_thread) {
+        while (audio_frames_pending() > AUDIO_FRAMES_AHEAD)
+            std::this_thread::yield();
+    }
+    else {
+        audio_callback(nullptr, stream, sizeof(stream));
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+/**
+ * Core1's sound loop, until stop is set and every frame is done.
+ */
+static void synthesis_thread(const std::atomic<bool>* stop) {
+    static int16_t thread_stream[AUDIO_SAMPLES * 2];
+    while (!stop->load(std::memory_order_acquire) || audio_frames_pending()) {
+        audio_synthesise();
+        if (audio_frames_pending())
+            audio_callback(nullptr, thread_stream, sizeof(thread_stream));
+        else
+            std::this_thread::yield();
+    }
+}
+
+static uint64_t hash() {
+    uint64_t h = 1469598103934665603ull;
+    auto add = [&h](const void* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            h ^= ((const uint8_t *)data)[i];
+            h *= 1099511628211ull;
+        }
+    };
+    add(screen, sizeof(screen));
+    add(gb.wram, sizeof(gb.wram));
+    add(gb.vram, sizeof(gb.vram));
+    add(gb.oam, sizeof(gb.oam));
+    add(gb.hram_io, sizeof(gb.hram_io));
+    add(cart_ram, sizeof(cart_ram));
+    return h;
+}
+
+bench_result_t run(const bench_options_t* bench_options) {
+    bench_result_t result = {};
+    options = bench_options;
+
+    for (int run = 0; run < options->runs; run++) {
+        start();
+        std::atomic<bool> stop(false);
+        std::thread synthesis;
+        if (options->audio_thread)
+            synthesis = std::thread(synthesis_thread, &stop);
+
+        double sound_seconds = 0;
+        const auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < options->frames; i++) {
+            gb_run_frame(&gb);
+            sound_seconds += end_frame();
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        if (options->audio_thread) {
+            stop.store(true, std::memory_order_release);
+            synthesis.join();
+        }
+
+        if (run == 0 || seconds < result.seconds) {
+            result.seconds = seconds;
+            result.synthesis_seconds = options->audio_thread ? 0 : sound_seconds;
+            result.wait_seconds = options->audio_thread ? sound_seconds : 0;
+        }
+        result.hash = hash();
+        result.line_waits = line_waits;
+        result.line_stalls = line_stalls;
+#if PEANUT_GB_ICACHE_SIZE && PEANUT_GB_ICACHE_STATS
+        result.icache_hits = gb.icache.hits;
+        result.icache_misses = gb.icache.misses;
+        result.icache_bypass = gb.icache.bypass;
+#endif
+#if PEANUT_GB_ROM_BANK_CACHE
+        result.rom_cache_hits = gb.rom_cache.hits;
+        result.rom_cache_misses = gb.rom_cache.misses;
+#endif
+    }
+    return result;
+}
+
+bench_result_t count(const bench_options_t* bench_options) {
+    bench_result_t result = {};
+    options = bench_options;
+
+#if PEANUT_GB_THREADED_DISPATCH
+    fprintf(stderr, "count() needs switch dispatch\n");
+    exit(2);
+#endif
+    start();
+    result.banks.push_back(mapped_bank());
+    for (int i = 0; i < options->frames; i++) {
+        /* gb_run_frame(), one instruction at a time. */
+        gb.gb_frame = 0;
+        gb.counter.idle_cycles = 0;
+        gb.counter.frame_cycles = 0;
+        while (!gb.gb_frame) {
+            __gb_step_cpu(&gb);
+            result.instructions++;
+            if (mapped_bank() != result.banks.back())
+                result.banks.push_back(mapped_bank());
+        }
+        end_frame();
+    }
+    result.hash = hash();
+    return result;
+}
+}
@@ -0,0 +1,322 @@
+#!/usr/bin/env python3
+"""Generate the synthetic, deterministic Game Boy ROMs the benchmark is run on.
+
+Usage: genrom.py <directory>
+
+The ROMs are random instruction mixes around the patterns games spend their
+time in: HALT, LY and STAT polling, bank switching, cart RAM, CGB VRAM and
+WRAM banking, HDMA, timers, serial and sound. They are not real games, so absolute
+figures differ from commercial ROMs, but they are the same for everyone.
+"""
+import os, random, sys
+
+class Asm:
+    def __init__(self, size):
+        self.rom = bytearray([0x00] * size)
+        self.pc = 0
+        self.labels = {}
+        self.fix = []  # (pos, label, kind)
+    def org(self, a): self.pc = a
+    def b(self, *bs):
+        for x in bs:
+            self.rom[self.pc] = x & 0xFF; self.pc += 1
+    def w(self, v): self.b(v & 0xFF, v >> 8)
+    def label(self, n): self.labels[n] = self.pc
+    def jp(self, n, op=0xC3):
+        self.b(op); self.fix.append((self.pc, n, 'abs')); self.w(0)
+    def call(self, n, op=0xCD): self.jp(n, op)
+    def jr(self, n, op=0x18):
+        self.b(op); self.fix.append((self.pc, n, 'rel')); self.b(0)
+    def ld_hl(self, v): self.b(0x21); self.w(v)
+    def ld_a(self, v): self.b(0x3E, v)
+    def ldh_w(self, io, v): self.ld_a(v); self.b(0xE0, io)
+    def resolve(self, base=0):
+        for pos, n, kind in self.fix:
+            t = self.labels[n]
+            if kind == 'abs':
+                self.rom[pos] = t & 0xFF; self.rom[pos + 1] = (t >> 8) & 0xFF
+            else:
+                d = t - (pos + 1)
+                assert -128 <= d <= 127, (n, d)
+                self.rom[pos] = d & 0xFF
+
+REG = [0, 1, 2, 3, 4, 5, 7]  # B C D E H L A (6 = (HL))
+
+def rand_block(a, rng, n, allow_hl_mem=True, wram_hi=0xC0, wram_span=0x10):
+    """Emit n random side-effect-safe instructions."""
+    def fix_h():
+        a.b(0x26, wram_hi + rng.randrange(wram_span))  # LD H, n
+    for _ in range(n):
+        k = rng.randrange(22)
+        if k == 0:  # LD r,r'
+            d = rng.choice([0, 1, 2, 3, 5, 7]); s = rng.choice(REG)
+            a.b(0x40 | (d << 3) | s)
+        elif k == 1:  # LD r,n
+            d = rng.choice([0, 1, 2, 3, 5, 7]); a.b(0x06 | (d << 3), rng.randrange(256))
+        elif k == 2:  # ALU A,r
+            a.b(0x80 | (rng.randrange(8) << 3) | rng.choice(REG))
+        elif k == 3:  # ALU A,n
+            a.b(0xC6 | (rng.randrange(8) << 3), rng.randrange(256))
+        elif k == 4 and allow_hl_mem:  # ALU A,(HL)
+            fix_h(); a.b(0x86 | (rng.randrange(8) << 3))
+        elif k == 5:  # INC/DEC r
+            d = rng.choice([0, 1, 2, 3, 5, 7]); a.b((0x04 if rng.random() < .5 else 0x05) | (d << 3))
+        elif k == 6:  # INC/DEC rr (BC, DE)
+            a.b(rng.choice([0x03, 0x0B, 0x13, 0x1B]))
+        elif k == 7:  # rotates, DAA, CPL, SCF, CCF
+            a.b(rng.choice([0x07, 0x0F, 0x17, 0x1F, 0x27, 0x2F, 0x37, 0x3F]))
+        elif k == 8:  # CB on reg
+            a.b(0xCB, (rng.randrange(256) & 0xF8) | rng.choice([0, 1, 2, 3, 5, 7]))
+        elif k == 9 and allow_hl_mem:  # CB on (HL)
+            fix_h(); a.b(0xCB, (rng.randrange(256) & 0xF8) | 6)
+        elif k == 10 and allow_hl_mem:  # LD (HL),r / LD r,(HL) / INC (HL)
+            fix_h()
+            c = rng.randrange(4)
+            if c == 0: a.b(0x70 | rng.choice([0, 1, 2, 3, 5, 7]))
+            elif c == 1: a.b(0x46 | (rng.choice([0, 1, 2, 3, 7]) << 3))
+            elif c == 2: a.b(rng.choice([0x34, 0x35]))
+            else: a.b(0x36, rng.randrange(256))
+        elif k == 11:  # LD A,(BC)/(DE) any address read
+            a.b(rng.choice([0x0A, 0x1A]))
+        elif k == 12:  # LD (nn),A into WRAM / LD A,(nn)
+            addr = 0xC000 + rng.randrange(0x1000)
+            a.b(rng.choice([0xEA, 0xFA])); a.w(addr)
+        elif k == 13:  # LDH (n),A HRAM / LDH A,(n) anywhere in IO
+            if rng.random() < .5:
+                a.b(0xE0, 0x80 + rng.randrange(0x60))
+            else:
+                a.b(0xF0, rng.choice([0x04, 0x05, 0x41, 0x44, 0x00, 0x0F, 0x80 + rng.randrange(0x70), 0x10 + rng.randrange(0x30)]))
+        elif k == 14:  # PUSH/POP pair
+            p = rng.choice([0xC5, 0xD5, 0xE5, 0xF5]); q = rng.choice([0xC1, 0xD1, 0xF1])
+            a.b(p, q)
+        elif k == 15:  # ADD HL,rr ; LD HL,SP+n ; INC/DEC HL
+            a.b(rng.choice([0x09, 0x19, 0x29, 0x39, 0x23, 0x2B]))
+        elif k == 16:
+            a.b(0xF8, rng.randrange(256))
+        elif k == 17:  # ADD SP,n then undo
+            n = rng.randrange(-8, 0)
+            a.b(0xE8, n & 0xFF, 0xE8, (-n) & 0xFF)
+        elif k == 18 and allow_hl_mem:  # LDI/LDD
+            fix_h(); a.b(rng.choice([0x22, 0x2A, 0x32, 0x3A]))
+        elif k == 19:  # LD A,(C) / LD BC,nn / LD DE,nn
+            c = rng.randrange(3)
+            if c == 0: a.b(0xF2)
+            elif c == 1: a.b(0x01); a.w(rng.randrange(0x10000))
+            else: a.b(0x11); a.w(rng.randrange(0x10000))
+        elif k == 20:  # conditional JR over a NOP/INC
+            a.b(rng.choice([0x20, 0x28, 0x30, 0x38]), 1, rng.choice([0x00, 0x3C, 0x04, 0x0C]))
+        else:
+            a.b(0x00)
+
+def header(a, title, cgb, cart, romsz, ramsz):
+    a.org(0x100); a.b(0x00); a.jp('main')
+    t = title.encode()[:11]
+    for i, c in enumerate(t): a.rom[0x134 + i] = c
+    a.rom[0x143] = cgb; a.rom[0x147] = cart; a.rom[0x148] = romsz; a.rom[0x149] = ramsz
+    x = 0
+    for i in range(0x134, 0x14D): x = (x - a.rom[i] - 1) & 0xFF
+    a.rom[0x14D] = x
+
+def build(seed, cgb=False, mbc=0, banks=2, extra=False, sound=False):
+    rng = random.Random(seed)
+    size = banks * 0x4000
+    a = Asm(size)
+    cart = {0: 0x00, 1: 0x03, 3: 0x13, 5: 0x1B}[mbc]
+    romsz = {2: 0, 4: 1, 8: 2, 16: 3, 32: 4}[banks]
+    ramsz = 0 if mbc == 0 else 3
+    # interrupt vectors
+    a.org(0x40); a.jp('vblank')
+    a.org(0x48); a.jp('stat')
+    a.org(0x50); a.jp('timer')
+    a.org(0x58); a.b(0xD9)
+    a.org(0x60); a.b(0xD9)
+    for i, v in enumerate([0x08, 0x10, 0x18, 0x20, 0x28, 0x30, 0x38]):
+        a.org(v); a.b(0x3C, 0x0C, 0xC9)  # INC A ; INC C ; RET
+    a.org(0x150)
+    a.label('main')
+    a.b(0xF3, 0x31); a.w(0xFFFE)  # DI ; LD SP
+    # LCD off
+    a.ldh_w(0x40, 0x00)
+    # fill VRAM tiles 8000-97FF with pseudo pattern (LD HL; loop)
+    a.ld_hl(0x8000); a.b(0x01); a.w(0x1800)  # BC = count
+    a.ld_a(rng.randrange(256))
+    a.label('fill1')
+    a.b(0x22)               # LD (HL+),A
+    a.b(0xC6, 0x3D)         # ADD A,0x3D
+    a.b(0x0F)               # RRCA
+    a.b(0x0B)               # DEC BC
+    a.b(0x57)               # LD D,A
+    a.b(0x78, 0xB1)         # LD A,B ; OR C
+    a.b(0x7A)               # LD A,D
+    a.jr('fill1', 0x20)
+    # fill maps 9800-9FFF with index pattern
+    a.ld_hl(0x9800); a.b(0x01); a.w(0x0800)
+    a.label('fill2')
+    a.b(0x7D); a.b(0xAC)    # LD A,L ; XOR H
+    a.b(0x22); a.b(0x0B); a.b(0x78, 0xB1)
+    a.jr('fill2', 0x20)
+    if cgb:
+        # VRAM bank 1: attributes
+        a.ldh_w(0x4F, 1)
+        a.ld_hl(0x9800); a.b(0x01); a.w(0x0800)
+        a.label('fill3')
+        a.b(0x7D); a.b(0xE6, 0xEF)  # LD A,L ; AND 0xEF
+        a.b(0x22); a.b(0x0B); a.b(0x78, 0xB1)
+        a.jr('fill3', 0x20)
+        a.ld_hl(0x8000); a.b(0x01); a.w(0x1800)
+        a.label('fill4')
+        a.b(0x7D); a.b(0x2F); a.b(0x22); a.b(0x0B); a.b(0x78, 0xB1)
+        a.jr('fill4', 0x20)
+        a.ldh_w(0x4F, 0)
+        # palettes
+        a.ldh_w(0x68, 0x80)
+        for i in range(64): a.ldh_w(0x69, rng.randrange(256))
+        a.ldh_w(0x6A, 0x80)
+        for i in range(64): a.ldh_w(0x6B, rng.randrange(256))
+    # sprite table at C100
+    a.ld_hl(0xC100)
+    for i in range(40):
+        a.b(0x36, 16 + rng.randrange(150)); a.b(0x23)
+        a.b(0x36, rng.randrange(175)); a.b(0x23)
+        a.b(0x36, rng.randrange(256)); a.b(0x23)
+        a.b(0x36, rng.randrange(256) & (0xFF if cgb else 0xF0)); a.b(0x23)
+    a.ldh_w(0x46, 0xC1)
+    a.ldh_w(0x47, 0xE4); a.ldh_w(0x48, 0xD2); a.ldh_w(0x49, 0x1B)
+    a.ldh_w(0x4A, 0x50); a.ldh_w(0x4B, 0x57)
+    a.ldh_w(0x42, 0); a.ldh_w(0x43, 0)
+    a.ldh_w(0x06, 0x40); a.ldh_w(0x07, 0x05)   # TMA, TAC
+    a.ldh_w(0x45, 0x48); a.ldh_w(0x41, 0x48)   # LYC, STAT(LYC + mode0 int)
+    a.ldh_w(0x0F, 0x00); a.ldh_w(0xFF, 0x0F if extra else 0x07)   # IF, IE
+    a.ldh_w(0x40, 0xE7)   # LCD on, window, sprites 8x16, BG
+    if sound:
+        a.ldh_w(0x26, 0x80); a.ldh_w(0x24, 0x77); a.ldh_w(0x25, 0xFF)   # APU on, full volume
+        for i in range(16): a.ldh_w(0x30 + i, rng.randrange(256))      # wave RAM
+        a.ldh_w(0x10, 0x15); a.ldh_w(0x11, 0x80); a.ldh_w(0x12, 0xF3)  # square 1 with sweep
+        a.ldh_w(0x16, 0x40); a.ldh_w(0x17, 0xF4)                       # square 2
+        a.ldh_w(0x1A, 0x80); a.ldh_w(0x1C, 0x20)                       # wave
+        a.ldh_w(0x21, 0xF2); a.ldh_w(0x22, rng.randrange(256))         # noise
+    if mbc:
+        a.ld_a(0x0A); a.b(0xEA); a.w(0x0000)   # enable cart RAM
+    a.b(0xFB)   # EI
+    # main loop
+    a.label('loop')
+    for blk in range(24):
+        rand_block(a, rng, rng.randrange(10, 40))
+        c = rng.randrange(14 if extra else 8)
+        if c == 8:
+            a.b(0xE0, 0x04)                      # DIV reset
+        elif c == 9:
+            a.ldh_w(0x05, rng.randrange(256))     # TIMA
+        elif c == 10:
+            a.ldh_w(0x07, 4 | rng.randrange(4) if rng.random() < .8 else 0)  # TAC
+        elif c == 11:
+            a.ldh_w(0x01, rng.randrange(256)); a.ldh_w(0x02, rng.choice([0x80, 0x81, 0x83]))  # serial
+        elif c == 12:
+            a.ldh_w(0x40, 0x67); rand_block(a, rng, 5); a.ldh_w(0x40, 0xE7)  # LCD off/on
+        elif c == 13 and cgb:
+            a.ldh_w(0x4D, 1); a.b(0x10, 0x00)   # speed switch
+        elif c == 0:
+            a.b(0x76, 0x00)    # HALT ; NOP
+        elif c == 1:   # poll LY until value
+            a.label(f'ly{blk}')
+            a.b(0xF0, 0x44, 0xFE, rng.randrange(154)); a.jr(f'ly{blk}', 0x20)
+        elif c == 2:   # poll STAT mode
+            a.label(f'st{blk}')
+            a.b(0xF0, 0x41, 0xE6, 0x03, 0xFE, rng.randrange(4)); a.jr(f'st{blk}', 0x20)
+        elif c == 3:
+            a.call(f'sub{rng.randrange(4)}')
+        elif c == 4 and mbc:
+            bank = 1 + rng.randrange(banks - 1)
+            a.ld_a(bank); a.b(0xEA); a.w(0x2000)
+            if mbc == 5:
+                a.ld_a(0); a.b(0xEA); a.w(0x3000)
+            a.call('bankfn')
+            # cart RAM bank + write/read
+            a.ld_a(rng.randrange(4)); a.b(0xEA); a.w(0x4000)
+            a.ld_hl(0xA000 + rng.randrange(0x2000)); a.b(0x34, 0x7E, 0x23, 0x77)
+        elif c == 5 and cgb:
+            a.ld_a(1 + rng.randrange(7)); a.b(0xE0, 0x70)
+            a.ld_hl(0xD000 + rng.randrange(0x1000)); a.b(0x34, 0x86, 0x77)
+            a.ld_a(rng.randrange(2)); a.b(0xE0, 0x4F)
+            a.ld_hl(0x9800 + rng.randrange(0x800)); a.b(0x77)
+            a.ldh_w(0x4F, 0)
+        elif c == 6 and cgb:
+            # general purpose HDMA from WRAM C200 -> VRAM
+            a.ldh_w(0x51, 0xC2); a.ldh_w(0x52, 0x00)
+            a.ldh_w(0x53, 0x08 + rng.randrange(8)); a.ldh_w(0x54, 0x00)
+            a.ldh_w(0x55, rng.randrange(4) | (0x80 if rng.random() < .5 else 0))
+        elif c == 7:
+            a.ld_hl(0x8000 + rng.randrange(0x1800)); a.b(0x34)  # poke tile data
+        # frame-variable raster: bump SCX from WRAM counter
+    a.jp('loop')
+    for s in range(4):
+        a.label(f'sub{s}')
+        rand_block(a, rng, rng.randrange(5, 30))
+        a.b(0xCF | (rng.randrange(8) << 3))  # RST
+        a.b(0xC9)
+    # interrupt handlers
+    a.label('vblank')
+    a.b(0xF5, 0xE5, 0xC5)
+    a.b(0xF0, 0x90, 0x3C, 0xE0, 0x90)         # frame counter
+    if sound:   # retrigger every channel at a pitch from the counter
+        a.b(0xE0, 0x13, 0x3E, 0x86, 0xE0, 0x14)
+        a.b(0xF0, 0x90, 0x2F, 0xE0, 0x18, 0x3E, 0x87, 0xE0, 0x19)
+        a.b(0xF0, 0x90, 0x07, 0xE0, 0x1D, 0x3E, 0x85, 0xE0, 0x1E)
+        a.b(0x3E, 0x80, 0xE0, 0x23)
+        a.b(0xF0, 0x90)
+    a.b(0xE0, 0x42)                           # SCY = counter
+    a.b(0x21); a.w(0xC100)                     # move sprites
+    a.b(0x06, 40)
+    a.label('vbl1')
+    a.b(0x34, 0x23, 0x23, 0x35, 0x23, 0x23, 0x05); a.jr('vbl1', 0x20)
+    a.ldh_w(0x46, 0xC1)
+    a.b(0xF0, 0x90, 0xE6, 0x1F, 0x20, 0x05)    # every 32 frames swap BGP
+    a.b(0xF0, 0x47, 0x2F, 0xE0, 0x47)
+    a.b(0xF0, 0x90, 0xE6, 0x3F, 0x20, 0x06)
+    a.b(0xF0, 0x40, 0xEE, 0x10, 0xE0, 0x40)    # toggle tile select
+    a.b(0xC1, 0xE1, 0xF1, 0xD9)
+    a.label('stat')
+    a.b(0xF5)
+    a.b(0xF0, 0x91, 0xC6, 0x03, 0xE0, 0x91, 0xE0, 0x43)   # SCX += 3
+    if sound:
+        a.b(0xE0, 0x13, 0xE0, 0x1D)           # pitch changes mid-frame
+    a.b(0xF0, 0x45, 0xC6, 0x11, 0xFE, 0x90, 0x38, 0x02, 0x3E, 0x08, 0xE0, 0x45)
+    a.b(0xF1, 0xD9)
+    a.label('timer')
+    a.b(0xF5, 0xFA); a.w(0xC0F0); a.b(0x3C, 0xEA); a.w(0xC0F0)
+    a.b(0xF0, 0x04, 0xEA); a.w(0xC0F1)
+    a.b(0xF1, 0xD9)
+    a.labels['bankfn'] = 0x4000
+    a.resolve()
+    # banked routines: at 0x4000 of each bank
+    if mbc:
+        for bank in range(1, banks):
+            b = Asm(0x8000)
+            b.org(0x4000)
+            rand_block(b, rng, rng.randrange(20, 60))
+            b.b(0xC9)
+            a.rom[bank * 0x4000:(bank + 1) * 0x4000] = b.rom[0x4000:0x8000]
+        a.labels['bankfn'] = 0x4000
+        a.resolve()
+    else:
+        a.labels['bankfn'] = 0x4000
+    header(a, f'T{seed}{"C" if cgb else ""}{mbc}', 0x80 if cgb else 0x00, cart, romsz, ramsz)
+    a.resolve()
+    return a.rom
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+    out = sys.argv[1]
+    os.makedirs(out, exist_ok=True)
+    cfgs = [
+        ('dmg_a', dict(seed=1)), ('dmg_b', dict(seed=2)), ('dmg_c', dict(seed=3)),
+        ('mbc1', dict(seed=4, mbc=1, banks=8)), ('mbc3', dict(seed=5, mbc=3, banks=16)),
+        ('mbc5', dict(seed=6, mbc=5, banks=32)),
+        ('cgb_a', dict(seed=7, cgb=True)), ('cgb_b', dict(seed=8, cgb=True, mbc=5, banks=8)),
+        ('tim_a', dict(seed=9, extra=True)), ('tim_b', dict(seed=10, extra=True, mbc=1, banks=4)),
+        ('tim_c', dict(seed=13, cgb=True, extra=True)), ('tim_d', dict(seed=12, cgb=True, extra=True, mbc=5, banks=8)),
+        ('snd_a', dict(seed=14, sound=True)), ('snd_b', dict(seed=15, cgb=True, sound=True, mbc=5, banks=8)),
+    ]
+    for n, kw in cfgs:
+        open(f'{out}/{n}.gb', 'wb').write(build(**kw))
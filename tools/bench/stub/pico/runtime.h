@@ -0,0 +1,2 @@
+/* Stand-in for the Pico SDK header the core includes. */
+#pragma once